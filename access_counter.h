@@ -0,0 +1,122 @@
+/**
+ * @file
+ * @brief Sampled lookup counting for weighted tree rebuilds
+ *
+ * Contains a wrapper around one version of a Tree that counts how often
+ * each element is looked up, so that the version can be rebuilt with
+ * Tree::reshape_by_weights to put frequently used elements near the
+ * head. Counting is opt-in: plain Tree lookups are never counted.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Counts sampled lookups of the elements of a tree
+ *
+ * Every period'th lookup is counted against the element it finds, by
+ * position; lookups of absent values are not counted. Counting costs
+ * one extra O(log n) descent per sample.
+ *
+ * @note an AccessCounter is not safe to share between threads
+ */
+template<typename T>
+class AccessCounter
+{
+public:
+    /**
+     * @brief starts counting lookups of tree, sampling one in period
+     */
+    explicit AccessCounter(const Tree<T>& tree, size_t period = 1) :
+        m_tree(Some(tree)),
+        m_weights(tree.size(), 0.0),
+        m_period(period),
+        m_until_sample(period)
+    {
+        if (period == 0) {
+            throw std::invalid_argument("period must be at least 1");
+        }
+    };
+
+    /**
+     * @brief returns the tree being counted
+     */
+    inline const Tree<T>& tree() const { return m_tree.get_bare(); };
+
+    /**
+     * @brief returns True if val is in the tree, counting the lookup
+     */
+    bool contains(const T& val) { return find(val) != NULL; }
+
+    /**
+     * @brief returns a pointer to the element equal to val, or NULL,
+     * counting the lookup
+     *
+     * @note the pointer is valid for as long as the tree is
+     */
+    const T* find(const T& val) {
+        const T* found = m_tree->find(val);
+        if (--m_until_sample == 0) {
+            m_until_sample = m_period;
+            if (found != NULL) {
+                m_weights[m_tree->rank(val)] += 1;
+            }
+        }
+        return found;
+    }
+
+    /**
+     * @brief returns the sampled counts, one per element in sorted order
+     */
+    inline const std::vector<double>& weights() const { return m_weights; };
+
+    /**
+     * @brief returns the tree rebuilt from the counts so far
+     *
+     * Every element is given half a sample on top of its count, so ones
+     * never sampled still end up somewhere reasonable.
+     */
+    Tree<T> reshape() const {
+        std::vector<double> weights(m_weights);
+        for (size_t i=0; i < weights.size(); ++i) {
+            weights[i] += 0.5;
+        }
+        return m_tree->reshape_by_weights(weights);
+    }
+
+private:
+
+    /// the version being counted
+    const Option<Tree<T>> m_tree;
+
+    /// samples counted against each element, by position
+    std::vector<double> m_weights;
+
+    /// one lookup in this many is counted
+    const size_t m_period;
+
+    /// lookups left before the next sample
+    size_t m_until_sample;
+};
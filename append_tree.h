@@ -0,0 +1,343 @@
+/**
+ * @file
+ * @brief Persistent ordered set with a fast path for ascending keys
+ *
+ * Contains a persistent ordered set for keys that mostly arrive in
+ * order, such as timestamps or sequence numbers. A tree appended to at
+ * its maximum copies its whole right spine on every insert; this set
+ * keeps that spine open instead, as a short list of finished subtrees
+ * that are joined together only when two of them reach the same height.
+ * Appending a key at or beyond the maximum then builds O(1) nodes,
+ * amortised, and the oldest keys can be dropped from the other end to
+ * keep a sliding window.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <list>
+#include <memory>       // shared_ptr
+#include <stdexcept>    // out_of_range
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Persistent ordered set whose right spine is kept unbuilt
+ *
+ * The elements are held as a list of entries, newest first. Each entry
+ * is a value and the subtree of everything between it and the previous
+ * entry's value, so the entries are the right spine of the tree they
+ * describe, with each spine node's left subtree already built. The
+ * subtrees grow strictly taller towards the oldest entry, which keeps
+ * the list O(log n) long; an insert that breaks this joins the
+ * offending entries, like the carry of a binary counter.
+ *
+ * Keys below the maximum are accepted too, at the cost of an ordinary
+ * tree insert plus a copy of the list. Like Tree, an AppendTree is
+ * never modified; every update returns a new one, and copies are cheap.
+ * Duplicates are kept, as in Tree.
+ */
+template<typename T>
+class AppendTree
+{
+public:
+    /**
+     * @brief creates an empty set
+     */
+    AppendTree() :
+        m_size(0)
+    {};
+
+    /**
+     * @brief returns the number of elements in the set
+     */
+    inline size_t size() const { return m_size; };
+
+    /**
+     * @brief returns the number of entries the spine is held as
+     */
+    size_t spine() const;
+
+    /**
+     * @brief returns True if the set has an element equal to val
+     */
+    bool contains(const T& val) const;
+
+    /**
+     * @brief returns the least element; the set must not be empty
+     */
+    const T& min() const;
+
+    /**
+     * @brief returns the greatest element; the set must not be empty
+     */
+    inline const T& max() const { return m_newest->value; };
+
+    /**
+     * @brief returns a new set with val inserted into it
+     *
+     * If val is not less than max(), this builds O(1) nodes amortised.
+     * Otherwise it costs O(log n).
+     */
+    AppendTree<T> insert(const T& val) const;
+
+    /**
+     * @brief returns a new set without its least element
+     *
+     * Throws std::out_of_range if the set is empty.
+     */
+    AppendTree<T> remove_min() const;
+
+    /**
+     * @brief returns a new set without the elements less than bound
+     *
+     * Entries wholly below bound are dropped, and only the one subtree
+     * that straddles it is split, so this costs O(log n) however many
+     * elements go.
+     */
+    AppendTree<T> remove_below(const T& bound) const;
+
+    /**
+     * @brief returns the set as a Tree, or None if it is empty
+     *
+     * The spine is joined onto the built subtrees, which copies
+     * O(log n) nodes and shares the rest.
+     */
+    Option<Tree<T>> tree() const;
+
+    std::list<T> toList() const;
+
+private:
+
+    /**
+     * @brief one node of the right spine
+     */
+    struct Entry
+    {
+        Entry(const T& value,
+              const Option<Tree<T>>& left,
+              const std::shared_ptr<const Entry>& older) :
+            value(value),
+            left(left),
+            older(older)
+        {};
+
+        /// the spine node's value
+        const T value;
+
+        /// everything between the older entry's value and this one
+        const Option<Tree<T>> left;
+
+        /// the entry below this one on the spine, or NULL
+        const std::shared_ptr<const Entry> older;
+    };
+
+    typedef std::shared_ptr<const Entry> Link;
+
+    AppendTree(const Link& newest, size_t size) :
+        m_newest(newest),
+        m_size(size)
+    {};
+
+    /**
+     * @brief puts a new newest entry on top of older, joining entries
+     * until the subtrees grow strictly taller towards the oldest
+     */
+    static Link push(Link older, const T& value, Option<Tree<T>> left) {
+        while (older && tree_height(older->left) <= tree_height(left)) {
+            left = Some(Tree<T>::join(older->left, older->value, left));
+            older = older->older;
+        }
+        return std::make_shared<const Entry>(value, left, older);
+    }
+
+    /**
+     * @brief returns the elements of tree not less than bound, joining
+     * back together what the search for bound leaves on its right
+     */
+    static Option<Tree<T>> at_least(const Option<Tree<T>>& tree,
+                                    const T& bound) {
+        if (tree.is_none()) {
+            return tree;
+        } else if (bound > tree->deref()) {
+            return at_least(tree->right(), bound);
+        }
+        return Some(Tree<T>::join(at_least(tree->left(), bound),
+                                  tree->deref(), tree->right()));
+    }
+
+    /**
+     * @brief returns the entries, oldest first
+     */
+    std::vector<const Entry*> entries() const {
+        std::vector<const Entry*> list;
+        for (const Entry* e = m_newest.get(); e != NULL; e = e->older.get()) {
+            list.push_back(e);
+        }
+        return std::vector<const Entry*>(list.rbegin(), list.rend());
+    }
+
+    /// the entry holding the greatest element, or NULL if empty
+    Link m_newest;
+
+    /// number of elements
+    size_t m_size;
+};
+
+
+
+template<typename T>
+size_t AppendTree<T>::spine() const
+{
+    size_t count = 0;
+    for (const Entry* e = m_newest.get(); e != NULL; e = e->older.get()) {
+        ++count;
+    }
+    return count;
+}
+
+
+template<typename T>
+bool AppendTree<T>::contains(const T& val) const
+{
+    for (const Entry* e = m_newest.get(); e != NULL; e = e->older.get()) {
+        if (val > e->value) {
+            return false;
+        } else if (val == e->value) {
+            return true;
+        } else if (e->older == NULL || val > e->older->value) {
+            // val can only be between the two spine values
+            return e->left.is_some() && e->left->contains(val);
+        }
+    }
+    return false;
+}
+
+
+template<typename T>
+const T& AppendTree<T>::min() const
+{
+    const Entry* oldest = m_newest.get();
+    while (oldest->older != NULL) {
+        oldest = oldest->older.get();
+    }
+    return oldest->left.is_some() ? oldest->left->min() : oldest->value;
+}
+
+
+template<typename T>
+AppendTree<T> AppendTree<T>::insert(const T& val) const
+{
+    if (!m_newest || !(m_newest->value > val)) {
+        return AppendTree<T>(push(m_newest, val, None<Tree<T>>()), m_size + 1);
+    }
+    // the oldest entry whose value is greater than val takes it
+    std::vector<const Entry*> list = entries();
+    size_t at = 0;
+    while (!(list[at]->value > val)) {
+        ++at;
+    }
+    Link spine;
+    for (size_t i=0; i < list.size(); ++i) {
+        if (i != at) {
+            spine = push(spine, list[i]->value, list[i]->left);
+        } else if (list[i]->left.is_some()) {
+            spine = push(spine, list[i]->value,
+                         Some(list[i]->left->insert(val)));
+        } else {
+            spine = push(spine, list[i]->value, Some(Tree<T>(val)));
+        }
+    }
+    return AppendTree<T>(spine, m_size + 1);
+}
+
+
+template<typename T>
+AppendTree<T> AppendTree<T>::remove_min() const
+{
+    if (!m_newest) {
+        throw std::out_of_range("remove_min of an empty set");
+    }
+    std::vector<const Entry*> list = entries();
+    Link spine;
+    if (list[0]->left.is_some()) {
+        const Option<Tree<T>>& oldest = list[0]->left;
+        spine = push(spine, list[0]->value, oldest->remove(oldest->min()));
+    }
+    // otherwise the oldest spine value is the least element, and goes
+    for (size_t i=1; i < list.size(); ++i) {
+        spine = push(spine, list[i]->value, list[i]->left);
+    }
+    return AppendTree<T>(spine, m_size - 1);
+}
+
+
+template<typename T>
+AppendTree<T> AppendTree<T>::remove_below(const T& bound) const
+{
+    std::vector<const Entry*> list = entries();
+    // entries whose value is below bound go whole, with their subtrees
+    size_t first = 0;
+    size_t removed = 0;
+    while (first < list.size() && bound > list[first]->value) {
+        removed += tree_size(list[first]->left) + 1;
+        ++first;
+    }
+    if (first == list.size()) {
+        return AppendTree<T>();
+    }
+    Option<Tree<T>> kept = at_least(list[first]->left, bound);
+    removed += tree_size(list[first]->left) - tree_size(kept);
+    if (removed == 0) {
+        return *this;
+    }
+    Link spine = push(Link(), list[first]->value, kept);
+    for (size_t i=first + 1; i < list.size(); ++i) {
+        spine = push(spine, list[i]->value, list[i]->left);
+    }
+    return AppendTree<T>(spine, m_size - removed);
+}
+
+
+template<typename T>
+Option<Tree<T>> AppendTree<T>::tree() const
+{
+    Option<Tree<T>> result = None<Tree<T>>();
+    for (const Entry* e = m_newest.get(); e != NULL; e = e->older.get()) {
+        result = Some(Tree<T>::join(e->left, e->value, result));
+    }
+    return result;
+}
+
+
+template<typename T>
+std::list<T> AppendTree<T>::toList() const
+{
+    std::list<T> l;
+    std::vector<const Entry*> list = entries();
+    for (size_t i=0; i < list.size(); ++i) {
+        if (list[i]->left.is_some()) {
+            l.splice(l.end(), list[i]->left->toList());
+        }
+        l.push_back(list[i]->value);
+    }
+    return l;
+}
@@ -0,0 +1,578 @@
+/**
+ * @file
+ * @brief Persistent adaptive radix tree
+ *
+ * Contains a persistent set of byte-string keys stored in an adaptive
+ * radix tree. Lookups follow one node per key byte (fewer, with path
+ * compression) instead of comparing whole keys at every level, so they
+ * cost O(key length) however many keys are stored. Inner nodes come in
+ * four sizes, holding up to 4, 16, 48 or 256 children, and are resized
+ * as children come and go. Updates copy the path to the changed leaf
+ * and share everything else, as Tree does.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // fill, copy
+#include <list>
+#include <memory>       // shared_ptr
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>  // Node16 child search
+#endif
+
+/**
+ * @brief Persistent set of byte strings, stored as a radix tree
+ *
+ * Like Tree, an ArtSet is never modified: insert() and remove() return
+ * new sets. Keys may contain any bytes, including NUL, and one key may
+ * be a prefix of another. Iteration is in std::string order.
+ */
+class ArtSet
+{
+public:
+    /**
+     * @brief creates an empty set
+     */
+    ArtSet() : m_root(), m_size(0) {};
+
+    /**
+     * @brief returns the number of keys in the set
+     */
+    inline size_t size() const { return m_size; };
+
+    /**
+     * @brief returns true if key is in the set
+     */
+    bool contains(const std::string& key) const;
+
+    /**
+     * @brief returns a new set with key added
+     */
+    ArtSet insert(const std::string& key) const {
+        Ptr root = insert(m_root, key, 0);
+        return root == m_root ? *this : ArtSet(root, m_size + 1);
+    }
+
+    /**
+     * @brief returns a new set with key removed
+     */
+    ArtSet remove(const std::string& key) const {
+        Ptr root = remove(m_root, key, 0);
+        return root == m_root ? *this : ArtSet(root, m_size - 1);
+    }
+
+    /**
+     * @brief returns the keys of the set in order
+     */
+    std::list<std::string> toList() const {
+        std::list<std::string> l;
+        std::string path;
+        append(m_root, path, l);
+        return l;
+    }
+
+private:
+
+    struct Node;
+    struct Leaf;
+    struct Node4;
+    struct Node16;
+    struct Node48;
+    struct Node256;
+
+    /// shared handle to an immutable node, NULL for an empty tree
+    typedef std::shared_ptr<const Node> Ptr;
+
+    /**
+     * @brief the kinds of node
+     */
+    enum Kind { LEAF, NODE4, NODE16, NODE48, NODE256 };
+
+    /**
+     * @brief fields common to every kind of node
+     *
+     * An inner node matches prefix before branching on the next byte;
+     * terminal marks that the key ending right after prefix is in the set.
+     * A leaf holds its whole key, so a lone key needs no inner nodes.
+     */
+    struct Node
+    {
+        Node(Kind kind) : kind(kind), terminal(false), count(0) {};
+
+        const Kind kind;
+        std::string prefix;
+        bool terminal;
+        unsigned int count;
+    };
+
+    struct Leaf : public Node
+    {
+        Leaf(const std::string& key) : Node(LEAF), key(key) {};
+
+        const std::string key;
+    };
+
+    struct Node4 : public Node
+    {
+        Node4() : Node(NODE4) {};
+
+        /// children's bytes, sorted
+        unsigned char keys[4];
+        Ptr children[4];
+    };
+
+    struct Node16 : public Node
+    {
+        Node16() : Node(NODE16) {};
+
+        /// children's bytes, sorted; searched 16 at a time
+        unsigned char keys[16];
+        Ptr children[16];
+    };
+
+    struct Node48 : public Node
+    {
+        Node48() : Node(NODE48) {
+            std::fill(index, index + 256, 0);
+        };
+
+        /// slot in children plus one for each byte, 0 for none
+        unsigned char index[256];
+        Ptr children[48];
+    };
+
+    struct Node256 : public Node
+    {
+        Node256() : Node(NODE256) {};
+
+        Ptr children[256];
+    };
+
+    /**
+     * @brief a child and the byte leading to it
+     */
+    struct Branch
+    {
+        unsigned char byte;
+        Ptr child;
+    };
+
+    ArtSet(const Ptr& root, size_t size) : m_root(root), m_size(size) {};
+
+    /**
+     * @brief returns the child of node for byte, or NULL
+     */
+    static const Ptr* find_child(const Node& node, unsigned char byte);
+
+    /**
+     * @brief copies the children of node, in byte order, into branches
+     */
+    static void children(const Node& node, Branch* branches);
+
+    /**
+     * @brief build the smallest inner node that holds count branches
+     */
+    static Ptr make(const std::string& prefix, bool terminal,
+                    const Branch* branches, unsigned int count);
+
+    /**
+     * @brief copy node with the child for byte set to child, or removed
+     * if child is NULL
+     */
+    static Ptr with_child(const Node& node, unsigned char byte,
+                          const Ptr& child);
+
+    /**
+     * @brief copy node with prefix and terminal replaced
+     */
+    static Ptr with(const Node& node, const std::string& prefix,
+                    bool terminal);
+
+    /**
+     * @brief return n with key added; n itself if it was already there
+     */
+    static Ptr insert(const Ptr& n, const std::string& key, size_t depth);
+
+    /**
+     * @brief return n with key removed; n itself if it was not there
+     */
+    static Ptr remove(const Ptr& n, const std::string& key, size_t depth);
+
+    static void append(const Ptr& n, std::string& path,
+                       std::list<std::string>& l);
+
+    /// the root node, NULL while empty
+    Ptr m_root;
+
+    /// number of keys
+    size_t m_size;
+};
+
+
+
+inline bool ArtSet::contains(const std::string& key) const
+{
+    const Node* n = m_root.get();
+    size_t depth = 0;
+    while (n != NULL) {
+        if (n->kind == LEAF) {
+            return static_cast<const Leaf*>(n)->key == key;
+        }
+        if (key.compare(depth, n->prefix.size(), n->prefix) != 0) {
+            return false;
+        }
+        depth += n->prefix.size();
+        if (depth == key.size()) {
+            return n->terminal;
+        }
+        const Ptr* child = find_child(*n, key[depth]);
+        n = child == NULL ? NULL : child->get();
+        ++depth;
+    }
+    return false;
+}
+
+
+inline const ArtSet::Ptr* ArtSet::find_child(const Node& node,
+                                             unsigned char byte)
+{
+    switch (node.kind) {
+    case NODE4: {
+        const Node4& n = static_cast<const Node4&>(node);
+        for (unsigned int i=0; i<n.count; ++i) {
+            if (n.keys[i] == byte) {
+                return &n.children[i];
+            }
+        }
+        return NULL;
+    }
+    case NODE16: {
+        const Node16& n = static_cast<const Node16&>(node);
+#ifdef __SSE2__
+        __m128i match = _mm_cmpeq_epi8(
+            _mm_set1_epi8(static_cast<char>(byte)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(n.keys)));
+        int mask = _mm_movemask_epi8(match) & ((1 << n.count) - 1);
+        return mask == 0 ? NULL : &n.children[__builtin_ctz(mask)];
+#else
+        for (unsigned int i=0; i<n.count; ++i) {
+            if (n.keys[i] == byte) {
+                return &n.children[i];
+            }
+        }
+        return NULL;
+#endif
+    }
+    case NODE48: {
+        const Node48& n = static_cast<const Node48&>(node);
+        return n.index[byte] == 0 ? NULL : &n.children[n.index[byte] - 1];
+    }
+    case NODE256: {
+        const Node256& n = static_cast<const Node256&>(node);
+        return n.children[byte] ? &n.children[byte] : NULL;
+    }
+    default:
+        return NULL;
+    }
+}
+
+
+inline void ArtSet::children(const Node& node, Branch* branches)
+{
+    unsigned int count = 0;
+    switch (node.kind) {
+    case NODE4: {
+        const Node4& n = static_cast<const Node4&>(node);
+        for (unsigned int i=0; i<n.count; ++i) {
+            branches[i].byte = n.keys[i];
+            branches[i].child = n.children[i];
+        }
+        break;
+    }
+    case NODE16: {
+        const Node16& n = static_cast<const Node16&>(node);
+        for (unsigned int i=0; i<n.count; ++i) {
+            branches[i].byte = n.keys[i];
+            branches[i].child = n.children[i];
+        }
+        break;
+    }
+    case NODE48: {
+        const Node48& n = static_cast<const Node48&>(node);
+        for (unsigned int b=0; b<256; ++b) {
+            if (n.index[b] != 0) {
+                branches[count].byte = static_cast<unsigned char>(b);
+                branches[count].child = n.children[n.index[b] - 1];
+                ++count;
+            }
+        }
+        break;
+    }
+    case NODE256: {
+        const Node256& n = static_cast<const Node256&>(node);
+        for (unsigned int b=0; b<256; ++b) {
+            if (n.children[b]) {
+                branches[count].byte = static_cast<unsigned char>(b);
+                branches[count].child = n.children[b];
+                ++count;
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+
+inline ArtSet::Ptr ArtSet::make(const std::string& prefix, bool terminal,
+                                const Branch* branches, unsigned int count)
+{
+    std::shared_ptr<Node> node;
+    if (count <= 4) {
+        std::shared_ptr<Node4> n = std::make_shared<Node4>();
+        for (unsigned int i=0; i<count; ++i) {
+            n->keys[i] = branches[i].byte;
+            n->children[i] = branches[i].child;
+        }
+        node = n;
+    } else if (count <= 16) {
+        std::shared_ptr<Node16> n = std::make_shared<Node16>();
+        std::fill(n->keys, n->keys + 16, 0);
+        for (unsigned int i=0; i<count; ++i) {
+            n->keys[i] = branches[i].byte;
+            n->children[i] = branches[i].child;
+        }
+        node = n;
+    } else if (count <= 48) {
+        std::shared_ptr<Node48> n = std::make_shared<Node48>();
+        for (unsigned int i=0; i<count; ++i) {
+            n->index[branches[i].byte] = static_cast<unsigned char>(i + 1);
+            n->children[i] = branches[i].child;
+        }
+        node = n;
+    } else {
+        std::shared_ptr<Node256> n = std::make_shared<Node256>();
+        for (unsigned int i=0; i<count; ++i) {
+            n->children[branches[i].byte] = branches[i].child;
+        }
+        node = n;
+    }
+    node->prefix = prefix;
+    node->terminal = terminal;
+    node->count = count;
+    return node;
+}
+
+
+inline ArtSet::Ptr ArtSet::with_child(const Node& node, unsigned char byte,
+                                      const Ptr& child)
+{
+    Branch branches[257];
+    children(node, branches);
+    unsigned int count = node.count;
+    unsigned int i = 0;
+    while (i < count && branches[i].byte < byte) {
+        ++i;
+    }
+    if (i < count && branches[i].byte == byte) {
+        if (child) {
+            branches[i].child = child;
+        } else {
+            std::copy(branches + i + 1, branches + count, branches + i);
+            --count;
+        }
+    } else if (child) {
+        std::copy_backward(branches + i, branches + count,
+                           branches + count + 1);
+        branches[i].byte = byte;
+        branches[i].child = child;
+        ++count;
+    }
+    return make(node.prefix, node.terminal, branches, count);
+}
+
+
+inline ArtSet::Ptr ArtSet::with(const Node& node, const std::string& prefix,
+                                bool terminal)
+{
+    Branch branches[256];
+    children(node, branches);
+    return make(prefix, terminal, branches, node.count);
+}
+
+
+inline ArtSet::Ptr ArtSet::insert(const Ptr& n, const std::string& key,
+                                  size_t depth)
+{
+    if (!n) {
+        return std::make_shared<Leaf>(key);
+    }
+    if (n->kind == LEAF) {
+        const std::string& other = static_cast<const Leaf&>(*n).key;
+        if (other == key) {
+            return n;
+        }
+        // branch where the two keys part
+        size_t end = depth;
+        while (end < key.size() && end < other.size() &&
+               key[end] == other[end]) {
+            ++end;
+        }
+        // one key may end right there, the other branches on its next byte
+        Branch branches[2];
+        unsigned int count = 0;
+        if (other.size() > end) {
+            Branch b = { static_cast<unsigned char>(other[end]), n };
+            branches[count++] = b;
+        }
+        if (key.size() > end) {
+            Branch b = { static_cast<unsigned char>(key[end]),
+                         std::make_shared<Leaf>(key) };
+            if (count == 1 && b.byte < branches[0].byte) {
+                branches[1] = branches[0];
+                branches[0] = b;
+            } else {
+                branches[count] = b;
+            }
+            ++count;
+        }
+        return make(key.substr(depth, end - depth), count < 2,
+                    branches, count);
+    }
+    size_t matched = 0;
+    while (matched < n->prefix.size() && depth + matched < key.size() &&
+           n->prefix[matched] == key[depth + matched]) {
+        ++matched;
+    }
+    if (matched < n->prefix.size()) {
+        // key leaves the compressed path: split it
+        Branch branches[2];
+        unsigned int count = 0;
+        Ptr rest = with(*n, n->prefix.substr(matched + 1), n->terminal);
+        Branch old_branch = { static_cast<unsigned char>(n->prefix[matched]),
+                              rest };
+        bool ends_here = (depth + matched == key.size());
+        if (!ends_here) {
+            Branch new_branch = {
+                static_cast<unsigned char>(key[depth + matched]),
+                std::make_shared<Leaf>(key) };
+            if (new_branch.byte < old_branch.byte) {
+                branches[count++] = new_branch;
+                branches[count++] = old_branch;
+            } else {
+                branches[count++] = old_branch;
+                branches[count++] = new_branch;
+            }
+        } else {
+            branches[count++] = old_branch;
+        }
+        return make(n->prefix.substr(0, matched), ends_here, branches, count);
+    }
+    depth += matched;
+    if (depth == key.size()) {
+        return n->terminal ? n : with(*n, n->prefix, true);
+    }
+    unsigned char byte = key[depth];
+    const Ptr* child = find_child(*n, byte);
+    if (child == NULL) {
+        return with_child(*n, byte, std::make_shared<Leaf>(key));
+    }
+    Ptr updated = insert(*child, key, depth + 1);
+    return updated == *child ? n : with_child(*n, byte, updated);
+}
+
+
+inline ArtSet::Ptr ArtSet::remove(const Ptr& n, const std::string& key,
+                                  size_t depth)
+{
+    if (!n) {
+        return n;
+    }
+    if (n->kind == LEAF) {
+        return static_cast<const Leaf&>(*n).key == key ? Ptr() : n;
+    }
+    if (key.compare(depth, n->prefix.size(), n->prefix) != 0) {
+        return n;
+    }
+    size_t end = depth + n->prefix.size();
+    Ptr node;
+    if (end == key.size()) {
+        if (!n->terminal) {
+            return n;
+        }
+        node = with(*n, n->prefix, false);
+    } else {
+        unsigned char byte = key[end];
+        const Ptr* child = find_child(*n, byte);
+        if (child == NULL) {
+            return n;
+        }
+        Ptr updated = remove(*child, key, end + 1);
+        if (updated == *child) {
+            return n;
+        }
+        node = with_child(*n, byte, updated);
+    }
+    // collapse nodes left with nothing to branch between
+    if (node->count == 0) {
+        return node->terminal ? std::make_shared<Leaf>(key.substr(0, end))
+                              : Ptr();
+    } else if (node->count == 1 && !node->terminal) {
+        Branch only[1];
+        children(*node, only);
+        if (only[0].child->kind == LEAF) {
+            return only[0].child;
+        }
+        return with(*only[0].child,
+                    node->prefix + static_cast<char>(only[0].byte)
+                    + only[0].child->prefix,
+                    only[0].child->terminal);
+    }
+    return node;
+}
+
+
+inline void ArtSet::append(const Ptr& n, std::string& path,
+                           std::list<std::string>& l)
+{
+    if (!n) {
+        return;
+    }
+    if (n->kind == LEAF) {
+        l.push_back(static_cast<const Leaf&>(*n).key);
+        return;
+    }
+    size_t depth = path.size();
+    path += n->prefix;
+    if (n->terminal) {
+        l.push_back(path);
+    }
+    Branch branches[256];
+    children(*n, branches);
+    for (unsigned int i=0; i<n->count; ++i) {
+        path.push_back(static_cast<char>(branches[i].byte));
+        append(branches[i].child, path, l);
+        path.resize(path.size() - 1);
+    }
+    path.resize(depth);
+}
@@ -0,0 +1,140 @@
+/**
+ * @file
+ * @brief Lock-free publication of a Tree version
+ *
+ * Contains a slot holding the current version of a tree, which one
+ * writer replaces while any number of readers take copies. std::atomic
+ * operations on a shared_ptr would do the same job, but libstdc++ makes
+ * them lock-free only in name: each takes one of a small global pool of
+ * mutexes. Here a reader does a few atomic reads and increments, and
+ * never waits for the writer or for other readers.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>       // shared_ptr
+#include <stdint.h>
+#include <thread>       // yield
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief The published version of a Tree
+ *
+ * The version is kept as a raw pointer to a heap-allocated shared_ptr.
+ * A reader copies that shared_ptr, which only touches the reference
+ * count. Replaced holders are reclaimed in the manner of RCU: readers
+ * announce themselves in one of two counters, picked by the parity of
+ * an epoch, and store() flips the epoch and frees the old holder once
+ * the counter for the previous epoch has drained. Only store() waits,
+ * and only for reads already under way; a read that overlaps a flip
+ * retries rather than waits, so some reader or writer always makes
+ * progress.
+ *
+ * Any number of threads may load() at once. store() must be called by
+ * one thread at a time; the caller serialises writers.
+ */
+template<typename T>
+class AtomicRoot
+{
+public:
+    /**
+     * @brief creates a slot holding None
+     */
+    AtomicRoot() :
+        m_holder(NULL),
+        m_epoch(0)
+    {
+        m_readers[0].store(0);
+        m_readers[1].store(0);
+    };
+
+    ~AtomicRoot() {
+        delete m_holder.load();
+    }
+
+    /**
+     * @brief returns the version published last, or None
+     */
+    Option<Tree<T>> load() const {
+        for (;;) {
+            uint64_t epoch = m_epoch.load();
+            std::atomic<size_t>& readers = m_readers[epoch & 1];
+            ++readers;
+            // a store() that flipped the epoch since may not wait for us
+            if (m_epoch.load() != epoch) {
+                --readers;
+                continue;
+            }
+            const Holder* holder = m_holder.load();
+            std::shared_ptr<Tree<T>> root;
+            if (holder != NULL) {
+                root = *holder;
+            }
+            --readers;
+            return Option<Tree<T>>(root);
+        }
+    }
+
+    /**
+     * @brief publishes root, which may be None
+     *
+     * Returns once no reader can still be looking at the version it
+     * replaced.
+     */
+    void store(const Option<Tree<T>>& root) {
+        const Holder* holder = NULL;
+        if (root.is_some()) {
+            holder = new Holder(root.get_ref());
+        }
+        const Holder* old = m_holder.exchange(holder);
+        uint64_t epoch = m_epoch.fetch_add(1);
+        // readers counted under the new epoch can only see the new holder
+        while (m_readers[epoch & 1].load() != 0) {
+            std::this_thread::yield();
+        }
+        delete old;
+    }
+
+private:
+
+    /**
+     * @brief blocked copy constructor, not implemented
+     */
+    AtomicRoot(const AtomicRoot<T>&);
+
+    /**
+     * @brief blocked copy assignment operator, not implemented
+     */
+    AtomicRoot<T>& operator=(const AtomicRoot<T>&);
+
+    typedef std::shared_ptr<Tree<T>> Holder;
+
+    /// the published version, NULL for None
+    std::atomic<const Holder*> m_holder;
+
+    /// bumped by every store()
+    std::atomic<uint64_t> m_epoch;
+
+    /// loads under way, by the parity of the epoch they started in
+    mutable std::atomic<size_t> m_readers[2];
+};
@@ -0,0 +1,163 @@
+/**
+ * @file
+ * @brief Persistent Tree Benchmarks
+ *
+ * Times inserts and removals and checks how many nodes each one builds.
+ * on invoking make bench, run ./bench to run these benchmarks. A non-zero
+ * exit status means an allocation check failed.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define TREE_COUNT_NODES
+#include<chrono>
+#include<iostream>
+
+#include "tree.h"
+#include "append_tree.h"
+
+/**
+ * @brief number of nodes a search for val visits before falling off
+ */
+template<typename T>
+size_t path_length(const Tree<T>& tree, const T& val)
+{
+    size_t length = 1;
+    const Tree<T>* node = &tree;
+    for (;;) {
+        Option<Tree<T>> next = (node->deref() > val) ? node->left()
+                                                     : node->right();
+        if (next.is_none()) {
+            return length;
+        }
+        node = next.operator->();
+        ++length;
+    }
+}
+
+/**
+ * @brief small deterministic generator so runs are comparable
+ */
+static unsigned int next_key(unsigned int& state)
+{
+    state = state * 1103515245u + 12345u;
+    return (state >> 8) & 0xffffff;
+}
+
+/**
+ * @brief insert n keys, checking that each insert builds exactly one
+ * node per level of its search path plus the new leaf
+ */
+static bool bench_insert(const char* name, size_t n, bool sequential)
+{
+    using namespace std;
+    unsigned int state = 1;
+    Option<Tree<unsigned int>> tree(Some(Tree<unsigned int>(0u)));
+    size_t built = 0;
+    chrono::steady_clock::duration elapsed(0);
+    for (size_t i=1; i<n; ++i) {
+        unsigned int key = sequential ? i : next_key(state);
+        size_t expected = path_length(tree.get_bare(), key) + 1;
+        size_t before = Tree<unsigned int>::nodes_built();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Tree<unsigned int> result(tree->insert(key));
+        elapsed += chrono::steady_clock::now() - start;
+        size_t count = Tree<unsigned int>::nodes_built() - before;
+        if (count != expected) {
+            cout << name << ": insert of " << key << " built " << count
+                 << " nodes, expected " << expected << endl;
+            return false;
+        }
+        built += count;
+        tree = result;
+    }
+    cout << name << ": " << n << " inserts, "
+         << static_cast<double>(built) / (n - 1) << " nodes/insert, "
+         << chrono::duration_cast<chrono::nanoseconds>(elapsed).count()
+            / (n - 1) << " ns/insert, height " << tree->height() << endl;
+    return true;
+}
+
+/**
+ * @brief remove every other key, checking that no removal builds more
+ * nodes than two search paths' worth
+ */
+static bool bench_remove(size_t n)
+{
+    using namespace std;
+    Option<Tree<unsigned int>> tree(Some(Tree<unsigned int>(0u)));
+    for (size_t i=1; i<n; ++i) {
+        tree = tree->insert(static_cast<unsigned int>(i));
+    }
+    size_t built = 0;
+    size_t removals = 0;
+    for (size_t i=0; i<n; i+=2) {
+        size_t bound = 2 * tree->height();
+        size_t before = Tree<unsigned int>::nodes_built();
+        tree = tree->remove(static_cast<unsigned int>(i));
+        size_t count = Tree<unsigned int>::nodes_built() - before;
+        if (count > bound) {
+            cout << "remove: removal of " << i << " built " << count
+                 << " nodes, bound is " << bound << endl;
+            return false;
+        }
+        built += count;
+        ++removals;
+    }
+    cout << "remove: " << removals << " removals, "
+         << static_cast<double>(built) / removals << " nodes/remove, "
+         << "height " << tree->height() << endl;
+    return true;
+}
+
+/**
+ * @brief append n ascending keys, checking that the appends build O(1)
+ * nodes each on average
+ */
+static bool bench_append(size_t n)
+{
+    using namespace std;
+    AppendTree<unsigned int> tree;
+    size_t before = Tree<unsigned int>::nodes_built();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i=0; i<n; ++i) {
+        tree = tree.insert(static_cast<unsigned int>(i));
+    }
+    chrono::steady_clock::duration elapsed = chrono::steady_clock::now() - start;
+    double per_append = static_cast<double>(Tree<unsigned int>::nodes_built()
+                                            - before) / n;
+    cout << "append: " << n << " appends, "
+         << per_append << " nodes/append, "
+         << chrono::duration_cast<chrono::nanoseconds>(elapsed).count() / n
+         << " ns/append, spine " << tree.spine() << endl;
+    if (per_append > 3) {
+        cout << "append: expected at most 3 nodes/append" << endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main(void)
+{
+    bool ok = true;
+    ok &= bench_insert("sequential", 100000, true);
+    ok &= bench_insert("random", 100000, false);
+    ok &= bench_remove(100000);
+    ok &= bench_append(100000);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+/**
+ * @file
+ * @brief Columnar export of key/value trees
+ *
+ * Contains exports that write one version of a tree of key/value pairs
+ * as two contiguous columns, one of keys and one of values, either into
+ * buffers the caller provides or into a file laid out the same way.
+ * Every node knows the size of its subtree, so the place each element
+ * goes is known without visiting the elements before it, and separate
+ * subtrees are written by separate threads.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // max
+#include <cstring>      // memcpy
+#include <future>       // async
+#include <stdexcept>    // runtime_error
+#include <stdint.h>
+#include <string>
+#include <thread>       // hardware_concurrency
+#include <type_traits>  // is_trivially_copyable
+#include <utility>      // pair
+
+#include <fcntl.h>      // open
+#include <sys/mman.h>   // mmap
+#include <unistd.h>     // ftruncate, close
+
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+
+/**
+ * @brief subtrees smaller than this are never handed to another thread
+ */
+const size_t COLUMNAR_GRAIN = 16384;
+
+/**
+ * @brief write the elements of tree into columns starting at offset
+ *
+ * spawn is how many more times the work may be split across threads.
+ */
+template<typename T, typename K, typename V, typename Split>
+void export_subtree_columns(const Tree<T>* tree, size_t offset,
+                            K* keys, V* values,
+                            const Split& split, unsigned spawn)
+{
+    while (tree != NULL) {
+        const Tree<T>* left = tree->left_node();
+        size_t at = offset + (left == NULL ? 0 : left->size());
+        std::future<void> done;
+        if (spawn > 0 && left != NULL && left->size() >= COLUMNAR_GRAIN) {
+            // the left subtree on another thread, the rest on this one
+            done = std::async(std::launch::async,
+                              export_subtree_columns<T, K, V, Split>,
+                              left, offset, keys, values,
+                              std::cref(split), spawn / 2);
+            spawn -= spawn / 2 + 1;
+        } else {
+            export_subtree_columns(left, offset, keys, values, split, spawn);
+        }
+        split(tree->deref(), keys[at], values[at]);
+        if (done.valid()) {
+            done.get();
+        }
+        offset = at + 1;
+        tree = tree->right_node();
+    }
+}
+
+
+/**
+ * @brief write the keys and values of tree, in order, to keys[0, size)
+ * and values[0, size)
+ *
+ * split(element, key, value) sets the key and value of one element.
+ * K and V are deduced from the buffers; for the file export below they
+ * have to be given explicitly.
+ * The buffers must hold tree_size(tree) entries each. threads is the
+ * most threads to use, 0 meaning one per hardware thread.
+ */
+template<typename T, typename K, typename V, typename Split>
+void export_columns(const Option<Tree<T>>& tree, const Split& split,
+                    K* keys, V* values, unsigned threads = 0)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    TREE_TRACE_SCOPE(trace, "export_columns");
+    TREE_TRACE_COUNT(trace, tree_size(tree),
+                     tree_size(tree) * (sizeof(K) + sizeof(V)));
+    export_subtree_columns(tree.is_some() ? tree.operator->() : NULL, 0,
+                           keys, values, split, threads - 1);
+}
+
+
+/**
+ * @brief splits a std::pair into its key and value
+ */
+struct SplitPair
+{
+    template<typename K, typename V>
+    void operator()(const std::pair<K, V>& element, K& key, V& value) const {
+        key = element.first;
+        value = element.second;
+    }
+};
+
+
+/**
+ * @brief write the keys and values of a tree of pairs to two columns
+ *
+ * @see export_columns
+ */
+template<typename K, typename V>
+void export_columns(const Option<Tree<std::pair<K, V>>>& tree,
+                    K* keys, V* values, unsigned threads = 0)
+{
+    export_columns(tree, SplitPair(), keys, values, threads);
+}
+
+
+/**
+ * @brief header at the start of a column file
+ *
+ * The keys follow the header, and the values follow the keys at the
+ * next multiple of 16 bytes.
+ */
+struct ColumnFileHeader
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t key_size;
+    uint64_t value_size;
+
+    /**
+     * @brief byte offset of the values column
+     */
+    uint64_t values_offset() const {
+        return (sizeof(ColumnFileHeader) + count * key_size + 15) / 16 * 16;
+    }
+};
+
+
+/**
+ * @brief write the keys and values of tree to a column file at path
+ *
+ * The file is mapped into memory and written by the same parallel
+ * export as export_columns. K and V are written as raw bytes, so must
+ * be trivially copyable. Throws std::runtime_error if the file cannot
+ * be written.
+ */
+template<typename T, typename K, typename V, typename Split>
+void export_columns(const Option<Tree<T>>& tree, const Split& split,
+                    const std::string& path, unsigned threads = 0)
+{
+    static_assert(std::is_trivially_copyable<K>::value &&
+                  std::is_trivially_copyable<V>::value,
+                  "columns are written as raw bytes");
+    ColumnFileHeader header;
+    std::memcpy(header.magic, "COLUMNS1", sizeof(header.magic));
+    header.count = tree_size(tree);
+    header.key_size = sizeof(K);
+    header.value_size = sizeof(V);
+    size_t length = header.values_offset() + header.count * sizeof(V);
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("could not create " + path);
+    }
+    if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("could not size " + path);
+    }
+    void* map = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("could not map " + path);
+    }
+    char* bytes = static_cast<char*>(map);
+    std::memcpy(bytes, &header, sizeof(header));
+    try {
+        export_columns(tree, split,
+                       reinterpret_cast<K*>(bytes + sizeof(header)),
+                       reinterpret_cast<V*>(bytes + header.values_offset()),
+                       threads);
+    } catch (...) {
+        ::munmap(map, length);
+        throw;
+    }
+    if (::munmap(map, length) != 0) {
+        throw std::runtime_error("could not write " + path);
+    }
+}
+
+
+/**
+ * @brief write the keys and values of a tree of pairs to a column file
+ *
+ * @see export_columns
+ */
+template<typename K, typename V>
+void export_columns(const Option<Tree<std::pair<K, V>>>& tree,
+                    const std::string& path, unsigned threads = 0)
+{
+    export_columns<std::pair<K, V>, K, V>(tree, SplitPair(), path, threads);
+}
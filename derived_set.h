@@ -0,0 +1,145 @@
+/**
+ * @file
+ * @brief Filtered and mapped views of a tree, maintained from its changes
+ *
+ * Contains a derived set: a persistent tree holding the image of a
+ * source tree under a filter-and-map function, such as the active IDs
+ * among all IDs. Each time the source moves to a new version, only the
+ * differences between the two versions are mapped and applied, so the
+ * view costs in proportion to the changes rather than to its size.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>   // function
+#include <vector>
+
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+#include "tree_diff.h"
+
+/**
+ * @brief View of a source Tree<T> as a Tree<U>, kept up to date by diffs
+ *
+ * The mapping decides, for one source element, whether it appears in
+ * the view and as what. It must give the same answer every time it is
+ * asked about the same element, because a removed element is mapped
+ * again to find what to take out of the view. Several source elements
+ * may map to equal values; the view holds one for each.
+ */
+template<typename T, typename U = T>
+class DerivedSet
+{
+public:
+    /**
+     * @brief returns true if source is in the view, setting derived to
+     * what it appears as
+     */
+    typedef std::function<bool(const T& source, U& derived)> Mapping;
+
+    /**
+     * @brief creates a view of source, which may be None
+     *
+     * The first view is built by diffing against an empty source.
+     */
+    DerivedSet(const Mapping& mapping, const Option<Tree<T>>& source) :
+        m_mapping(mapping),
+        m_source(None<Tree<T>>()),
+        m_view(None<Tree<U>>()),
+        m_changes(0)
+    {
+        update(source);
+    };
+
+    /**
+     * @brief moves the view to a new version of the source
+     *
+     * The changes are collected first and then applied together, so
+     * view() never shows a partly updated view.
+     */
+    void update(const Option<Tree<T>>& source);
+
+    /**
+     * @brief returns the source version the view is of
+     */
+    inline const Option<Tree<T>>& source() const { return m_source; };
+
+    /**
+     * @brief returns the view, or None if it is empty
+     */
+    inline const Option<Tree<U>>& view() const { return m_view; };
+
+    /**
+     * @brief returns the number of source elements that changed in the
+     * last update()
+     */
+    inline size_t changes() const { return m_changes; };
+
+private:
+
+    /// decides what each source element appears as
+    const Mapping m_mapping;
+
+    /// the source version the view was last brought up to
+    Option<Tree<T>> m_source;
+
+    /// the image of m_source
+    Option<Tree<U>> m_view;
+
+    /// source elements changed by the last update
+    size_t m_changes;
+};
+
+
+
+template<typename T, typename U>
+void DerivedSet<T, U>::update(const Option<Tree<T>>& source)
+{
+    TREE_TRACE_SCOPE(trace, "DerivedSet::update");
+    std::vector<U> removed;
+    std::vector<U> added;
+    TreeDiff<T> diff(m_source, source);
+    typename TreeDiff<T>::Change change;
+    size_t changes = 0;
+    while (diff.next(change)) {
+        ++changes;
+        U derived;
+        if (m_mapping(*change.value, derived)) {
+            if (change.kind == TreeDiff<T>::REMOVED) {
+                removed.push_back(derived);
+            } else {
+                added.push_back(derived);
+            }
+        }
+    }
+    Option<Tree<U>> view = m_view;
+    for (size_t i=0; i < removed.size(); ++i) {
+        view = view->remove(removed[i]);
+    }
+    for (size_t i=0; i < added.size(); ++i) {
+        view = view.is_some() ? Some(view->insert(added[i]))
+                              : Some(Tree<U>(added[i]));
+    }
+    m_source = source;
+    m_view = view;
+    m_changes = changes;
+    TREE_TRACE_COUNT(trace, changes, 0);
+}
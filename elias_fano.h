@@ -0,0 +1,395 @@
+/**
+ * @file
+ * @brief Frozen Elias-Fano snapshots of integer trees
+ *
+ * Contains a read-only, compressed copy of a Tree<uint64_t>. Each value
+ * is split into low bits, stored verbatim, and high bits, stored in
+ * unary as gaps in a bit vector, for about 2 + log(U/n) bits per value
+ * where U is the largest value. Lookups, ranks, selects and iteration
+ * all work on the compressed form, so an archived version of a tree can
+ * stay queryable for a fraction of the memory its nodes take.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <iterator>   // forward_iterator_tag
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Read-only Elias-Fano encoding of a sorted multiset of integers
+ *
+ * Built in O(n) from a Tree<uint64_t> and turned back into one in O(n).
+ * nth() (select) is O(1) on average using a sample of every 256th
+ * value; contains(), rank() and lower_bound() jump straight to the
+ * values sharing the query's high bits and scan only those.
+ */
+class EliasFano
+{
+public:
+    class const_iterator;
+
+    /**
+     * @brief creates an empty encoding
+     */
+    EliasFano() :
+        m_size(0),
+        m_low_bits(0),
+        m_max(0)
+    {};
+
+    /**
+     * @brief encodes the values of tree
+     */
+    explicit EliasFano(const Tree<uint64_t>& tree) :
+        m_size(0),
+        m_low_bits(0),
+        m_max(0)
+    {
+        encode(tree);
+    };
+
+    /**
+     * @brief encodes the values of tree, which may be None
+     */
+    explicit EliasFano(const Option<Tree<uint64_t>>& tree) :
+        m_size(0),
+        m_low_bits(0),
+        m_max(0)
+    {
+        if (tree.is_some()) {
+            encode(tree.get_bare());
+        }
+    };
+
+    /**
+     * @brief returns the number of values encoded
+     */
+    inline size_t size() const { return m_size; };
+
+    /**
+     * @brief returns the number of bytes the encoding occupies
+     */
+    size_t bytes() const {
+        return sizeof(*this) +
+            sizeof(uint64_t) * (m_low.capacity() + m_high.capacity()) +
+            sizeof(size_t) * (m_ones.capacity() + m_zeros.capacity());
+    }
+
+    /**
+     * @brief returns True if val is one of the values
+     */
+    bool contains(uint64_t val) const;
+
+    /**
+     * @brief returns the number of values less than val
+     */
+    size_t rank(uint64_t val) const;
+
+    /**
+     * @brief returns the value at index in sorted order (select)
+     *
+     * Throws std::out_of_range if index is not less than size().
+     */
+    uint64_t nth(size_t index) const {
+        if (index >= m_size) {
+            throw std::out_of_range("index past the end of the encoding");
+        }
+        return value(index, select(m_ones, true, index));
+    }
+
+    /**
+     * @brief returns an iterator to the first value not less than val,
+     * or end() if every value is less
+     */
+    const_iterator lower_bound(uint64_t val) const;
+
+    /**
+     * @brief return an iterator to the smallest value
+     */
+    const_iterator begin() const;
+
+    /**
+     * @brief return an iterator to after the largest value
+     */
+    const_iterator end() const;
+
+    /**
+     * @brief returns the values as a balanced Tree, or None if empty
+     */
+    Option<Tree<uint64_t>> to_tree() const;
+
+private:
+
+    /// one select sample is kept for every this many ones (or zeros)
+    enum { sample_rate = 256 };
+
+    void encode(const Tree<uint64_t>& tree);
+
+    /**
+     * @brief returns the low bits of the value at index
+     */
+    uint64_t low(size_t index) const {
+        if (m_low_bits == 0) {
+            return 0;
+        }
+        size_t bit = index * m_low_bits;
+        size_t shift = bit % 64;
+        uint64_t v = m_low[bit / 64] >> shift;
+        if (shift + m_low_bits > 64) {
+            v |= m_low[bit / 64 + 1] << (64 - shift);
+        }
+        return v & ((uint64_t(1) << m_low_bits) - 1);
+    }
+
+    /**
+     * @brief returns the value at index, whose one is at bit pos
+     */
+    uint64_t value(size_t index, size_t pos) const {
+        return (uint64_t(pos - index) << m_low_bits) | low(index);
+    }
+
+    /**
+     * @brief returns the position in m_high of the one (or zero) with
+     * the given rank, starting from the nearest sample
+     */
+    size_t select(const std::vector<size_t>& samples, bool ones,
+                  size_t rank) const;
+
+    /**
+     * @brief returns the position of the next one at or after pos
+     */
+    size_t next_one(size_t pos) const {
+        size_t w = pos / 64;
+        uint64_t bits = m_high[w] & (~uint64_t(0) << (pos % 64));
+        while (bits == 0) {
+            bits = m_high[++w];
+        }
+        return w * 64 + __builtin_ctzll(bits);
+    }
+
+    /// number of values
+    size_t m_size;
+
+    /// number of low bits stored verbatim per value
+    size_t m_low_bits;
+
+    /// the largest value
+    uint64_t m_max;
+
+    /// low bits of every value, packed m_low_bits at a time
+    std::vector<uint64_t> m_low;
+
+    /// value i sets bit (high bits of value i) + i
+    std::vector<uint64_t> m_high;
+
+    /// position in m_high of every sample_rate'th one
+    std::vector<size_t> m_ones;
+
+    /// position in m_high of every sample_rate'th zero
+    std::vector<size_t> m_zeros;
+};
+
+
+/**
+ * @brief Forward iterator over the values of an EliasFano
+ *
+ * Decodes sequentially: each step finds the next one in the high bits,
+ * so a full pass costs O(n) in total.
+ */
+class EliasFano::const_iterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef uint64_t value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const uint64_t* pointer;
+    typedef uint64_t reference;
+
+    uint64_t operator*() const { return m_owner->value(m_index, m_pos); }
+
+    const_iterator& operator++() {
+        if (++m_index < m_owner->m_size) {
+            m_pos = m_owner->next_one(m_pos + 1);
+        }
+        return *this;
+    }
+
+    const_iterator operator++(int) {
+        const_iterator was(*this);
+        ++*this;
+        return was;
+    }
+
+    bool operator==(const const_iterator& rhs) const {
+        return m_owner == rhs.m_owner && m_index == rhs.m_index;
+    }
+
+    bool operator!=(const const_iterator& rhs) const {
+        return !operator==(rhs);
+    }
+
+private:
+    friend class EliasFano;
+
+    const_iterator(const EliasFano* owner, size_t index, size_t pos) :
+        m_owner(owner),
+        m_index(index),
+        m_pos(pos)
+    {};
+
+    /// the encoding being read
+    const EliasFano* m_owner;
+
+    /// index of the current value
+    size_t m_index;
+
+    /// position of the current value's one in m_high
+    size_t m_pos;
+};
+
+
+
+inline void EliasFano::encode(const Tree<uint64_t>& tree)
+{
+    m_size = tree.size();
+    m_max = tree.max();
+    // about log(U/n) low bits leaves at most 2n bits of high part
+    m_low_bits = 0;
+    for (uint64_t buckets = m_max / m_size; buckets > 1; buckets >>= 1) {
+        ++m_low_bits;
+    }
+    size_t high_bits = m_size + static_cast<size_t>(m_max >> m_low_bits) + 1;
+    m_high.assign(high_bits / 64 + 1, 0);
+    // one spare word so low() may always read two
+    m_low.assign(m_size * m_low_bits / 64 + 2, 0);
+
+    size_t index = 0;
+    tree.for_each([this, &index](uint64_t val) {
+        if (m_low_bits > 0) {
+            uint64_t bits = val & ((uint64_t(1) << m_low_bits) - 1);
+            size_t bit = index * m_low_bits;
+            m_low[bit / 64] |= bits << (bit % 64);
+            if (bit % 64 + m_low_bits > 64) {
+                m_low[bit / 64 + 1] |= bits >> (64 - bit % 64);
+            }
+        }
+        size_t pos = static_cast<size_t>(val >> m_low_bits) + index;
+        m_high[pos / 64] |= uint64_t(1) << (pos % 64);
+        ++index;
+    });
+
+    size_t ones = 0;
+    size_t zeros = 0;
+    for (size_t pos=0; pos < high_bits; ++pos) {
+        if (m_high[pos / 64] >> (pos % 64) & 1) {
+            if (ones++ % sample_rate == 0) {
+                m_ones.push_back(pos);
+            }
+        } else if (zeros++ % sample_rate == 0) {
+            m_zeros.push_back(pos);
+        }
+    }
+}
+
+
+inline size_t EliasFano::select(const std::vector<size_t>& samples,
+                                bool ones, size_t rank) const
+{
+    size_t pos = samples[rank / sample_rate];
+    size_t skip = rank % sample_rate;
+    size_t w = pos / 64;
+    uint64_t bits = (ones ? m_high[w] : ~m_high[w]) &
+                    (~uint64_t(0) << (pos % 64));
+    for (;;) {
+        size_t count = __builtin_popcountll(bits);
+        if (skip < count) {
+            break;
+        }
+        skip -= count;
+        ++w;
+        bits = ones ? m_high[w] : ~m_high[w];
+    }
+    while (skip-- > 0) {
+        bits &= bits - 1;
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+
+inline bool EliasFano::contains(uint64_t val) const
+{
+    const_iterator it = lower_bound(val);
+    return it != end() && *it == val;
+}
+
+
+inline size_t EliasFano::rank(uint64_t val) const
+{
+    const_iterator it = lower_bound(val);
+    return it.m_index;
+}
+
+
+inline EliasFano::const_iterator EliasFano::lower_bound(uint64_t val) const
+{
+    if (m_size == 0 || val > m_max) {
+        return end();
+    }
+    // values with the same high bits as val follow the bucket's zero
+    size_t bucket = static_cast<size_t>(val >> m_low_bits);
+    size_t pos = bucket == 0 ? 0 : select(m_zeros, false, bucket - 1) + 1;
+    size_t index = pos - bucket;
+    uint64_t val_low = val & ((uint64_t(1) << m_low_bits) - 1);
+    while (m_high[pos / 64] >> (pos % 64) & 1) {
+        if (!(val_low > low(index))) {
+            return const_iterator(this, index, pos);
+        }
+        ++index;
+        ++pos;
+    }
+    // every value in the bucket is less, so the next one is the answer
+    return const_iterator(this, index, next_one(pos));
+}
+
+
+inline EliasFano::const_iterator EliasFano::begin() const
+{
+    if (m_size == 0) {
+        return end();
+    }
+    return const_iterator(this, 0, next_one(0));
+}
+
+
+inline EliasFano::const_iterator EliasFano::end() const
+{
+    return const_iterator(this, m_size, 0);
+}
+
+
+inline Option<Tree<uint64_t>> EliasFano::to_tree() const
+{
+    return Tree<uint64_t>::from_sorted(begin(), m_size);
+}
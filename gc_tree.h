@@ -0,0 +1,579 @@
+/**
+ * @file
+ * @brief Persistent AVL trees reclaimed by mark-sweep instead of refcounts
+ *
+ * Contains a variant of Tree whose nodes live in a heap and point at
+ * each other with plain pointers. Tree keeps a shared_ptr to each child,
+ * so every path copy increments the counts of the siblings it shares and
+ * every release decrements them: atomic writes to nodes that readers on
+ * other cores have in their caches. Here an update only allocates new
+ * nodes and a read only follows pointers, so neither writes to any node
+ * that already exists.
+ *
+ * In exchange, nothing is freed as a version is dropped. The heap keeps
+ * a registry of the roots that handles hold, and a collector reclaims
+ * nodes that none of them reaches. It works on a snapshot taken when
+ * each cycle begins and runs in steps of bounded work, on whichever
+ * thread calls it, alongside any number of updating and reading threads.
+ *
+ * The registry is the one shared thing an update does write: handing
+ * over the new nodes, and taking or dropping a handle, each lock the
+ * shard of the registry that the root hashes to. Threads working on
+ * different versions mostly take different shards, but two handles on
+ * one version always meet on the same lock.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>        // max
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <stdint.h>         // uintptr_t
+#include <unordered_map>    // root registry
+#include <unordered_set>    // marks
+#include <vector>
+
+template<typename T> class GcTree;
+
+/**
+ * @brief a node of a GcTree; never modified once built
+ */
+template<typename T>
+struct GcNode
+{
+    const T value;
+    const GcNode<T>* const left;
+    const GcNode<T>* const right;
+    const size_t size;
+    const size_t height;
+};
+
+
+/**
+ * @brief Owner of the nodes of a family of GcTrees
+ *
+ * The heap must outlive every GcTree in it. Destroying it frees every
+ * node it still holds.
+ *
+ * Collection runs in cycles. A cycle starts by taking the registered
+ * roots and setting aside the nodes published so far; it then marks
+ * everything those roots reach, in an external set, and finally frees
+ * the set-aside nodes it did not mark. Because nodes never change, what
+ * the roots reached when the cycle began is still exactly what they
+ * reach, and nothing published after that is touched, so no barrier is
+ * needed on updates. A version dropped during a cycle is freed by the
+ * next one.
+ *
+ * collect_step() and collect() may run on one thread at a time, while
+ * other threads update and read.
+ */
+template<typename T>
+class GcHeap
+{
+public:
+    GcHeap() :
+        m_nodes_live(0),
+        m_phase(IDLE),
+        m_sweep_at(0),
+        m_reclaimed(0)
+    {};
+
+    ~GcHeap() {
+        for (size_t s=0; s < SHARDS; ++s) {
+            free(m_shards[s].nodes, 0);
+        }
+        free(m_kept, 0);
+        // a sweep under way has already freed the start of m_old, and
+        // moved what it kept there to m_survivors
+        free(m_survivors, 0);
+        free(m_old, m_phase == SWEEPING ? m_sweep_at : 0);
+    }
+
+    /**
+     * @brief returns the number of nodes allocated and not yet freed
+     */
+    size_t nodes() const { return m_nodes_live.load(); };
+
+    /**
+     * @brief returns the number of distinct roots registered
+     */
+    size_t roots() const {
+        size_t count = 0;
+        for (size_t s=0; s < SHARDS; ++s) {
+            std::lock_guard<std::mutex> lock(m_shards[s].lock);
+            count += m_shards[s].roots.size();
+        }
+        return count;
+    }
+
+    /**
+     * @brief returns the number of nodes freed so far
+     */
+    size_t reclaimed() const { return m_reclaimed.load(); };
+
+    /**
+     * @brief does up to budget nodes' worth of collection
+     *
+     * Returns True when this step finished a cycle. The next call
+     * starts another one.
+     */
+    bool collect_step(size_t budget);
+
+    /**
+     * @brief runs collection until a whole cycle has finished
+     *
+     * A cycle already under way is finished first, and then a fresh
+     * one is run, so everything unreachable when collect() was called
+     * is freed.
+     */
+    void collect() {
+        std::lock_guard<std::mutex> collecting(m_collector);
+        bool fresh = m_phase == IDLE;
+        while (!step(1024) || !fresh) {
+            fresh = fresh || m_phase == IDLE;
+        }
+    }
+
+private:
+    friend class GcTree<T>;
+
+    /**
+     * @brief blocked copy constructor, not implemented
+     */
+    GcHeap(const GcHeap&);
+
+    /**
+     * @brief blocked copy assignment operator, not implemented
+     */
+    GcHeap& operator=(const GcHeap&);
+
+    /**
+     * @brief makes built visible to the collector and registers root,
+     * as one step so that no cycle sees one without the other
+     */
+    void publish(const std::vector<const GcNode<T>*>& built,
+                 const GcNode<T>* root) {
+        Shard& shard = shard_of(root);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.nodes.insert(shard.nodes.end(), built.begin(), built.end());
+        m_nodes_live += built.size();
+        if (root != NULL) {
+            ++shard.roots[root];
+        }
+    }
+
+    void hold(const GcNode<T>* root) {
+        if (root != NULL) {
+            Shard& shard = shard_of(root);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            ++shard.roots[root];
+        }
+    }
+
+    void release(const GcNode<T>* root) {
+        if (root != NULL) {
+            Shard& shard = shard_of(root);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            typename Roots::iterator it = shard.roots.find(root);
+            if (--it->second == 0) {
+                shard.roots.erase(it);
+            }
+        }
+    }
+
+    bool step(size_t budget);
+
+    /**
+     * @brief deletes nodes[from..]
+     */
+    static void free(const std::vector<const GcNode<T>*>& nodes, size_t from) {
+        for (size_t i=from; i < nodes.size(); ++i) {
+            delete nodes[i];
+        }
+    }
+
+    enum Phase { IDLE, MARKING, SWEEPING };
+
+    /// number of parts the registry is split into
+    enum { SHARDS = 16 };
+
+    typedef std::unordered_map<const GcNode<T>*, size_t> Roots;
+
+    /**
+     * @brief the registered roots that hash to one shard, and the nodes
+     * published with them since the current cycle began
+     */
+    struct Shard
+    {
+        /// guards roots and nodes
+        std::mutex lock;
+
+        /// registered roots, with the number of handles holding each
+        Roots roots;
+
+        std::vector<const GcNode<T>*> nodes;
+    };
+
+    Shard& shard_of(const GcNode<T>* root) {
+        // nodes are heap allocated, so the low bits say little
+        return m_shards[(reinterpret_cast<uintptr_t>(root) >> 6) % SHARDS];
+    }
+
+    /// the registry; a cycle starts with every shard locked
+    mutable Shard m_shards[SHARDS];
+
+    /// held by whichever thread is collecting
+    std::mutex m_collector;
+
+    /// count of nodes not yet freed
+    std::atomic<size_t> m_nodes_live;
+
+    // the rest belongs to the collector
+
+    Phase m_phase;
+
+    /// nodes that survived the last cycle
+    std::vector<const GcNode<T>*> m_kept;
+
+    /// nodes published before the current cycle began
+    std::vector<const GcNode<T>*> m_old;
+
+    /// nodes reached from the roots of the current cycle
+    std::unordered_set<const GcNode<T>*> m_marked;
+
+    /// nodes reached but whose children have not been looked at
+    std::vector<const GcNode<T>*> m_pending;
+
+    /// nodes of m_old to keep
+    std::vector<const GcNode<T>*> m_survivors;
+
+    /// next node of m_old to sweep
+    size_t m_sweep_at;
+
+    /// count of nodes freed
+    std::atomic<size_t> m_reclaimed;
+};
+
+
+/**
+ * @brief Persistent AVL tree whose nodes belong to a GcHeap
+ *
+ * A GcTree is a handle on one version: while it exists its root is
+ * registered, and the version cannot be collected. Updates return new
+ * handles, as with Tree. Nodes are only valid through a handle, so
+ * anything read out of a version must be copied before its last handle
+ * goes.
+ */
+template<typename T>
+class GcTree
+{
+public:
+    /**
+     * @brief creates an empty tree in heap
+     */
+    explicit GcTree(GcHeap<T>& heap) :
+        m_heap(&heap),
+        m_root(NULL)
+    {};
+
+    GcTree(const GcTree<T>& other) :
+        m_heap(other.m_heap),
+        m_root(other.m_root)
+    {
+        m_heap->hold(m_root);
+    }
+
+    GcTree<T>& operator=(const GcTree<T>& other) {
+        other.m_heap->hold(other.m_root);
+        m_heap->release(m_root);
+        m_heap = other.m_heap;
+        m_root = other.m_root;
+        return *this;
+    }
+
+    ~GcTree() {
+        m_heap->release(m_root);
+    }
+
+    inline size_t size() const { return m_root != NULL ? m_root->size : 0; };
+
+    inline size_t height() const { return m_root != NULL ? m_root->height : 0; };
+
+    /**
+     * @brief returns True if the tree has an element equal to val
+     */
+    bool contains(const T& val) const {
+        const GcNode<T>* node = m_root;
+        while (node != NULL && !(node->value == val)) {
+            node = node->value > val ? node->left : node->right;
+        }
+        return node != NULL;
+    }
+
+    /**
+     * @brief returns a new tree with val inserted into it
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    GcTree<T> insert(const T& val) const {
+        Builder b;
+        const GcNode<T>* root = b.insert(m_root, val);
+        return GcTree<T>(*m_heap, b, root);
+    }
+
+    /**
+     * @brief returns a new tree with val removed from it, or an equal
+     * tree if val is not in it
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    GcTree<T> remove(const T& val) const {
+        Builder b;
+        bool found = false;
+        const GcNode<T>* root = b.remove(m_root, val, found);
+        return found ? GcTree<T>(*m_heap, b, root) : *this;
+    }
+
+    std::list<T> toList() const {
+        std::list<T> l;
+        collect(m_root, l);
+        return l;
+    }
+
+private:
+
+    /**
+     * @brief allocates the nodes of one update and remembers them until
+     * they are published, freeing them if the update fails
+     */
+    class Builder
+    {
+    public:
+        Builder() {};
+
+        ~Builder() {
+            for (size_t i=0; i < m_built.size(); ++i) {
+                delete m_built[i];
+            }
+        }
+
+        const GcNode<T>* make(const T& value,
+                              const GcNode<T>* left,
+                              const GcNode<T>* right) {
+            m_built.reserve(m_built.size() + 1);
+            GcNode<T>* node = new GcNode<T>{
+                value, left, right,
+                size(left) + 1 + size(right),
+                std::max(height(left), height(right)) + 1 };
+            m_built.push_back(node);
+            return node;
+        }
+
+        /**
+         * @brief a node for value over left and right, rotated if they
+         * differ in height by more than one
+         */
+        const GcNode<T>* balance(const T& value,
+                                 const GcNode<T>* left,
+                                 const GcNode<T>* right) {
+            if (height(left) > height(right) + 1) {
+                const GcNode<T>* outer = left->left;
+                const GcNode<T>* inner = left->right;
+                if (height(outer) >= height(inner)) {
+                    return make(left->value, outer,
+                                make(value, inner, right));
+                }
+                return make(inner->value,
+                            make(left->value, outer, inner->left),
+                            make(value, inner->right, right));
+            }
+            if (height(right) > height(left) + 1) {
+                const GcNode<T>* outer = right->right;
+                const GcNode<T>* inner = right->left;
+                if (height(outer) >= height(inner)) {
+                    return make(right->value,
+                                make(value, left, inner), outer);
+                }
+                return make(inner->value,
+                            make(value, left, inner->left),
+                            make(right->value, inner->right, outer));
+            }
+            return make(value, left, right);
+        }
+
+        const GcNode<T>* insert(const GcNode<T>* at, const T& val) {
+            if (at == NULL) {
+                return make(val, NULL, NULL);
+            } else if (at->value > val) {
+                return balance(at->value, insert(at->left, val), at->right);
+            }
+            return balance(at->value, at->left, insert(at->right, val));
+        }
+
+        const GcNode<T>* remove(const GcNode<T>* at, const T& val,
+                                bool& found) {
+            if (at == NULL) {
+                return NULL;
+            } else if (at->value == val) {
+                found = true;
+                if (at->left == NULL) {
+                    return at->right;
+                } else if (at->right == NULL) {
+                    return at->left;
+                }
+                const GcNode<T>* min_node = at->right;
+                while (min_node->left != NULL) {
+                    min_node = min_node->left;
+                }
+                bool ignored = false;
+                return balance(min_node->value, at->left,
+                               remove(at->right, min_node->value, ignored));
+            } else if (at->value > val) {
+                const GcNode<T>* left = remove(at->left, val, found);
+                return found ? balance(at->value, left, at->right) : at;
+            }
+            const GcNode<T>* right = remove(at->right, val, found);
+            return found ? balance(at->value, at->left, right) : at;
+        }
+
+        /**
+         * @brief hands the nodes over to heap, registering root
+         */
+        void publish(GcHeap<T>& heap, const GcNode<T>* root) {
+            heap.publish(m_built, root);
+            m_built.clear();
+        }
+
+    private:
+        Builder(const Builder&);
+        Builder& operator=(const Builder&);
+
+        std::vector<const GcNode<T>*> m_built;
+    };
+
+    /**
+     * @brief creates a handle on the version at root that b built
+     */
+    GcTree(GcHeap<T>& heap, Builder& b, const GcNode<T>* root) :
+        m_heap(&heap),
+        m_root(root)
+    {
+        b.publish(heap, root);
+    }
+
+    static size_t size(const GcNode<T>* node) {
+        return node != NULL ? node->size : 0;
+    }
+
+    static size_t height(const GcNode<T>* node) {
+        return node != NULL ? node->height : 0;
+    }
+
+    static void collect(const GcNode<T>* node, std::list<T>& l) {
+        if (node != NULL) {
+            collect(node->left, l);
+            l.push_back(node->value);
+            collect(node->right, l);
+        }
+    }
+
+    /// the heap holding the nodes
+    GcHeap<T>* m_heap;
+
+    /// the head node, or NULL if empty
+    const GcNode<T>* m_root;
+};
+
+
+
+template<typename T>
+bool GcHeap<T>::collect_step(size_t budget)
+{
+    std::lock_guard<std::mutex> collecting(m_collector);
+    return step(budget);
+}
+
+
+template<typename T>
+bool GcHeap<T>::step(size_t budget)
+{
+    if (m_phase == IDLE) {
+        // holding every shard at once makes the snapshot consistent: no
+        // publish is seen with its nodes but not its root, or the reverse
+        for (size_t s=0; s < SHARDS; ++s) {
+            m_shards[s].lock.lock();
+        }
+        m_old.swap(m_kept);
+        for (size_t s=0; s < SHARDS; ++s) {
+            Shard& shard = m_shards[s];
+            m_old.insert(m_old.end(), shard.nodes.begin(), shard.nodes.end());
+            shard.nodes.clear();
+            for (typename Roots::const_iterator it = shard.roots.begin();
+                 it != shard.roots.end(); ++it) {
+                m_pending.push_back(it->first);
+            }
+        }
+        for (size_t s=SHARDS; s-- > 0; ) {
+            m_shards[s].lock.unlock();
+        }
+        m_phase = MARKING;
+    }
+    while (m_phase == MARKING && budget > 0) {
+        if (m_pending.empty()) {
+            m_phase = SWEEPING;
+            m_sweep_at = 0;
+            break;
+        }
+        const GcNode<T>* node = m_pending.back();
+        m_pending.pop_back();
+        --budget;
+        // a subtree already marked is marked all the way down
+        if (m_marked.insert(node).second) {
+            if (node->left != NULL) {
+                m_pending.push_back(node->left);
+            }
+            if (node->right != NULL) {
+                m_pending.push_back(node->right);
+            }
+        }
+    }
+    while (m_phase == SWEEPING && budget > 0) {
+        if (m_sweep_at == m_old.size()) {
+            m_kept.swap(m_survivors);
+            m_old.clear();
+            m_marked.clear();
+            m_phase = IDLE;
+            return true;
+        }
+        const GcNode<T>* node = m_old[m_sweep_at++];
+        --budget;
+        if (m_marked.count(node) != 0) {
+            m_survivors.push_back(node);
+        } else {
+            delete node;
+            --m_nodes_live;
+            ++m_reclaimed;
+        }
+    }
+    return false;
+}
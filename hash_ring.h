@@ -0,0 +1,255 @@
+/**
+ * @file
+ * @brief Consistent-hash ring on a persistent tree
+ *
+ * Contains a consistent-hash ring for routing keys to backends. Each
+ * backend owns a number of virtual-node tokens on a 64-bit ring, kept
+ * in a persistent Tree, and a key goes to the owner of the first token
+ * at or after the key's hash, wrapping around at the top. Membership
+ * changes build a new version of the tree and publish it atomically,
+ * so routing never waits for them and never sees one half applied.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <mutex>        // writers take turns
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "atomic_root.h"
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Consistent-hash ring of named backends
+ *
+ * Any number of threads may route at once, and never block: the ring
+ * is published through an AtomicRoot, so a lookup does a few atomic
+ * operations and never waits for another lookup or for a membership
+ * change. Membership changes are serialised among themselves by a
+ * mutex that routing never takes, and each waits for lookups already
+ * reading the version it replaces.
+ */
+class HashRing
+{
+public:
+    /**
+     * @brief a virtual node: one point on the ring owned by a backend
+     *
+     * Tokens order by position, then by backend so that two backends
+     * hashing to the same point are both kept.
+     */
+    struct Token
+    {
+        uint64_t position;
+        std::string backend;
+
+        bool operator==(const Token& rhs) const {
+            return position == rhs.position && backend == rhs.backend;
+        }
+        bool operator!=(const Token& rhs) const { return !operator==(rhs); }
+        bool operator>(const Token& rhs) const {
+            return position > rhs.position ||
+                   (position == rhs.position && backend > rhs.backend);
+        }
+    };
+
+    /**
+     * @brief creates an empty ring giving each backend replicas tokens
+     */
+    explicit HashRing(size_t replicas = 64) :
+        m_replicas(replicas)
+    {
+        if (replicas == 0) {
+            throw std::invalid_argument("backends need at least one token");
+        }
+    };
+
+    /**
+     * @brief adds backend to the ring, if it is not already there
+     */
+    void add(const std::string& backend) {
+        update(std::vector<std::string>(1, backend), std::vector<std::string>());
+    }
+
+    /**
+     * @brief removes backend from the ring, if it is there
+     */
+    void remove(const std::string& backend) {
+        update(std::vector<std::string>(), std::vector<std::string>(1, backend));
+    }
+
+    /**
+     * @brief adds and removes several backends as one change
+     *
+     * Routing sees either none of the change or all of it.
+     */
+    void update(const std::vector<std::string>& added,
+                const std::vector<std::string>& removed);
+
+    /**
+     * @brief returns the ring as it is now, or None if it is empty
+     *
+     * A snapshot never changes, and can be routed against with
+     * route(snapshot, key) for as long as it is held.
+     */
+    Option<Tree<Token>> snapshot() const {
+        return m_root.load();
+    }
+
+    /**
+     * @brief returns the number of backends on the ring
+     */
+    size_t backends() const { return tree_size(snapshot()) / m_replicas; }
+
+    /**
+     * @brief returns the backend key is routed to
+     *
+     * Throws std::out_of_range if the ring is empty.
+     */
+    std::string route(const std::string& key) const {
+        return route(snapshot(), key);
+    }
+
+    /**
+     * @brief returns the backend for each of keys, all routed against
+     * the same version of the ring
+     *
+     * Throws std::out_of_range if the ring is empty.
+     */
+    std::vector<std::string> route(const std::vector<std::string>& keys) const;
+
+    /**
+     * @brief returns the backend key is routed to on ring
+     *
+     * Throws std::out_of_range if ring is None.
+     */
+    static const std::string& route(const Option<Tree<Token>>& ring,
+                                    const std::string& key);
+
+    /**
+     * @brief returns the position of key on the ring
+     *
+     * 64-bit FNV-1a, with the bits mixed afterwards so that keys that
+     * differ only at the end still land far apart.
+     */
+    static uint64_t hash(const std::string& key) {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i=0; i < key.size(); ++i) {
+            h ^= static_cast<unsigned char>(key[i]);
+            h *= 1099511628211ull;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+
+    /**
+     * @brief blocked copy constructor, not implemented
+     */
+    HashRing(const HashRing&);
+
+    /**
+     * @brief blocked copy assignment operator, not implemented
+     */
+    HashRing& operator=(const HashRing&);
+
+    /**
+     * @brief the replica'th token of backend
+     */
+    static Token token(const std::string& backend, size_t replica) {
+        std::ostringstream name;
+        name << backend << '#' << replica;
+        Token t = { hash(name.str()), backend };
+        return t;
+    }
+
+    /// tokens per backend
+    const size_t m_replicas;
+
+    /// held by membership changes, never by routing
+    std::mutex m_writer;
+
+    /// the published ring, None while empty
+    AtomicRoot<Token> m_root;
+};
+
+
+
+inline void HashRing::update(const std::vector<std::string>& added,
+                             const std::vector<std::string>& removed)
+{
+    std::lock_guard<std::mutex> lock(m_writer);
+    Option<Tree<Token>> root = m_root.load();
+    for (size_t i=0; i < removed.size(); ++i) {
+        if (root.is_none() || !root->contains(token(removed[i], 0))) {
+            continue;
+        }
+        for (size_t r=0; r < m_replicas && root.is_some(); ++r) {
+            root = root->remove(token(removed[i], r));
+        }
+    }
+    for (size_t i=0; i < added.size(); ++i) {
+        if (root.is_some() && root->contains(token(added[i], 0))) {
+            continue;
+        }
+        for (size_t r=0; r < m_replicas; ++r) {
+            Token t = token(added[i], r);
+            root = root.is_some() ? Some(root->insert(t)) : Some(Tree<Token>(t));
+        }
+    }
+    m_root.store(root);
+}
+
+
+inline const std::string& HashRing::route(const Option<Tree<Token>>& ring,
+                                          const std::string& key)
+{
+    if (ring.is_none()) {
+        throw std::out_of_range("no backends on the ring");
+    }
+    // the empty name sorts before every backend at the same position
+    Token probe = { hash(key), std::string() };
+    const Token* owner = ring->ceiling(probe);
+    if (owner == NULL) {
+        // past the last token: wrap around to the first
+        owner = &ring->min();
+    }
+    return owner->backend;
+}
+
+
+inline std::vector<std::string>
+HashRing::route(const std::vector<std::string>& keys) const
+{
+    Option<Tree<Token>> ring = snapshot();
+    std::vector<std::string> backends;
+    backends.reserve(keys.size());
+    for (size_t i=0; i < keys.size(); ++i) {
+        backends.push_back(route(ring, keys[i]));
+    }
+    return backends;
+}
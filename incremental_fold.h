@@ -0,0 +1,193 @@
+/**
+ * @file
+ * @brief Folds over tree versions that reuse results for shared subtrees
+ *
+ * Contains a cache for a user-defined fold (a sum, a histogram, a hash,
+ * a derived index...) over trees. Each subtree's result is remembered
+ * against the node itself, so folding a new version only evaluates the
+ * nodes the update created: O(changes * log n) instead of O(n).
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>        // min
+#include <memory>           // shared_ptr, weak_ptr
+#include <unordered_map>    // results by node
+#include <vector>
+
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+
+template<typename Container, typename F> class IncrementalFold;
+
+/**
+ * @brief Memoised fold over the versions of a Tree
+ *
+ * F combines a node's value with the results for its two subtrees:
+ *
+ *     typedef R result_type;
+ *     R operator()(const R& left, const T& value, const R& right) const;
+ *
+ * and an empty subtree folds to the empty value given at construction.
+ * The result of a subtree must depend only on its contents.
+ *
+ * Results are held against weak references to their nodes, so the
+ * cache never keeps a version alive. A weak reference does keep the
+ * node's control block, and with make_shared its storage, so entries
+ * for destroyed nodes are dropped as the cache goes: each fold() also
+ * checks a slice of the cache, four buckets for every node it
+ * evaluated plus a few more, and carries on from there next time.
+ * prune() drops them all at once.
+ *
+ * @note an IncrementalFold is not safe to share between threads
+ */
+template<typename T, typename F>
+class IncrementalFold<Tree<T>, F>
+{
+public:
+    /// the type the fold produces
+    typedef typename F::result_type Result;
+
+    /**
+     * @brief creates an empty cache for f
+     */
+    explicit IncrementalFold(const F& f = F(), const Result& empty = Result()) :
+        m_f(f),
+        m_empty(empty),
+        m_evaluations(0),
+        m_sweep_at(0)
+    {};
+
+    /**
+     * @brief returns the fold of tree, which may be None
+     *
+     * Only nodes not seen before (since they were last pruned) are
+     * evaluated.
+     */
+    Result fold(const Option<Tree<T>>& tree) {
+        size_t before = m_evaluations;
+        Result result = compute(tree);
+        sweep(4 * (m_evaluations - before) + 16);
+        return result;
+    }
+
+    /**
+     * @brief drops the results of subtrees that no longer exist
+     */
+    void prune() {
+        TREE_TRACE_SCOPE(trace, "IncrementalFold::prune");
+        typename Cache::iterator it = m_cache.begin();
+        while (it != m_cache.end()) {
+            if (it->second.node.expired()) {
+                TREE_TRACE_COUNT(trace, 1, sizeof(Entry));
+                it = m_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /**
+     * @brief returns the number of subtree results held
+     */
+    inline size_t cached() const { return m_cache.size(); };
+
+    /**
+     * @brief returns the number of times F has been called so far
+     */
+    inline size_t evaluations() const { return m_evaluations; };
+
+private:
+
+    /**
+     * @brief the result for a subtree, and the subtree it is for
+     */
+    struct Entry
+    {
+        std::weak_ptr<Tree<T>> node;
+        Result result;
+    };
+
+    typedef std::unordered_map<const Tree<T>*, Entry> Cache;
+
+    /**
+     * @brief drops the expired entries in the next count buckets
+     *
+     * Erasing never rehashes, so the buckets stay put while they are
+     * checked; a rehash between sweeps only moves where the next starts.
+     */
+    void sweep(size_t count) {
+        TREE_TRACE_SCOPE(trace, "IncrementalFold::sweep");
+        size_t buckets = m_cache.bucket_count();
+        count = std::min(count, buckets);
+        std::vector<const Tree<T>*> expired;
+        for (size_t i=0; i < count; ++i) {
+            size_t b = m_sweep_at++ % buckets;
+            typename Cache::local_iterator it = m_cache.begin(b);
+            for (; it != m_cache.end(b); ++it) {
+                if (it->second.node.expired()) {
+                    expired.push_back(it->first);
+                }
+            }
+        }
+        m_sweep_at %= buckets;
+        for (size_t i=0; i < expired.size(); ++i) {
+            TREE_TRACE_COUNT(trace, 1, sizeof(Entry));
+            m_cache.erase(expired[i]);
+        }
+    }
+
+    Result compute(const Option<Tree<T>>& tree) {
+        if (tree.is_none()) {
+            return m_empty;
+        }
+        std::shared_ptr<Tree<T>> node = tree.get_ref();
+        typename Cache::iterator it = m_cache.find(node.get());
+        // a live entry is for this node; the address of a destroyed one
+        // may have been reused
+        if (it != m_cache.end() && !it->second.node.expired()) {
+            return it->second.result;
+        }
+        Result result = m_f(compute(node->left()),
+                            node->deref(),
+                            compute(node->right()));
+        ++m_evaluations;
+        Entry& entry = m_cache[node.get()];
+        entry.node = node;
+        entry.result = result;
+        return result;
+    }
+
+    /// the fold
+    const F m_f;
+
+    /// the fold of an empty subtree
+    const Result m_empty;
+
+    /// results by node address
+    Cache m_cache;
+
+    /// calls to m_f so far
+    size_t m_evaluations;
+
+    /// the bucket the next sweep starts at
+    size_t m_sweep_at;
+};
@@ -0,0 +1,442 @@
+/**
+ * @file
+ * @brief Persistent k-d tree for multi-dimensional points
+ *
+ * Contains a persistent k-d tree: a binary tree of points that splits
+ * on each coordinate in turn, with orthogonal range, radius and
+ * nearest-neighbour queries. As with Tree, nodes are immutable and an
+ * update copies only the path it changes, so every earlier version of a
+ * moving point set stays queryable for as long as it is held.
+ *
+ * A k-d tree cannot be rotated the way an AVL tree is, because the
+ * axis a node splits on depends on its depth. Instead, any subtree that
+ * an update leaves lopsided (one child holding more than 3/4 of it) is
+ * rebuilt around its medians, as in a scapegoat tree. Rebuilding costs
+ * O(m log m) for a subtree of m points but happens rarely enough that
+ * updates stay O(log^2 n) amortised, and the depth stays O(log n).
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // nth_element, max, sort
+#include <array>
+#include <list>
+#include <memory>       // shared_ptr
+#include <queue>        // priority_queue
+#include <utility>      // pair
+#include <vector>
+
+/**
+ * @brief Persistent k-d tree of D-dimensional points with coordinates
+ * of type C
+ *
+ * C must be an arithmetic type; distances are Euclidean and computed in
+ * double. The same point may be held more than once. Like Tree, a
+ * KdTree is never modified; every update returns a new one, and copies
+ * are cheap.
+ *
+ * Each node splits its subtree on axis depth % D: points in its left
+ * subtree have that coordinate no greater than the node's, and points
+ * in its right subtree no less.
+ */
+template<typename C, size_t D>
+class KdTree
+{
+public:
+    /// a point
+    typedef std::array<C, D> Point;
+
+    /**
+     * @brief creates an empty tree
+     */
+    KdTree() {};
+
+    /**
+     * @brief creates a balanced tree of points
+     */
+    explicit KdTree(std::vector<Point> points) :
+        m_root(build(points, 0, points.size(), 0))
+    {};
+
+    /**
+     * @brief returns the number of points in the tree
+     */
+    inline size_t size() const { return size(m_root); };
+
+    /**
+     * @brief returns the number of levels in the tree
+     */
+    size_t height() const { return height(m_root); };
+
+    /**
+     * @brief returns True if point is in the tree
+     */
+    bool contains(const Point& point) const {
+        return contains(m_root, point, 0);
+    }
+
+    /**
+     * @brief returns a new tree with point added to it
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    KdTree<C, D> insert(const Point& point) const {
+        return KdTree<C, D>(insert(m_root, point, 0));
+    }
+
+    /**
+     * @brief returns a new tree with one copy of point removed from it,
+     * or this tree if point is not in it
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    KdTree<C, D> remove(const Point& point) const {
+        bool found = false;
+        Link root = remove(m_root, point, 0, found);
+        return found ? KdTree<C, D>(root) : *this;
+    }
+
+    /**
+     * @brief returns the points p with lo[i] <= p[i] <= hi[i] on every
+     * axis i, in no particular order
+     */
+    std::vector<Point> range(const Point& lo, const Point& hi) const {
+        std::vector<Point> found;
+        range(m_root, lo, hi, 0, found);
+        return found;
+    }
+
+    /**
+     * @brief returns the points no further than radius from center, in
+     * no particular order
+     */
+    std::vector<Point> within(const Point& center, double radius) const {
+        std::vector<Point> found;
+        within(m_root, center, radius * radius, 0, found);
+        return found;
+    }
+
+    /**
+     * @brief returns the k points nearest to center, nearest first
+     *
+     * Returns every point if there are fewer than k. Points equally
+     * far away are returned in no particular order.
+     */
+    std::vector<Point> nearest(const Point& center, size_t k) const;
+
+    /**
+     * @brief returns the squared distance between two points
+     */
+    static double distance2(const Point& a, const Point& b) {
+        double total = 0;
+        for (size_t i=0; i < D; ++i) {
+            double d = static_cast<double>(a[i]) - static_cast<double>(b[i]);
+            total += d * d;
+        }
+        return total;
+    }
+
+    /**
+     * @brief returns the points, in the order of the tree
+     */
+    std::list<Point> toList() const {
+        std::list<Point> l;
+        collect(m_root, l);
+        return l;
+    }
+
+private:
+
+    struct Node;
+    typedef std::shared_ptr<const Node> Link;
+
+    /**
+     * @brief one point and the subtrees on either side of it
+     */
+    struct Node
+    {
+        Node(const Point& point, const Link& left, const Link& right) :
+            point(point),
+            left(left),
+            right(right),
+            size(1 + KdTree::size(left) + KdTree::size(right))
+        {};
+
+        const Point point;
+        const Link left;
+        const Link right;
+
+        /// number of points in this subtree
+        const size_t size;
+    };
+
+    /// the farthest of the nearest points found so far on top
+    typedef std::priority_queue<std::pair<double, const Point*> > Nearest;
+
+    explicit KdTree(const Link& root) :
+        m_root(root)
+    {};
+
+    static size_t size(const Link& at) { return at ? at->size : 0; }
+
+    static size_t height(const Link& at) {
+        return at ? 1 + std::max(height(at->left), height(at->right)) : 0;
+    }
+
+    static Link make(const Point& point, const Link& left, const Link& right) {
+        return std::make_shared<const Node>(point, left, right);
+    }
+
+    /**
+     * @brief build a balanced subtree of points[lo, hi) at depth
+     *
+     * Each node is the median along its axis, so the split invariant
+     * holds even where coordinates repeat.
+     */
+    static Link build(std::vector<Point>& points, size_t lo, size_t hi,
+                      size_t depth) {
+        if (lo == hi) {
+            return Link();
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        size_t axis = depth % D;
+        std::nth_element(points.begin() + lo,
+                         points.begin() + mid,
+                         points.begin() + hi,
+                         [axis](const Point& a, const Point& b) {
+                             return a[axis] < b[axis];
+                         });
+        Link left = build(points, lo, mid, depth + 1);
+        Link right = build(points, mid + 1, hi, depth + 1);
+        return make(points[mid], left, right);
+    }
+
+    /**
+     * @brief returns at, or at rebuilt if one side holds more than 3/4
+     * of it
+     */
+    static Link balanced(const Link& at, size_t depth) {
+        if (!at || 4 * std::max(size(at->left), size(at->right)) <= 3 * at->size) {
+            return at;
+        }
+        std::list<Point> l;
+        collect(at, l);
+        std::vector<Point> points(l.begin(), l.end());
+        return build(points, 0, points.size(), depth);
+    }
+
+    static void collect(const Link& at, std::list<Point>& l) {
+        if (at) {
+            collect(at->left, l);
+            l.push_back(at->point);
+            collect(at->right, l);
+        }
+    }
+
+    static bool contains(const Link& at, const Point& point, size_t depth) {
+        if (!at) {
+            return false;
+        } else if (at->point == point) {
+            return true;
+        }
+        size_t axis = depth % D;
+        return (point[axis] <= at->point[axis] &&
+                contains(at->left, point, depth + 1)) ||
+               (!(point[axis] < at->point[axis]) &&
+                contains(at->right, point, depth + 1));
+    }
+
+    static Link insert(const Link& at, const Point& point, size_t depth) {
+        if (!at) {
+            return make(point, Link(), Link());
+        }
+        size_t axis = depth % D;
+        if (point[axis] < at->point[axis]) {
+            return balanced(make(at->point,
+                                 insert(at->left, point, depth + 1),
+                                 at->right), depth);
+        }
+        return balanced(make(at->point,
+                             at->left,
+                             insert(at->right, point, depth + 1)), depth);
+    }
+
+    /**
+     * @brief remove point from the subtree at
+     *
+     * @param[out] found set to true if point was in the subtree. If it
+     * was not, at is returned and nothing is copied.
+     */
+    static Link remove(const Link& at, const Point& point, size_t depth,
+                       bool& found) {
+        if (!at) {
+            return at;
+        } else if (at->point == point) {
+            found = true;
+            return balanced(removeHead(at, depth), depth);
+        }
+        size_t axis = depth % D;
+        // a point equal to this one on the axis may be on either side
+        if (point[axis] <= at->point[axis]) {
+            Link left = remove(at->left, point, depth + 1, found);
+            if (found) {
+                return balanced(make(at->point, left, at->right), depth);
+            }
+        }
+        if (!(point[axis] < at->point[axis])) {
+            Link right = remove(at->right, point, depth + 1, found);
+            if (found) {
+                return balanced(make(at->point, at->left, right), depth);
+            }
+        }
+        return at;
+    }
+
+    /**
+     * @brief remove the head of at, replacing it with the least point
+     * on its axis from the right, or else the greatest from the left
+     */
+    static Link removeHead(const Link& at, size_t depth) {
+        size_t axis = depth % D;
+        bool found = false;
+        if (at->right) {
+            Point next = *extreme(at->right, axis, depth + 1, false);
+            Link right = remove(at->right, next, depth + 1, found);
+            return make(next, at->left, right);
+        } else if (at->left) {
+            Point prev = *extreme(at->left, axis, depth + 1, true);
+            Link left = remove(at->left, prev, depth + 1, found);
+            return make(prev, left, Link());
+        }
+        return Link();
+    }
+
+    /**
+     * @brief the point of a non-empty subtree with the least (or, if
+     * greatest is set, the greatest) coordinate on axis
+     */
+    static const Point* extreme(const Link& at, size_t axis, size_t depth,
+                                bool greatest) {
+        const Point* best = &at->point;
+        // only one side can beat this node if it splits on axis
+        const Link& skip = greatest ? at->left : at->right;
+        const Link* sides[] = { &at->left, &at->right };
+        for (size_t i=0; i < 2; ++i) {
+            const Link& side = *sides[i];
+            if (!side || (depth % D == axis && &side == &skip)) {
+                continue;
+            }
+            const Point* p = extreme(side, axis, depth + 1, greatest);
+            if (greatest ? (*p)[axis] > (*best)[axis]
+                         : (*p)[axis] < (*best)[axis]) {
+                best = p;
+            }
+        }
+        return best;
+    }
+
+    static void range(const Link& at, const Point& lo, const Point& hi,
+                      size_t depth, std::vector<Point>& found) {
+        if (!at) {
+            return;
+        }
+        bool inside = true;
+        for (size_t i=0; i < D && inside; ++i) {
+            inside = !(at->point[i] < lo[i]) && !(hi[i] < at->point[i]);
+        }
+        if (inside) {
+            found.push_back(at->point);
+        }
+        size_t axis = depth % D;
+        if (!(at->point[axis] < lo[axis])) {
+            range(at->left, lo, hi, depth + 1, found);
+        }
+        if (!(hi[axis] < at->point[axis])) {
+            range(at->right, lo, hi, depth + 1, found);
+        }
+    }
+
+    static void within(const Link& at, const Point& center, double radius2,
+                       size_t depth, std::vector<Point>& found) {
+        if (!at) {
+            return;
+        }
+        if (distance2(at->point, center) <= radius2) {
+            found.push_back(at->point);
+        }
+        size_t axis = depth % D;
+        double gap = static_cast<double>(center[axis]) -
+                     static_cast<double>(at->point[axis]);
+        // the far side is only worth visiting if the splitting plane is
+        // within the radius
+        if (gap <= 0 || gap * gap <= radius2) {
+            within(at->left, center, radius2, depth + 1, found);
+        }
+        if (gap >= 0 || gap * gap <= radius2) {
+            within(at->right, center, radius2, depth + 1, found);
+        }
+    }
+
+    static void nearest(const Link& at, const Point& center, size_t k,
+                        size_t depth, Nearest& best) {
+        if (!at) {
+            return;
+        }
+        double d = distance2(at->point, center);
+        if (best.size() < k) {
+            best.push(std::make_pair(d, &at->point));
+        } else if (d < best.top().first) {
+            best.pop();
+            best.push(std::make_pair(d, &at->point));
+        }
+        size_t axis = depth % D;
+        double gap = static_cast<double>(center[axis]) -
+                     static_cast<double>(at->point[axis]);
+        const Link& near = gap < 0 ? at->left : at->right;
+        const Link& far = gap < 0 ? at->right : at->left;
+        nearest(near, center, k, depth + 1, best);
+        if (best.size() < k || gap * gap < best.top().first) {
+            nearest(far, center, k, depth + 1, best);
+        }
+    }
+
+    /// the head node, or NULL if the tree is empty
+    Link m_root;
+};
+
+
+
+template<typename C, size_t D>
+std::vector<typename KdTree<C, D>::Point>
+KdTree<C, D>::nearest(const Point& center, size_t k) const
+{
+    Nearest best;
+    if (k > 0) {
+        nearest(m_root, center, k, 0, best);
+    }
+    std::vector<Point> found(best.size());
+    for (size_t i = found.size(); i > 0; --i) {
+        found[i - 1] = *best.top().second;
+        best.pop();
+    }
+    return found;
+}
@@ -0,0 +1,235 @@
+/**
+ * @file
+ * @brief Learned indexes over frozen integer trees
+ *
+ * Contains a read-only index for one version of a Tree of integers. The
+ * keys are copied into a contiguous array and a piecewise-linear model
+ * of key to position is fitted over them, so a lookup is a short search
+ * through the model's segments, one multiply-add, and a scan of a few
+ * neighbouring keys, rather than a walk of pointers down the tree.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // lower_bound, upper_bound
+#include <limits>
+#include <stdexcept>
+#include <type_traits>  // make_unsigned
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Frozen learned index over one version of a Tree
+ *
+ * Built in one O(n) pass over the tree. The model is split into
+ * segments greedily (a shrinking cone): each segment is a line that
+ * predicts the position of every distinct key it covers to within
+ * error places. A prediction is always checked against its neighbours,
+ * so answers are exact even for keys the model has never seen.
+ *
+ * The index keeps the tree it was built from alive, so tree() can be
+ * used for anything the index does not answer.
+ *
+ * T must be an integer type.
+ */
+template<typename T>
+class LearnedIndex
+{
+public:
+    /**
+     * @brief builds an index over tree, which may be None
+     *
+     * @param error how far, in places, a prediction may be from the
+     * true position of a key; smaller means more segments
+     */
+    explicit LearnedIndex(const Option<Tree<T>>& tree, size_t error = 16);
+
+    /**
+     * @brief returns the tree the index was built from
+     */
+    inline const Option<Tree<T>>& tree() const { return m_tree; };
+
+    /**
+     * @brief returns the number of keys
+     */
+    inline size_t size() const { return m_keys.size(); };
+
+    /**
+     * @brief returns the number of linear segments in the model
+     */
+    inline size_t segments() const { return m_segments.size(); };
+
+    /**
+     * @brief returns the number of keys less than val
+     */
+    size_t rank(const T& val) const;
+
+    /**
+     * @brief returns True if val is one of the keys
+     */
+    bool contains(const T& val) const {
+        size_t i = rank(val);
+        return i < m_keys.size() && m_keys[i] == val;
+    }
+
+    /**
+     * @brief returns a pointer to the least key not less than val,
+     * or NULL if every key is less
+     *
+     * @note the pointer is valid for as long as the index is
+     */
+    const T* lower_bound(const T& val) const {
+        size_t i = rank(val);
+        return i < m_keys.size() ? &m_keys[i] : NULL;
+    }
+
+    /**
+     * @brief return a reference to the key at index in sorted order
+     *
+     * Throws std::out_of_range if index is not less than size().
+     */
+    const T& nth(size_t index) const {
+        if (index >= m_keys.size()) {
+            throw std::out_of_range("index past the end of the index");
+        }
+        return m_keys[index];
+    }
+
+private:
+
+    typedef typename std::make_unsigned<T>::type Unsigned;
+
+    /**
+     * @brief a line predicting positions from first to the next segment
+     */
+    struct Segment
+    {
+        /// position of first in the key array
+        size_t start;
+
+        /// positions per unit of key
+        double slope;
+    };
+
+    /**
+     * @brief distance from lo up to hi as a double, without overflow
+     */
+    static double span(const T& lo, const T& hi) {
+        return static_cast<double>(static_cast<Unsigned>(hi) -
+                                   static_cast<Unsigned>(lo));
+    }
+
+    /**
+     * @brief adds the segment beginning at start, with the slope in the
+     * middle of the cone [lo, hi]
+     */
+    void close(size_t start, double lo, double hi) {
+        Segment s = { start, hi == std::numeric_limits<double>::max()
+                                 ? 0.0 : (lo + hi) / 2 };
+        m_firsts.push_back(m_keys[start]);
+        m_segments.push_back(s);
+    }
+
+    /// the tree indexed, kept alive with the index
+    Option<Tree<T>> m_tree;
+
+    /// the keys in order
+    std::vector<T> m_keys;
+
+    /// the first key of each segment, searched to pick one
+    std::vector<T> m_firsts;
+
+    /// the model, one line per entry of m_firsts
+    std::vector<Segment> m_segments;
+
+    /// greatest distance from a prediction to its key's position
+    size_t m_error;
+};
+
+
+
+template<typename T>
+LearnedIndex<T>::LearnedIndex(const Option<Tree<T>>& tree, size_t error) :
+    m_tree(tree),
+    m_error(error)
+{
+    if (tree.is_none()) {
+        return;
+    }
+    m_keys.reserve(tree->size());
+    tree->for_each([this](const T& key) { m_keys.push_back(key); });
+
+    // fit each segment to the first position of every distinct key
+    const double e = static_cast<double>(error);
+    size_t start = 0;
+    double lo = 0;
+    double hi = std::numeric_limits<double>::max();
+    for (size_t i=1; i < m_keys.size(); ++i) {
+        if (m_keys[i] == m_keys[i - 1]) {
+            continue;
+        }
+        double dx = span(m_keys[start], m_keys[i]);
+        double dp = static_cast<double>(i - start);
+        double point_lo = (dp - e) / dx;
+        double point_hi = (dp + e) / dx;
+        if (point_lo > hi || lo > point_hi) {
+            // no one line fits both this key and the segment so far
+            close(start, lo, hi);
+            start = i;
+            lo = 0;
+            hi = std::numeric_limits<double>::max();
+            continue;
+        }
+        lo = std::max(lo, point_lo);
+        hi = std::min(hi, point_hi);
+    }
+    close(start, lo, hi);
+}
+
+
+template<typename T>
+size_t LearnedIndex<T>::rank(const T& val) const
+{
+    if (m_keys.empty() || !(val > m_keys.front())) {
+        return 0;
+    }
+    // the last segment starting at or before val
+    size_t s = std::upper_bound(m_firsts.begin(), m_firsts.end(), val) -
+               m_firsts.begin() - 1;
+    const Segment& seg = m_segments[s];
+    double predicted = seg.start + seg.slope * span(m_firsts[s], val);
+    size_t guess = predicted < static_cast<double>(m_keys.size())
+        ? static_cast<size_t>(predicted) : m_keys.size();
+
+    typename std::vector<T>::const_iterator first = m_keys.begin();
+    size_t lo = guess > m_error ? guess - m_error : 0;
+    size_t hi = std::min(m_keys.size(), guess + m_error + 1);
+    // keys that fall between a segment's fitted points can be further
+    // off; if the window missed, search everything on that side of it
+    if (lo > 0 && !(val > m_keys[lo - 1])) {
+        lo = 0;
+    }
+    if (hi < m_keys.size() && val > m_keys[hi - 1]) {
+        hi = m_keys.size();
+    }
+    return std::lower_bound(first + lo, first + hi, val) - first;
+}
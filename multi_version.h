@@ -0,0 +1,144 @@
+/**
+ * @file
+ * @brief Queries over many versions of a tree at once
+ *
+ * Contains lookups that take a whole list of versions. Retained versions
+ * of a tree share most of their nodes, so instead of searching each one
+ * separately, all the roots are descended together: versions that reach
+ * the same node are grouped, and each distinct node is looked at once on
+ * behalf of its whole group.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <unordered_map>    // versions grouped by node
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+#ifdef TREE_COUNT_NODES
+/**
+ * @brief number of nodes find_in_versions has looked at so far
+ *
+ * Only compiled in with TREE_COUNT_NODES, for the benchmarks and tests.
+ */
+inline size_t& versions_nodes_visited() { static size_t count = 0; return count; }
+#endif
+
+/**
+ * @brief return, for each version, a pointer to its element equal to
+ * val, or NULL if that version does not contain val
+ *
+ * Costs O(distinct nodes on the search paths) plus O(versions) to hand
+ * out the answers, against O(versions * log n) for a find() on each.
+ * Versions may be None.
+ *
+ * @note behavior is undefined if an element is used after every version
+ * holding it is destroyed
+ */
+template<typename T>
+std::vector<const T*> find_in_versions(
+    const std::vector<Option<Tree<T>>>& versions, const T& val)
+{
+    const size_t none = static_cast<size_t>(-1);
+    std::vector<const T*> found(versions.size(), NULL);
+    // the versions at one node, chained together through next
+    struct Group
+    {
+        const Tree<T>* node;
+        size_t first;
+        size_t last;
+    };
+    std::vector<size_t> next(versions.size(), none);
+    // groups waiting to be looked at, by the height of their node. A
+    // shared node can be at different depths in different versions, but
+    // it has one height, and every node above it on any path is taller,
+    // so going down by height reaches all its versions before it is seen
+    std::vector<std::vector<Group>> by_height;
+    std::unordered_map<const Tree<T>*, size_t> at;
+
+    // join the chain first..last to the group at node
+    auto reach = [&](const Tree<T>* node, size_t first, size_t last) {
+        size_t height = node->height();
+        if (by_height.size() <= height) {
+            by_height.resize(height + 1);
+        }
+        std::vector<Group>& groups = by_height[height];
+        typename std::unordered_map<const Tree<T>*, size_t>::iterator g =
+            at.find(node);
+        if (g == at.end()) {
+            Group group = { node, first, last };
+            at[node] = groups.size();
+            groups.push_back(group);
+        } else {
+            next[groups[g->second].last] = first;
+            groups[g->second].last = last;
+        }
+    };
+
+    for (size_t v=0; v < versions.size(); ++v) {
+        if (versions[v].is_some()) {
+            reach(versions[v].operator->(), v, v);
+        }
+    }
+    for (size_t height = by_height.size(); height-- > 0; ) {
+        for (size_t i=0; i < by_height[height].size(); ++i) {
+            // children are shorter, so reach() never touches this level
+            const Group group = by_height[height][i];
+            at.erase(group.node);
+            const Tree<T>& node = *group.node;
+#ifdef TREE_COUNT_NODES
+            ++versions_nodes_visited();
+#endif
+            if (node.deref() == val) {
+                for (size_t v = group.first; v != none; v = next[v]) {
+                    found[v] = &node.deref();
+                }
+                continue;
+            }
+            const Tree<T>* child = node.deref() > val ? node.left_node()
+                                                      : node.right_node();
+            if (child != NULL) {
+                reach(child, group.first, group.last);
+            }
+        }
+        by_height[height].clear();
+    }
+    return found;
+}
+
+
+/**
+ * @brief return, for each version, whether it contains val
+ *
+ * @see find_in_versions
+ */
+template<typename T>
+std::vector<bool> contains_in_versions(
+    const std::vector<Option<Tree<T>>>& versions, const T& val)
+{
+    std::vector<const T*> found = find_in_versions(versions, val);
+    std::vector<bool> contains(found.size());
+    for (size_t v=0; v < found.size(); ++v) {
+        contains[v] = found[v] != NULL;
+    }
+    return contains;
+}
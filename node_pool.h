@@ -0,0 +1,347 @@
+/**
+ * @file
+ * @brief Fixed-capacity node pools for Persistent Trees
+ *
+ * Contains a preallocated, lock-free pool of tree nodes. Updates made
+ * through a pool never call the allocator: every node they build comes
+ * out of the pool, and goes back into it when its last reference is
+ * dropped. An update that would need more nodes than the pool has free
+ * fails without changing anything.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>   // lock-free free list
+#include <cstddef>  // max_align_t
+#include <memory>   // unique_ptr
+#include <new>      // bad_alloc
+#include <stdint.h>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Fixed-capacity pool of tree nodes
+ *
+ * The pool is sized once, when it is constructed, and never grows. Trees
+ * built with try_insert() and try_remove() draw their new nodes from it;
+ * the nodes they share with older versions may come from anywhere.
+ * Any number of threads may update through the same pool, and nodes may
+ * be released from any thread.
+ *
+ * @note the pool must outlive every node allocated from it.
+ */
+template<typename T>
+class NodePool
+{
+public:
+    /**
+     * @brief preallocates room for capacity nodes
+     *
+     * Throws std::length_error, before allocating anything, if capacity
+     * is too large for the pool's 32-bit slot numbers.
+     */
+    explicit NodePool(size_t capacity) :
+        m_capacity(checked(capacity)),
+        m_slots(new unsigned char[static_cast<size_t>(m_capacity) * slot_size]),
+        m_next(new std::atomic<uint32_t>[m_capacity]),
+        m_head(m_capacity == 0 ? empty : 0),
+        m_free(m_capacity)
+    {
+        for (uint32_t i=0; i<m_capacity; ++i) {
+            m_next[i].store(i + 1 < m_capacity ? i + 1 : empty);
+        }
+    };
+
+    /**
+     * @brief returns the number of nodes the pool was created with
+     */
+    inline size_t capacity() const { return m_capacity; };
+
+    /**
+     * @brief returns the number of nodes not currently in use
+     *
+     * @note only a snapshot when other threads are using the pool
+     */
+    inline size_t available() const { return m_free.load(); };
+
+    /**
+     * @brief insert node into tree, building new nodes from the pool
+     *
+     * @param[out] result the new version of the tree. Left untouched if
+     * the pool does not have enough free nodes.
+     *
+     * @return false if the pool does not have enough free nodes
+     */
+    bool try_insert(const Option<Tree<T>>& tree,
+                    const T& node,
+                    Option<Tree<T>>& result);
+
+    /**
+     * @brief remove node from tree, building new nodes from the pool
+     *
+     * Removing a value that is not in the tree succeeds without using
+     * the pool, and result shares the whole tree.
+     *
+     * @param[out] result the new version of the tree (None if the last
+     * element was removed). Left untouched if the pool does not have
+     * enough free nodes.
+     *
+     * @return false if the pool does not have enough free nodes
+     */
+    bool try_remove(const Option<Tree<T>>& tree,
+                    const T& node,
+                    Option<Tree<T>>& result);
+
+private:
+
+    typedef typename Tree<T>::Sub Sub;
+    typedef typename Tree<T>::Scratch Scratch;
+
+    template<typename U> class Allocator;
+
+    /**
+     * @brief slots taken from the pool for one update
+     *
+     * Reserving up front means the update cannot run out halfway
+     * through building. Anything left over goes back on destruction.
+     */
+    struct Reservation
+    {
+        Reservation(NodePool<T>& pool) : m_pool(pool), m_head(empty) {};
+
+        ~Reservation() {
+            while (m_head != empty) {
+                uint32_t slot = m_head;
+                m_head = m_pool.m_next[slot].load();
+                m_pool.release(slot);
+            }
+        }
+
+        NodePool<T>& m_pool;
+        uint32_t m_head;
+    };
+
+    /// marks the end of a list of slots
+    static const uint32_t empty = 0xffffffffu;
+
+    /// bytes per slot: a node, its refcounts and its allocator
+    static const size_t slot_size =
+        (sizeof(Tree<T>) + 8 * sizeof(void*) + alignof(std::max_align_t) - 1)
+        / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+    /**
+     * @brief returns capacity as a slot count, throwing
+     * std::length_error if it is too large for one
+     */
+    static uint32_t checked(size_t capacity) {
+        if (capacity >= empty) {
+            throw std::length_error("node pool too large");
+        }
+        return static_cast<uint32_t>(capacity);
+    }
+
+    /**
+     * @brief take count slots from the free list, or none at all
+     */
+    bool reserve(size_t count, Reservation& reservation);
+
+    /**
+     * @brief build a planned tree out of reserved slots
+     */
+    bool commit(const Scratch& scratch, const Sub& head,
+                Option<Tree<T>>& result);
+
+    /**
+     * @brief return a slot to the free list
+     */
+    void release(uint32_t slot);
+
+    inline void* address(uint32_t slot) const {
+        return m_slots.get() + static_cast<size_t>(slot) * slot_size;
+    }
+
+    inline uint32_t slot_of(const void* p) const {
+        return static_cast<uint32_t>(
+            (static_cast<const unsigned char*>(p) - m_slots.get())
+            / slot_size);
+    }
+
+    /// number of slots
+    const uint32_t m_capacity;
+
+    /// the preallocated node storage
+    const std::unique_ptr<unsigned char[]> m_slots;
+
+    /// next free slot after each free slot
+    const std::unique_ptr<std::atomic<uint32_t>[]> m_next;
+
+    /// first free slot in the low half, ABA tag in the high half
+    std::atomic<uint64_t> m_head;
+
+    /// number of free slots
+    std::atomic<size_t> m_free;
+};
+
+
+
+/**
+ * @brief allocator handing out reserved pool slots to make_shared
+ *
+ * Allocation takes from the update's reservation; deallocation, which
+ * may happen much later and on another thread, returns to the pool.
+ */
+template<typename T>
+template<typename U>
+class NodePool<T>::Allocator
+{
+public:
+    typedef U value_type;
+
+    template<typename V> struct rebind { typedef Allocator<V> other; };
+
+    Allocator(NodePool<T>* pool, Reservation* reservation) :
+        m_pool(pool),
+        m_reservation(reservation)
+    {};
+
+    template<typename V>
+    Allocator(const Allocator<V>& other) :
+        m_pool(other.m_pool),
+        m_reservation(other.m_reservation)
+    {};
+
+    U* allocate(size_t n) {
+        static_assert(sizeof(U) <= slot_size,
+                      "node pool slots are too small for this node type");
+        if (n != 1 || m_reservation == NULL ||
+            m_reservation->m_head == empty) {
+            // only reachable if a reservation was miscounted
+            throw std::bad_alloc();
+        }
+        uint32_t slot = m_reservation->m_head;
+        m_reservation->m_head = m_pool->m_next[slot].load();
+        return static_cast<U*>(m_pool->address(slot));
+    }
+
+    void deallocate(U* p, size_t) {
+        m_pool->release(m_pool->slot_of(p));
+    }
+
+    template<typename V>
+    bool operator==(const Allocator<V>& rhs) const {
+        return m_pool == rhs.m_pool;
+    }
+
+    template<typename V>
+    bool operator!=(const Allocator<V>& rhs) const {
+        return m_pool != rhs.m_pool;
+    }
+
+private:
+    template<typename V> friend class Allocator;
+
+    /// pool the slots belong to
+    NodePool<T>* m_pool;
+
+    /// slots set aside for the update in progress
+    Reservation* m_reservation;
+};
+
+
+
+template<typename T>
+bool NodePool<T>::try_insert(const Option<Tree<T>>& tree,
+                             const T& node,
+                             Option<Tree<T>>& result)
+{
+    Scratch scratch;
+    Sub head = scratch.insert(Sub::of(tree), node);
+    return commit(scratch, head, result);
+}
+
+
+template<typename T>
+bool NodePool<T>::try_remove(const Option<Tree<T>>& tree,
+                             const T& node,
+                             Option<Tree<T>>& result)
+{
+    Scratch scratch;
+    bool found = false;
+    Sub head = scratch.remove(Sub::of(tree), node, found);
+    if (!found) {
+        result = tree;
+        return true;
+    }
+    return commit(scratch, head, result);
+}
+
+
+template<typename T>
+bool NodePool<T>::commit(const Scratch& scratch, const Sub& head,
+                         Option<Tree<T>>& result)
+{
+    Reservation reservation(*this);
+    if (!reserve(scratch.pending(head), reservation)) {
+        return false;
+    }
+    result = scratch.build(head, Allocator<Tree<T>>(this, &reservation));
+    return true;
+}
+
+
+template<typename T>
+bool NodePool<T>::reserve(size_t count, Reservation& reservation)
+{
+    for (size_t i=0; i<count; ++i) {
+        uint64_t head = m_head.load();
+        uint32_t slot;
+        for (;;) {
+            slot = static_cast<uint32_t>(head);
+            if (slot == empty) {
+                // out of nodes: the reservation hands back what it took
+                return false;
+            }
+            uint64_t next = ((head >> 32) + 1) << 32 | m_next[slot].load();
+            if (m_head.compare_exchange_weak(head, next)) {
+                break;
+            }
+        }
+        m_free.fetch_sub(1);
+        m_next[slot].store(reservation.m_head);
+        reservation.m_head = slot;
+    }
+    return true;
+}
+
+
+template<typename T>
+void NodePool<T>::release(uint32_t slot)
+{
+    uint64_t head = m_head.load();
+    for (;;) {
+        m_next[slot].store(static_cast<uint32_t>(head));
+        uint64_t next = ((head >> 32) + 1) << 32 | slot;
+        if (m_head.compare_exchange_weak(head, next)) {
+            break;
+        }
+    }
+    m_free.fetch_add(1);
+}
@@ -0,0 +1,524 @@
+/**
+ * @file
+ * @brief Persistent trees paged in from a file
+ *
+ * Contains a persistent AVL tree whose subtrees may still be on file.
+ * An unloaded subtree is a stub holding its file offset, size and
+ * height; it is read in the first time a lookup or update descends into
+ * it, and dropped again once it is cold and too many subtrees are
+ * loaded. Snapshots much bigger than their working set can be queried
+ * and updated with only the paths in use held in memory.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <cstdio>       // FILE, fopen, fread, fwrite
+#include <cstring>      // memcmp, memset
+#include <list>         // least recently used stubs
+#include <memory>       // shared_ptr
+#include <stdexcept>    // runtime_error
+#include <stdint.h>
+#include <string>
+#include <type_traits>  // is_trivially_copyable
+
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+
+/**
+ * @brief Persistent AVL tree loaded from a file on demand
+ *
+ * A PagedTree is opened from a file written by write(). Nothing but the
+ * head stub is read until it is used. Subtrees loaded from the file are
+ * never modified, so any of them may be evicted and read again later;
+ * insert() copies the path it changes into memory, and those nodes stay
+ * in memory for as long as the new version does.
+ *
+ * T must be trivially copyable: it is stored in the file as raw bytes.
+ *
+ * This is a type of its own rather than a kind of Tree node because a
+ * Tree child is an Option<Tree<T>> that must already be in memory:
+ * Tree's update planner reads heights and children straight from
+ * existing nodes, and cannot stop to load a stub or note that one may
+ * be evicted. PagedTree therefore keeps its own AVL balance, which
+ * loads only the children a rotation actually moves.
+ *
+ * @note the trees opened from one file share a cache, which is not
+ * safe to use from more than one thread at a time
+ */
+template<typename T>
+class PagedTree
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "PagedTree elements are stored as raw bytes");
+
+    struct Node;
+    struct Stub;
+    class Store;
+
+    /**
+     * @brief reference to a subtree, in memory or on file
+     */
+    struct Link
+    {
+        /// the subtree, if it is in memory for good
+        std::shared_ptr<const Node> node;
+
+        /// the subtree, if it is on file
+        std::shared_ptr<Stub> stub;
+
+        /// number of elements in the subtree
+        uint64_t size;
+
+        /// height of the subtree
+        uint64_t height;
+
+        bool is_none() const { return size == 0; }
+
+        /**
+         * @brief the subtree's head node, loading it if necessary
+         */
+        std::shared_ptr<const Node> get() const {
+            return node ? node : stub->load();
+        }
+    };
+
+public:
+    /**
+     * @brief writes tree, which may be None, to a file at path
+     *
+     * Throws std::runtime_error if the file cannot be written.
+     */
+    static void write(const Option<Tree<T>>& tree, const std::string& path);
+
+    /**
+     * @brief opens a tree written by write()
+     *
+     * No more than budget subtrees are kept loaded at once (each is one
+     * node); the least recently used beyond that are evicted. Throws
+     * std::runtime_error if the file cannot be read.
+     */
+    static PagedTree<T> open(const std::string& path, size_t budget);
+
+    /**
+     * @brief returns the number of elements in the tree
+     */
+    inline size_t size() const { return m_root.size; };
+
+    /**
+     * @brief returns the maximum height of the tree
+     */
+    inline size_t height() const { return m_root.height; };
+
+    /**
+     * @brief returns True if val is in the tree
+     *
+     * Loads only the nodes on the path to val.
+     */
+    bool contains(const T& val) const;
+
+    /**
+     * @brief returns a new tree with node inserted into it
+     *
+     * Loads the path to node, plus a child at each rotation. The copied
+     * path is kept in memory; the rest is shared with this version.
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    PagedTree<T> insert(const T& node) const {
+        return PagedTree<T>(m_store, insert(m_root, node));
+    }
+
+    /**
+     * @brief calls f on each element in ascending order
+     *
+     * Every subtree is loaded in turn, but only the path to the current
+     * element has to stay loaded.
+     */
+    template<typename F>
+    void for_each(F&& f) const { for_each(m_root, f); }
+
+    std::list<T> toList() const {
+        std::list<T> l;
+        for_each([&l](const T& node) { l.push_back(node); });
+        return l;
+    }
+
+    /**
+     * @brief returns the number of subtrees now loaded from the file
+     */
+    size_t loaded() const { return m_store->loaded(); }
+
+private:
+
+    /**
+     * @brief a node in memory
+     */
+    struct Node
+    {
+        T value;
+        Link left;
+        Link right;
+    };
+
+    /**
+     * @brief an on-file subtree, and its node while it is loaded
+     */
+    struct Stub
+    {
+        Stub(const std::shared_ptr<Store>& store, uint64_t offset) :
+            store(store),
+            offset(offset),
+            in_lru(false)
+        {};
+
+        ~Stub() {
+            if (in_lru) {
+                store->forget(this);
+            }
+        }
+
+        std::shared_ptr<const Node> load() {
+            if (!loaded) {
+                loaded = store->read(offset);
+            }
+            store->touch(this);
+            return loaded;
+        }
+
+        /// the file the subtree is in
+        const std::shared_ptr<Store> store;
+
+        /// where its head's record starts
+        const uint64_t offset;
+
+        /// the head node, or NULL if evicted or never loaded
+        std::shared_ptr<const Node> loaded;
+
+        /// true while listed in the store's recently used list
+        bool in_lru;
+
+        /// position in the store's recently used list
+        typename std::list<Stub*>::iterator lru;
+    };
+
+    /**
+     * @brief on-file layout of one child reference
+     */
+    struct ChildRecord
+    {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t height;
+    };
+
+    /**
+     * @brief on-file layout of one node
+     */
+    struct NodeRecord
+    {
+        T value;
+        ChildRecord left;
+        ChildRecord right;
+    };
+
+    /**
+     * @brief the open file and the recently used list of its stubs
+     */
+    class Store
+    {
+    public:
+        Store(std::FILE* file, size_t budget) :
+            m_file(file),
+            m_budget(budget)
+        {};
+
+        ~Store() { std::fclose(m_file); }
+
+        size_t loaded() const { return m_lru.size(); }
+
+        /**
+         * @brief read the node at offset, with stubs for its children
+         */
+        std::shared_ptr<const Node> read(uint64_t offset);
+
+        /**
+         * @brief mark stub as most recently used, evicting the least
+         * recently used stubs if over budget
+         */
+        void touch(Stub* stub);
+
+        /**
+         * @brief take a stub that is being destroyed off the list
+         */
+        void forget(Stub* stub) { m_lru.erase(stub->lru); }
+
+        /// the Store that owns this object; set by open()
+        std::weak_ptr<Store> self;
+
+    private:
+        Store(const Store&);
+        Store& operator=(const Store&);
+
+        std::FILE* m_file;
+
+        /// most recently used first
+        std::list<Stub*> m_lru;
+
+        const size_t m_budget;
+    };
+
+    PagedTree(const std::shared_ptr<Store>& store, const Link& root) :
+        m_store(store),
+        m_root(root)
+    {};
+
+    static Link none() {
+        Link l = { std::shared_ptr<const Node>(), std::shared_ptr<Stub>(),
+                   0, 0 };
+        return l;
+    }
+
+    static Link make(const T& value, const Link& left, const Link& right) {
+        Node n = { value, left, right };
+        Link l = { std::make_shared<const Node>(n), std::shared_ptr<Stub>(),
+                   left.size + 1 + right.size,
+                   std::max(left.height, right.height) + 1 };
+        return l;
+    }
+
+    static Link balance(const T& value, const Link& left, const Link& right);
+
+    static Link insert(const Link& at, const T& node);
+
+    template<typename F>
+    static void for_each(const Link& at, F& f) {
+        if (at.is_none()) {
+            return;
+        }
+        std::shared_ptr<const Node> n = at.get();
+        for_each(n->left, f);
+        f(n->value);
+        for_each(n->right, f);
+    }
+
+    static ChildRecord write(std::FILE* file, const Option<Tree<T>>& tree);
+
+    static const char* magic() { return "PAGETREE"; }
+
+    /// the file this tree was opened from
+    std::shared_ptr<Store> m_store;
+
+    /// the head of the tree
+    Link m_root;
+};
+
+
+
+template<typename T>
+std::shared_ptr<const typename PagedTree<T>::Node>
+PagedTree<T>::Store::read(uint64_t offset)
+{
+    NodeRecord r;
+    if (std::fseek(m_file, static_cast<long>(offset), SEEK_SET) != 0 ||
+        std::fread(&r, sizeof(r), 1, m_file) != 1) {
+        throw std::runtime_error("could not read tree node");
+    }
+    std::shared_ptr<Store> store(self);
+    Link left = none();
+    if (r.left.size > 0) {
+        left.stub = std::make_shared<Stub>(store, r.left.offset);
+        left.size = r.left.size;
+        left.height = r.left.height;
+    }
+    Link right = none();
+    if (r.right.size > 0) {
+        right.stub = std::make_shared<Stub>(store, r.right.offset);
+        right.size = r.right.size;
+        right.height = r.right.height;
+    }
+    Node n = { r.value, left, right };
+    return std::make_shared<const Node>(n);
+}
+
+
+template<typename T>
+void PagedTree<T>::Store::touch(Stub* stub)
+{
+    if (stub->in_lru) {
+        m_lru.splice(m_lru.begin(), m_lru, stub->lru);
+    } else {
+        m_lru.push_front(stub);
+        stub->lru = m_lru.begin();
+        stub->in_lru = true;
+    }
+    if (m_lru.size() <= m_budget) {
+        return;
+    }
+    TREE_TRACE_SCOPE(trace, "PagedTree::evict");
+    while (m_lru.size() > m_budget && m_lru.back() != stub) {
+        TREE_TRACE_COUNT(trace, 1, sizeof(Node));
+        Stub* cold = m_lru.back();
+        m_lru.pop_back();
+        cold->in_lru = false;
+        // may destroy stubs below it, which take themselves off the list
+        cold->loaded.reset();
+    }
+}
+
+
+template<typename T>
+void PagedTree<T>::write(const Option<Tree<T>>& tree, const std::string& path)
+{
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        throw std::runtime_error("could not create " + path);
+    }
+    TREE_TRACE_SCOPE(trace, "PagedTree::write");
+    TREE_TRACE_COUNT(trace, tree_size(tree), tree_size(tree) * sizeof(NodeRecord));
+    ChildRecord root = { 0, 0, 0 };
+    bool ok = std::fwrite(magic(), 8, 1, file) == 1 &&
+              std::fwrite(&root, sizeof(root), 1, file) == 1;
+    try {
+        root = write(file, tree);
+    } catch (...) {
+        std::fclose(file);
+        throw;
+    }
+    ok = ok && std::fseek(file, 8, SEEK_SET) == 0 &&
+         std::fwrite(&root, sizeof(root), 1, file) == 1;
+    if (std::fclose(file) != 0 || !ok) {
+        throw std::runtime_error("could not write " + path);
+    }
+}
+
+
+template<typename T>
+typename PagedTree<T>::ChildRecord
+PagedTree<T>::write(std::FILE* file, const Option<Tree<T>>& tree)
+{
+    ChildRecord c = { 0, 0, 0 };
+    if (tree.is_none()) {
+        return c;
+    }
+    // children first, so their offsets are known when this is written
+    NodeRecord r;
+    std::memset(&r, 0, sizeof(r));
+    r.value = tree->deref();
+    r.left = write(file, tree->left());
+    r.right = write(file, tree->right());
+    long offset = std::ftell(file);
+    if (offset < 0 || std::fwrite(&r, sizeof(r), 1, file) != 1) {
+        throw std::runtime_error("could not write tree node");
+    }
+    c.offset = static_cast<uint64_t>(offset);
+    c.size = tree->size();
+    c.height = tree->height();
+    return c;
+}
+
+
+template<typename T>
+PagedTree<T> PagedTree<T>::open(const std::string& path, size_t budget)
+{
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        throw std::runtime_error("could not open " + path);
+    }
+    char header[8];
+    ChildRecord root;
+    if (std::fread(header, sizeof(header), 1, file) != 1 ||
+        std::memcmp(header, magic(), sizeof(header)) != 0 ||
+        std::fread(&root, sizeof(root), 1, file) != 1) {
+        std::fclose(file);
+        throw std::runtime_error(path + " is not a paged tree");
+    }
+    std::shared_ptr<Store> store = std::make_shared<Store>(file, budget);
+    store->self = store;
+    Link l = none();
+    if (root.size > 0) {
+        l.stub = std::make_shared<Stub>(store, root.offset);
+        l.size = root.size;
+        l.height = root.height;
+    }
+    return PagedTree<T>(store, l);
+}
+
+
+template<typename T>
+bool PagedTree<T>::contains(const T& val) const
+{
+    Link at = m_root;
+    while (!at.is_none()) {
+        std::shared_ptr<const Node> n = at.get();
+        if (n->value == val) {
+            return true;
+        }
+        at = n->value > val ? n->left : n->right;
+    }
+    return false;
+}
+
+
+template<typename T>
+typename PagedTree<T>::Link
+PagedTree<T>::insert(const Link& at, const T& node)
+{
+    if (at.is_none()) {
+        return make(node, none(), none());
+    }
+    std::shared_ptr<const Node> n = at.get();
+    if (n->value > node) {
+        return balance(n->value, insert(n->left, node), n->right);
+    } else {
+        return balance(n->value, n->left, insert(n->right, node));
+    }
+}
+
+
+template<typename T>
+typename PagedTree<T>::Link
+PagedTree<T>::balance(const T& value, const Link& left, const Link& right)
+{
+    if (left.height > right.height + 1) {
+        std::shared_ptr<const Node> l = left.get();
+        if (l->left.height >= l->right.height) {
+            return make(l->value, l->left, make(value, l->right, right));
+        }
+        // left-right case: the inner grandchild becomes the head
+        std::shared_ptr<const Node> inner = l->right.get();
+        return make(inner->value,
+                    make(l->value, l->left, inner->left),
+                    make(value, inner->right, right));
+    }
+    if (right.height > left.height + 1) {
+        std::shared_ptr<const Node> r = right.get();
+        if (r->right.height >= r->left.height) {
+            return make(r->value, make(value, left, r->left), r->right);
+        }
+        // right-left case: the inner grandchild becomes the head
+        std::shared_ptr<const Node> inner = r->left.get();
+        return make(inner->value,
+                    make(value, left, inner->left),
+                    make(r->value, inner->right, r->right));
+    }
+    return make(value, left, right);
+}
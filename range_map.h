@@ -0,0 +1,436 @@
+/**
+ * @file
+ * @brief Persistent maps with range updates
+ *
+ * Contains a persistent ordered map whose values can be shifted by a
+ * delta over a whole key range in O(log n). Each node keeps the sum of
+ * its subtree, and a range update tags the O(log n) subtrees that cover
+ * the range instead of visiting every entry. Tags are pushed down into
+ * copied nodes as later updates path-copy through them, so every older
+ * version keeps seeing its own values.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // max
+#include <list>
+#include <memory>       // shared_ptr
+#include <stdexcept>
+#include <utility>      // pair
+
+/**
+ * @brief Persistent map from K to V with range add and range sum
+ *
+ * Balanced with the AVL algorithm, like Tree. K needs operator> and
+ * operator==; V needs operator+, default construction to zero, and
+ * multiplication by a V made from a size_t count.
+ *
+ * Range queries and get() never allocate: they add up the pending tags
+ * on their way down instead of pushing them.
+ */
+template<typename K, typename V>
+class RangeMap
+{
+public:
+    /**
+     * @brief creates an empty map
+     */
+    RangeMap() : m_root() {};
+
+    /**
+     * @brief returns the number of entries in the map
+     */
+    inline size_t size() const { return node_size(m_root); };
+
+    /**
+     * @brief returns true if key has a value in the map
+     */
+    bool contains(const K& key) const;
+
+    /**
+     * @brief returns the value of key
+     *
+     * @note throws an exception if key is not in the map
+     */
+    V get(const K& key) const;
+
+    /**
+     * @brief returns a new map with key set to value
+     */
+    RangeMap<K, V> put(const K& key, const V& value) const {
+        return RangeMap<K, V>(put(m_root, V(), key, value));
+    }
+
+    /**
+     * @brief returns a new map without key
+     */
+    RangeMap<K, V> remove(const K& key) const;
+
+    /**
+     * @brief returns a new map with delta added to the value of every
+     * key from lo through hi
+     */
+    RangeMap<K, V> add(const K& lo, const K& hi, const V& delta) const {
+        return RangeMap<K, V>(add(m_root, V(), lo, hi, delta));
+    }
+
+    /**
+     * @brief returns the sum of the values of keys from lo through hi
+     */
+    V sum(const K& lo, const K& hi) const {
+        return sum(m_root, V(), lo, hi);
+    }
+
+    /**
+     * @brief returns the entries of the map in key order
+     */
+    std::list<std::pair<K, V> > toList() const {
+        std::list<std::pair<K, V> > l;
+        append(m_root, V(), l);
+        return l;
+    }
+
+private:
+
+    struct Node;
+
+    /// shared handle to an immutable node, NULL for an empty subtree
+    typedef std::shared_ptr<const Node> Ptr;
+
+    /**
+     * @brief map entry and the aggregates of its subtree
+     *
+     * value and sum already include this node's own tag. lazy is the
+     * amount still to be added to every entry below this node.
+     */
+    struct Node
+    {
+        K key;
+        V value;
+        V lazy;
+        V sum;
+        K min;
+        K max;
+        size_t size;
+        size_t height;
+        Ptr left;
+        Ptr right;
+    };
+
+    explicit RangeMap(const Ptr& root) : m_root(root) {};
+
+    static size_t node_size(const Ptr& t) { return t ? t->size : 0; }
+
+    static size_t node_height(const Ptr& t) { return t ? t->height : 0; }
+
+    static V node_sum(const Ptr& t) { return t ? t->sum : V(); }
+
+    /**
+     * @brief build a node with no pending tag
+     */
+    static Ptr make(const K& key, const V& value,
+                    const Ptr& left, const Ptr& right);
+
+    /**
+     * @brief return t with delta added to every entry
+     *
+     * Only t itself is copied; its children get the delta through the
+     * copy's tag.
+     */
+    static Ptr shift(const Ptr& t, const V& delta);
+
+    /**
+     * @brief build a node, rotating first if it would be out of balance
+     */
+    static Ptr balance(const K& key, const V& value,
+                       const Ptr& left, const Ptr& right);
+
+    /**
+     * @brief t with carry added throughout, then key set to value
+     *
+     * carry is the tag inherited from t's old parent. Passing it down
+     * rather than shifting t first avoids copying each node twice.
+     */
+    static Ptr put(const Ptr& t, const V& carry,
+                   const K& key, const V& value);
+
+    /**
+     * @brief t with carry added throughout, then key removed
+     */
+    static Ptr remove(const Ptr& t, const V& carry, const K& key,
+                      bool& found);
+
+    /**
+     * @brief t with carry added throughout, then its minimum removed
+     */
+    static Ptr popMin(const Ptr& t, const V& carry, K& key, V& value);
+
+    /**
+     * @brief t with carry added throughout, then delta added from lo
+     * through hi
+     */
+    static Ptr add(const Ptr& t, const V& carry,
+                   const K& lo, const K& hi, const V& delta);
+
+    /**
+     * @brief sum of lo through hi in t, with carry added throughout
+     */
+    static V sum(const Ptr& t, const V& carry, const K& lo, const K& hi);
+
+    static void append(const Ptr& t, const V& carry,
+                       std::list<std::pair<K, V> >& l);
+
+    /// the entries, or NULL if there are none
+    Ptr m_root;
+};
+
+
+
+template<typename K, typename V>
+bool RangeMap<K, V>::contains(const K& key) const
+{
+    for (const Node* t = m_root.get(); t != NULL; ) {
+        if (t->key == key) {
+            return true;
+        }
+        t = (t->key > key) ? t->left.get() : t->right.get();
+    }
+    return false;
+}
+
+
+template<typename K, typename V>
+V RangeMap<K, V>::get(const K& key) const
+{
+    V carry = V();
+    for (const Node* t = m_root.get(); t != NULL; ) {
+        if (t->key == key) {
+            return t->value + carry;
+        }
+        carry = carry + t->lazy;
+        t = (t->key > key) ? t->left.get() : t->right.get();
+    }
+    throw std::out_of_range("key not in map");
+}
+
+
+template<typename K, typename V>
+RangeMap<K, V> RangeMap<K, V>::remove(const K& key) const
+{
+    bool found = false;
+    Ptr root = remove(m_root, V(), key, found);
+    return found ? RangeMap<K, V>(root) : *this;
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::make(const K& key, const V& value,
+                     const Ptr& left, const Ptr& right)
+{
+    std::shared_ptr<Node> n = std::make_shared<Node>();
+    n->key = key;
+    n->value = value;
+    n->lazy = V();
+    n->sum = node_sum(left) + value + node_sum(right);
+    n->min = left ? left->min : key;
+    n->max = right ? right->max : key;
+    n->size = node_size(left) + 1 + node_size(right);
+    n->height = std::max(node_height(left), node_height(right)) + 1;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::shift(const Ptr& t, const V& delta)
+{
+    if (!t || delta == V()) {
+        return t;
+    }
+    std::shared_ptr<Node> n = std::make_shared<Node>(*t);
+    n->value = t->value + delta;
+    n->lazy = t->lazy + delta;
+    n->sum = t->sum + delta * V(t->size);
+    return n;
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::balance(const K& key, const V& value,
+                        const Ptr& left, const Ptr& right)
+{
+    // a child taken apart by a rotation hands its tag to its children
+    if (node_height(left) > node_height(right) + 1) {
+        Ptr outer = shift(left->left, left->lazy);
+        Ptr inner = shift(left->right, left->lazy);
+        if (node_height(outer) >= node_height(inner)) {
+            return make(left->key, left->value,
+                        outer, make(key, value, inner, right));
+        }
+        return make(inner->key, inner->value,
+                    make(left->key, left->value,
+                         outer, shift(inner->left, inner->lazy)),
+                    make(key, value,
+                         shift(inner->right, inner->lazy), right));
+    }
+    if (node_height(right) > node_height(left) + 1) {
+        Ptr outer = shift(right->right, right->lazy);
+        Ptr inner = shift(right->left, right->lazy);
+        if (node_height(outer) >= node_height(inner)) {
+            return make(right->key, right->value,
+                        make(key, value, left, inner), outer);
+        }
+        return make(inner->key, inner->value,
+                    make(key, value,
+                         left, shift(inner->left, inner->lazy)),
+                    make(right->key, right->value,
+                         shift(inner->right, inner->lazy), outer));
+    }
+    return make(key, value, left, right);
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::put(const Ptr& t, const V& carry,
+                    const K& key, const V& value)
+{
+    if (!t) {
+        return make(key, value, Ptr(), Ptr());
+    }
+    V down = carry + t->lazy;
+    if (t->key == key) {
+        return make(key, value, shift(t->left, down), shift(t->right, down));
+    } else if (t->key > key) {
+        return balance(t->key, t->value + carry,
+                       put(t->left, down, key, value),
+                       shift(t->right, down));
+    } else {
+        return balance(t->key, t->value + carry,
+                       shift(t->left, down),
+                       put(t->right, down, key, value));
+    }
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::remove(const Ptr& t, const V& carry, const K& key,
+                       bool& found)
+{
+    if (!t) {
+        return t;
+    }
+    V down = carry + t->lazy;
+    if (t->key == key) {
+        found = true;
+        if (!t->right) {
+            return shift(t->left, down);
+        }
+        K min_key = key;
+        V min_value = V();
+        Ptr rest = popMin(t->right, down, min_key, min_value);
+        return balance(min_key, min_value, shift(t->left, down), rest);
+    } else if (t->key > key) {
+        Ptr left = remove(t->left, down, key, found);
+        if (!found) {
+            return t;
+        }
+        return balance(t->key, t->value + carry, left, shift(t->right, down));
+    } else {
+        Ptr right = remove(t->right, down, key, found);
+        if (!found) {
+            return t;
+        }
+        return balance(t->key, t->value + carry, shift(t->left, down), right);
+    }
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::popMin(const Ptr& t, const V& carry, K& key, V& value)
+{
+    V down = carry + t->lazy;
+    if (!t->left) {
+        key = t->key;
+        value = t->value + carry;
+        return shift(t->right, down);
+    }
+    return balance(t->key, t->value + carry,
+                   popMin(t->left, down, key, value),
+                   shift(t->right, down));
+}
+
+
+template<typename K, typename V>
+typename RangeMap<K, V>::Ptr
+RangeMap<K, V>::add(const Ptr& t, const V& carry,
+                    const K& lo, const K& hi, const V& delta)
+{
+    if (!t || lo > t->max || t->min > hi) {
+        // nothing in range: only the inherited tag applies
+        return shift(t, carry);
+    }
+    if (!(lo > t->min) && !(t->max > hi)) {
+        // all in range: tag the whole subtree
+        return shift(t, carry + delta);
+    }
+    V down = carry + t->lazy;
+    bool in_range = !(lo > t->key) && !(t->key > hi);
+    return make(t->key, t->value + carry + (in_range ? delta : V()),
+                add(t->left, down, lo, hi, delta),
+                add(t->right, down, lo, hi, delta));
+}
+
+
+template<typename K, typename V>
+V RangeMap<K, V>::sum(const Ptr& t, const V& carry, const K& lo, const K& hi)
+{
+    if (!t || lo > t->max || t->min > hi) {
+        return V();
+    }
+    if (!(lo > t->min) && !(t->max > hi)) {
+        return t->sum + carry * V(t->size);
+    }
+    V down = carry + t->lazy;
+    bool in_range = !(lo > t->key) && !(t->key > hi);
+    return sum(t->left, down, lo, hi)
+         + (in_range ? t->value + carry : V())
+         + sum(t->right, down, lo, hi);
+}
+
+
+template<typename K, typename V>
+void RangeMap<K, V>::append(const Ptr& t, const V& carry,
+                            std::list<std::pair<K, V> >& l)
+{
+    if (!t) {
+        return;
+    }
+    V down = carry + t->lazy;
+    append(t->left, down, l);
+    l.push_back(std::make_pair(t->key, t->value + carry));
+    append(t->right, down, l);
+}
@@ -0,0 +1,209 @@
+/**
+ * @file
+ * @brief Persistent run-coalescing range sets
+ *
+ * Contains a persistent set of integers stored as maximal runs of
+ * consecutive values. Each node of the underlying Tree holds one run,
+ * so storage grows with the number of runs, not the number of values.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <list>
+#include <stdexcept>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Persistent set of integers, stored as runs
+ *
+ * Runs never overlap or touch: inserting a value next to a run extends
+ * it, inserting one that bridges two runs merges them, and removing a
+ * value from inside a run splits it. Like Tree, a RangeSet is never
+ * modified; every update returns a new set sharing unchanged runs.
+ *
+ * T must be an integer type.
+ */
+template<typename T>
+class RangeSet
+{
+public:
+    /**
+     * @brief the values lo through hi, inclusive
+     *
+     * Runs compare on lo alone, so the tree can be searched by value.
+     */
+    struct Run
+    {
+        T lo;
+        T hi;
+
+        bool operator==(const Run& rhs) const { return lo == rhs.lo; }
+        bool operator!=(const Run& rhs) const { return lo != rhs.lo; }
+        bool operator>(const Run& rhs) const { return lo > rhs.lo; }
+    };
+
+    /**
+     * @brief creates an empty set
+     */
+    RangeSet() :
+        m_root(None<Tree<Run>>()),
+        m_size(0)
+    {};
+
+    /**
+     * @brief returns the number of values in the set
+     */
+    inline size_t size() const { return m_size; };
+
+    /**
+     * @brief returns the number of runs the values are stored in
+     */
+    inline size_t runs() const { return tree_size(m_root); };
+
+    /**
+     * @brief returns true if val is in the set
+     */
+    bool contains(const T& val) const {
+        const Run* r = m_root.is_some() ? m_root->floor(run(val, val)) : NULL;
+        return r != NULL && val <= r->hi;
+    }
+
+    /**
+     * @brief returns a new set with val added
+     */
+    RangeSet<T> insert(const T& val) const { return insert(val, val); }
+
+    /**
+     * @brief returns a new set with lo through hi added
+     */
+    RangeSet<T> insert(const T& lo, const T& hi) const;
+
+    /**
+     * @brief returns a new set with val removed
+     */
+    RangeSet<T> remove(const T& val) const;
+
+    /**
+     * @brief returns the runs of the set in ascending order
+     */
+    std::list<Run> toList() const {
+        return m_root.is_some() ? m_root->toList() : std::list<Run>();
+    }
+
+private:
+
+    RangeSet(const Option<Tree<Run>>& root, size_t size) :
+        m_root(root),
+        m_size(size)
+    {};
+
+    static Run run(const T& lo, const T& hi) {
+        Run r = { lo, hi };
+        return r;
+    }
+
+    /**
+     * @brief number of values in a run
+     */
+    static size_t length(const Run& r) {
+        return static_cast<size_t>(r.hi - r.lo) + 1;
+    }
+
+    /**
+     * @brief true if a run ending at hi and one starting at lo would
+     * overlap or touch
+     */
+    static bool joins(const T& hi, const T& lo) {
+        // written so that hi + 1 cannot overflow
+        return lo <= hi || lo - hi == 1;
+    }
+
+    /// the runs, keyed by their lowest value
+    Option<Tree<Run>> m_root;
+
+    /// number of values in all runs
+    size_t m_size;
+};
+
+
+
+template<typename T>
+RangeSet<T> RangeSet<T>::insert(const T& lo, const T& hi) const
+{
+    if (hi < lo) {
+        throw std::invalid_argument("range ends before it starts");
+    }
+    Run merged = run(lo, hi);
+    size_t size = m_size;
+    Option<Tree<Run>> root = m_root;
+    // the run starting at or before lo, if it reaches lo
+    const Run* r = root.is_some() ? root->floor(merged) : NULL;
+    if (r != NULL && joins(r->hi, lo)) {
+        if (hi <= r->hi) {
+            // already covered
+            return *this;
+        }
+        merged.lo = r->lo;
+        size -= length(*r);
+        root = root->remove(*r);
+    }
+    // every run starting inside or just after the merged run
+    for (;;) {
+        r = root.is_some() ? root->ceiling(merged) : NULL;
+        if (r == NULL || !joins(merged.hi, r->lo)) {
+            break;
+        }
+        if (r->hi > merged.hi) {
+            merged.hi = r->hi;
+        }
+        size -= length(*r);
+        root = root->remove(*r);
+    }
+    size += length(merged);
+    if (root.is_none()) {
+        return RangeSet<T>(Some(Tree<Run>(merged)), size);
+    }
+    return RangeSet<T>(Some(root->insert(merged)), size);
+}
+
+
+template<typename T>
+RangeSet<T> RangeSet<T>::remove(const T& val) const
+{
+    const Run* found = m_root.is_some() ? m_root->floor(run(val, val)) : NULL;
+    if (found == NULL || val > found->hi) {
+        return *this;
+    }
+    Run r = *found;
+    Option<Tree<Run>> root = m_root->remove(r);
+    if (r.lo < val) {
+        Run below = run(r.lo, val - 1);
+        root = root.is_some() ? Some(root->insert(below))
+                              : Some(Tree<Run>(below));
+    }
+    if (val < r.hi) {
+        Run above = run(val + 1, r.hi);
+        root = root.is_some() ? Some(root->insert(above))
+                              : Some(Tree<Run>(above));
+    }
+    return RangeSet<T>(root, m_size - 1);
+}
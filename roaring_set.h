@@ -0,0 +1,860 @@
+/**
+ * @file
+ * @brief Persistent Roaring-style integer sets
+ *
+ * Contains a persistent set of 32-bit integers for sets with dense
+ * clusters. The high 16 bits of each value select a chunk, kept in a
+ * persistent Tree; the low 16 bits are stored in an immutable container
+ * that is a sorted array, a bitmap or a list of runs, whichever is
+ * smallest for that chunk. Versions share both tree nodes and the
+ * containers of every chunk they did not change.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // lower_bound, set_intersection
+#include <iterator>     // back_inserter
+#include <list>
+#include <memory>       // shared_ptr
+#include <stdint.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>  // bitmap and/or, two words at a time
+#endif
+
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+
+/**
+ * @brief Immutable set of 16-bit values in one of three layouts
+ *
+ * Containers are never modified once built. Operations that change one
+ * build a new container in whichever layout is smallest for the result.
+ */
+class RoaringContainer
+{
+public:
+    /**
+     * @brief the layout of a container
+     */
+    enum Kind {
+        ARRAY,      ///< sorted values, 2 bytes each
+        BITMAP,     ///< one bit per possible value, 8 KiB
+        RUNS        ///< sorted [start, start + length] runs, 4 bytes each
+    };
+
+    /// shared handle to a container
+    typedef std::shared_ptr<const RoaringContainer> Ptr;
+
+    /// number of 64-bit words in a bitmap
+    enum { words = 65536 / 64 };
+
+    /**
+     * @brief returns a container holding only low
+     */
+    static Ptr single(uint16_t low) {
+        std::vector<uint16_t> values(1, low);
+        return from_sorted(values);
+    }
+
+    /**
+     * @brief returns the layout of this container
+     */
+    inline Kind kind() const { return m_kind; };
+
+    /**
+     * @brief returns the number of values in this container
+     */
+    inline size_t cardinality() const { return m_cardinality; };
+
+    /**
+     * @brief returns the number of bytes used by the values
+     */
+    size_t bytes() const {
+        switch (m_kind) {
+        case ARRAY:  return m_array.size() * sizeof(uint16_t);
+        case BITMAP: return m_bitmap.size() * sizeof(uint64_t);
+        default:     return m_runs.size() * sizeof(Run);
+        }
+    }
+
+    /**
+     * @brief returns true if low is in this container
+     */
+    bool contains(uint16_t low) const;
+
+    /**
+     * @brief returns a new container with low added
+     *
+     * A run container changes only the run low joins, and a bitmap only
+     * low's bit; the values are re-laid out only if the cardinality or
+     * the number of runs makes another layout smaller.
+     */
+    Ptr with(uint16_t low) const;
+
+    /**
+     * @brief returns a new container with low removed, or NULL if that
+     * would leave it empty
+     *
+     * Costs the same as with().
+     */
+    Ptr without(uint16_t low) const;
+
+    /**
+     * @brief returns the values in both containers, or NULL if none
+     */
+    static Ptr intersect(const RoaringContainer& a, const RoaringContainer& b);
+
+    /**
+     * @brief returns the values in either container
+     */
+    static Ptr unite(const RoaringContainer& a, const RoaringContainer& b);
+
+    /**
+     * @brief calls f on each value in ascending order
+     */
+    template<typename F>
+    void for_each(F f) const {
+        if (m_kind == ARRAY) {
+            for (size_t i=0; i<m_array.size(); ++i) {
+                f(m_array[i]);
+            }
+        } else if (m_kind == RUNS) {
+            for (size_t i=0; i<m_runs.size(); ++i) {
+                uint32_t end = static_cast<uint32_t>(m_runs[i].start)
+                             + m_runs[i].length;
+                for (uint32_t v=m_runs[i].start; v<=end; ++v) {
+                    f(static_cast<uint16_t>(v));
+                }
+            }
+        } else {
+            for (size_t w=0; w<words; ++w) {
+                uint64_t bits = m_bitmap[w];
+                while (bits != 0) {
+                    f(static_cast<uint16_t>(w * 64 + __builtin_ctzll(bits)));
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+private:
+
+    /**
+     * @brief values start through start + length
+     */
+    struct Run
+    {
+        uint16_t start;
+        uint16_t length;
+    };
+
+    RoaringContainer(Kind kind, size_t cardinality) :
+        m_kind(kind),
+        m_cardinality(cardinality),
+        m_bitmap_runs(0)
+    {};
+
+    /**
+     * @brief the smallest layout for cardinality values in runs runs
+     */
+    static Kind layout(size_t cardinality, size_t runs) {
+        size_t array_bytes = cardinality * sizeof(uint16_t);
+        size_t run_bytes = runs * sizeof(Run);
+        if (array_bytes <= run_bytes && array_bytes <= words * sizeof(uint64_t)) {
+            return ARRAY;
+        } else if (run_bytes < words * sizeof(uint64_t)) {
+            return RUNS;
+        }
+        return BITMAP;
+    }
+
+    /**
+     * @brief returns the number of runs starting at or before low
+     */
+    size_t runs_upto(uint16_t low) const;
+
+    /**
+     * @brief build the smallest container for sorted, distinct values
+     */
+    static Ptr from_sorted(const std::vector<uint16_t>& values);
+
+    /**
+     * @brief build the smallest container for a bitmap
+     */
+    static Ptr from_bitmap(const uint64_t* bitmap);
+
+    /**
+     * @brief build the smallest container for sorted, disjoint runs
+     * holding cardinality values, keeping them as they are if runs are
+     * the smallest
+     */
+    static Ptr from_runs(const std::vector<Run>& runs, size_t cardinality);
+
+    /**
+     * @brief build the smallest container for a bitmap whose values and
+     * runs are already counted, taking its words if it stays a bitmap
+     */
+    static Ptr from_words(std::vector<uint64_t>& bitmap,
+                          size_t cardinality, size_t runs);
+
+    /**
+     * @brief write this container's values into a zeroed bitmap
+     */
+    void to_bitmap(uint64_t* bitmap) const;
+
+    /**
+     * @brief bitmap = a & b, word by word
+     */
+    static void and_words(const uint64_t* a, const uint64_t* b,
+                          uint64_t* bitmap);
+
+    /**
+     * @brief bitmap = a | b, word by word
+     */
+    static void or_words(const uint64_t* a, const uint64_t* b,
+                         uint64_t* bitmap);
+
+    /// the layout in use; only the matching member below is filled in
+    const Kind m_kind;
+
+    /// number of values held
+    const size_t m_cardinality;
+
+    /// values, if m_kind is ARRAY
+    std::vector<uint16_t> m_array;
+
+    /// bits, if m_kind is BITMAP
+    std::vector<uint64_t> m_bitmap;
+
+    /// number of runs the bits form, if m_kind is BITMAP
+    size_t m_bitmap_runs;
+
+    /// runs, if m_kind is RUNS
+    std::vector<Run> m_runs;
+};
+
+
+
+/**
+ * @brief Persistent set of 32-bit integers
+ *
+ * Like Tree, a RoaringSet is never modified: insert() and remove()
+ * return new sets, sharing everything they did not change with this
+ * one. Unlike Tree, a RoaringSet may be empty.
+ */
+class RoaringSet
+{
+public:
+    /**
+     * @brief creates an empty set
+     */
+    RoaringSet() :
+        m_root(None<Tree<Chunk>>()),
+        m_size(0)
+    {};
+
+    /**
+     * @brief returns the number of values in the set
+     */
+    inline size_t size() const { return m_size; };
+
+    /**
+     * @brief returns the number of 65536-value chunks holding values
+     */
+    inline size_t chunks() const { return tree_size(m_root); };
+
+    /**
+     * @brief returns the bytes used by all containers in the set
+     */
+    size_t bytes() const;
+
+    /**
+     * @brief returns true if val is in the set
+     */
+    bool contains(uint32_t val) const;
+
+    /**
+     * @brief returns a new set with val added
+     */
+    RoaringSet insert(uint32_t val) const;
+
+    /**
+     * @brief returns a new set with val removed
+     */
+    RoaringSet remove(uint32_t val) const;
+
+    /**
+     * @brief returns a new set of the values in both sets
+     */
+    RoaringSet intersect(const RoaringSet& rhs) const;
+
+    /**
+     * @brief returns a new set of the values in either set
+     *
+     * Chunks found in only one of the sets are shared with it.
+     */
+    RoaringSet unite(const RoaringSet& rhs) const;
+
+    /**
+     * @brief returns the values of the set in ascending order
+     */
+    std::list<uint32_t> toList() const;
+
+private:
+
+    /**
+     * @brief the container for all values sharing their high 16 bits
+     *
+     * Chunks compare on key alone, so a Chunk with no container can be
+     * used to look one up.
+     */
+    struct Chunk
+    {
+        uint16_t key;
+        RoaringContainer::Ptr container;
+
+        bool operator==(const Chunk& rhs) const { return key == rhs.key; }
+        bool operator!=(const Chunk& rhs) const { return key != rhs.key; }
+        bool operator>(const Chunk& rhs) const { return key > rhs.key; }
+    };
+
+    RoaringSet(const Option<Tree<Chunk>>& root, size_t size) :
+        m_root(root),
+        m_size(size)
+    {};
+
+    static Chunk chunk(uint16_t key,
+                       RoaringContainer::Ptr container=RoaringContainer::Ptr()) {
+        Chunk c = { key, container };
+        return c;
+    }
+
+    /**
+     * @brief return root with chunk c replacing any chunk with its key
+     */
+    static Option<Tree<Chunk>> put(const Option<Tree<Chunk>>& root,
+                                   const Chunk& c);
+
+    /// the chunks, keyed by the high 16 bits
+    Option<Tree<Chunk>> m_root;
+
+    /// number of values in all chunks
+    size_t m_size;
+};
+
+
+
+inline bool RoaringContainer::contains(uint16_t low) const
+{
+    if (m_kind == BITMAP) {
+        return (m_bitmap[low / 64] >> (low % 64)) & 1;
+    } else if (m_kind == ARRAY) {
+        return std::binary_search(m_array.begin(), m_array.end(), low);
+    } else {
+        // last run starting at or before low
+        size_t i = runs_upto(low);
+        return i > 0 && low - m_runs[i - 1].start <= m_runs[i - 1].length;
+    }
+}
+
+
+inline size_t RoaringContainer::runs_upto(uint16_t low) const
+{
+    size_t lo = 0;
+    size_t hi = m_runs.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (m_runs[mid].start <= low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+inline RoaringContainer::Ptr RoaringContainer::with(uint16_t low) const
+{
+    if (m_kind == ARRAY) {
+        std::vector<uint16_t> values(m_array);
+        std::vector<uint16_t>::iterator it =
+            std::lower_bound(values.begin(), values.end(), low);
+        if (it == values.end() || *it != low) {
+            values.insert(it, low);
+        }
+        return from_sorted(values);
+    } else if (contains(low)) {
+        return Ptr(new RoaringContainer(*this));
+    } else if (m_kind == BITMAP) {
+        // low joins the runs on either side of it, if there are any
+        bool below = low > 0 && contains(low - 1);
+        bool above = low < 0xffff && contains(low + 1);
+        std::vector<uint64_t> bitmap(m_bitmap);
+        bitmap[low / 64] |= uint64_t(1) << (low % 64);
+        return from_words(bitmap, m_cardinality + 1,
+                          m_bitmap_runs + 1 - below - above);
+    }
+    std::vector<Run> runs(m_runs);
+    size_t i = runs_upto(low);
+    bool below = i > 0 &&
+                 static_cast<uint32_t>(runs[i - 1].start) + runs[i - 1].length
+                 + 1 == low;
+    bool above = i < runs.size() &&
+                 static_cast<uint32_t>(low) + 1 == runs[i].start;
+    if (below && above) {
+        runs[i - 1].length += runs[i].length + 2;
+        runs.erase(runs.begin() + i);
+    } else if (below) {
+        ++runs[i - 1].length;
+    } else if (above) {
+        runs[i].start = low;
+        ++runs[i].length;
+    } else {
+        Run r = { low, 0 };
+        runs.insert(runs.begin() + i, r);
+    }
+    return from_runs(runs, m_cardinality + 1);
+}
+
+
+inline RoaringContainer::Ptr RoaringContainer::without(uint16_t low) const
+{
+    if (m_kind == ARRAY) {
+        std::vector<uint16_t> values(m_array);
+        values.erase(std::remove(values.begin(), values.end(), low),
+                     values.end());
+        return values.empty() ? Ptr() : from_sorted(values);
+    } else if (!contains(low)) {
+        return Ptr(new RoaringContainer(*this));
+    } else if (m_cardinality == 1) {
+        return Ptr();
+    } else if (m_kind == BITMAP) {
+        // removing low splits its run, shortens it, or removes it
+        bool below = low > 0 && contains(low - 1);
+        bool above = low < 0xffff && contains(low + 1);
+        std::vector<uint64_t> bitmap(m_bitmap);
+        bitmap[low / 64] &= ~(uint64_t(1) << (low % 64));
+        return from_words(bitmap, m_cardinality - 1,
+                          m_bitmap_runs + below + above - 1);
+    }
+    std::vector<Run> runs(m_runs);
+    size_t i = runs_upto(low) - 1;
+    uint16_t start = runs[i].start;
+    uint16_t end = static_cast<uint16_t>(start + runs[i].length);
+    if (start == end) {
+        runs.erase(runs.begin() + i);
+    } else if (low == start) {
+        ++runs[i].start;
+        --runs[i].length;
+    } else if (low == end) {
+        --runs[i].length;
+    } else {
+        Run upper = { static_cast<uint16_t>(low + 1),
+                      static_cast<uint16_t>(end - low - 1) };
+        runs[i].length = static_cast<uint16_t>(low - start - 1);
+        runs.insert(runs.begin() + i + 1, upper);
+    }
+    return from_runs(runs, m_cardinality - 1);
+}
+
+
+inline RoaringContainer::Ptr
+RoaringContainer::intersect(const RoaringContainer& a,
+                            const RoaringContainer& b)
+{
+    if (a.m_kind == ARRAY && b.m_kind == ARRAY) {
+        std::vector<uint16_t> values;
+        std::set_intersection(a.m_array.begin(), a.m_array.end(),
+                              b.m_array.begin(), b.m_array.end(),
+                              std::back_inserter(values));
+        return values.empty() ? Ptr() : from_sorted(values);
+    } else if (a.m_kind == ARRAY || b.m_kind == ARRAY) {
+        // probe the other container for each value of the array
+        const RoaringContainer& array = a.m_kind == ARRAY ? a : b;
+        const RoaringContainer& other = a.m_kind == ARRAY ? b : a;
+        std::vector<uint16_t> values;
+        for (size_t i=0; i<array.m_array.size(); ++i) {
+            if (other.contains(array.m_array[i])) {
+                values.push_back(array.m_array[i]);
+            }
+        }
+        return values.empty() ? Ptr() : from_sorted(values);
+    }
+    std::vector<uint64_t> lhs(words, 0);
+    std::vector<uint64_t> rhs(words, 0);
+    a.to_bitmap(&lhs[0]);
+    b.to_bitmap(&rhs[0]);
+    and_words(&lhs[0], &rhs[0], &lhs[0]);
+    return from_bitmap(&lhs[0]);
+}
+
+
+inline RoaringContainer::Ptr
+RoaringContainer::unite(const RoaringContainer& a, const RoaringContainer& b)
+{
+    if (a.m_kind == ARRAY && b.m_kind == ARRAY &&
+        a.m_cardinality + b.m_cardinality <= 4096) {
+        std::vector<uint16_t> values;
+        std::set_union(a.m_array.begin(), a.m_array.end(),
+                       b.m_array.begin(), b.m_array.end(),
+                       std::back_inserter(values));
+        return from_sorted(values);
+    }
+    std::vector<uint64_t> lhs(words, 0);
+    std::vector<uint64_t> rhs(words, 0);
+    a.to_bitmap(&lhs[0]);
+    b.to_bitmap(&rhs[0]);
+    or_words(&lhs[0], &rhs[0], &lhs[0]);
+    return from_bitmap(&lhs[0]);
+}
+
+
+inline RoaringContainer::Ptr
+RoaringContainer::from_sorted(const std::vector<uint16_t>& values)
+{
+    size_t runs = 0;
+    for (size_t i=0; i<values.size(); ++i) {
+        if (i == 0 || values[i] != values[i - 1] + 1) {
+            ++runs;
+        }
+    }
+    Kind kind = layout(values.size(), runs);
+    if (kind == ARRAY) {
+        std::shared_ptr<RoaringContainer> c(
+            new RoaringContainer(ARRAY, values.size()));
+        c->m_array = values;
+        return c;
+    } else if (kind == RUNS) {
+        std::shared_ptr<RoaringContainer> c(
+            new RoaringContainer(RUNS, values.size()));
+        c->m_runs.reserve(runs);
+        for (size_t i=0; i<values.size(); ++i) {
+            if (i == 0 || values[i] != values[i - 1] + 1) {
+                Run r = { values[i], 0 };
+                c->m_runs.push_back(r);
+            } else {
+                ++c->m_runs.back().length;
+            }
+        }
+        return c;
+    }
+    std::vector<uint64_t> bitmap(words, 0);
+    for (size_t i=0; i<values.size(); ++i) {
+        bitmap[values[i] / 64] |= uint64_t(1) << (values[i] % 64);
+    }
+    return from_bitmap(&bitmap[0]);
+}
+
+
+inline RoaringContainer::Ptr RoaringContainer::from_bitmap(const uint64_t* bitmap)
+{
+    size_t cardinality = 0;
+    size_t runs = 0;
+    uint64_t carry = 0;
+    for (size_t w=0; w<words; ++w) {
+        cardinality += __builtin_popcountll(bitmap[w]);
+        // a run starts at each set bit whose lower neighbour is clear
+        runs += __builtin_popcountll(bitmap[w] & ~(bitmap[w] << 1 | carry));
+        carry = bitmap[w] >> 63;
+    }
+    if (cardinality == 0) {
+        return Ptr();
+    }
+    if (layout(cardinality, runs) != BITMAP) {
+        std::vector<uint16_t> values;
+        values.reserve(cardinality);
+        for (size_t w=0; w<words; ++w) {
+            uint64_t bits = bitmap[w];
+            while (bits != 0) {
+                values.push_back(static_cast<uint16_t>(
+                    w * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+        return from_sorted(values);
+    }
+    std::shared_ptr<RoaringContainer> c(
+        new RoaringContainer(BITMAP, cardinality));
+    c->m_bitmap.assign(bitmap, bitmap + words);
+    c->m_bitmap_runs = runs;
+    return c;
+}
+
+
+inline RoaringContainer::Ptr
+RoaringContainer::from_runs(const std::vector<Run>& runs, size_t cardinality)
+{
+    Kind kind = layout(cardinality, runs.size());
+    if (kind == RUNS) {
+        std::shared_ptr<RoaringContainer> c(
+            new RoaringContainer(RUNS, cardinality));
+        c->m_runs = runs;
+        return c;
+    }
+    RoaringContainer expanded(RUNS, cardinality);
+    expanded.m_runs = runs;
+    if (kind == ARRAY) {
+        std::shared_ptr<RoaringContainer> c(
+            new RoaringContainer(ARRAY, cardinality));
+        c->m_array.reserve(cardinality);
+        expanded.for_each([&c](uint16_t v) { c->m_array.push_back(v); });
+        return c;
+    }
+    std::shared_ptr<RoaringContainer> c(
+        new RoaringContainer(BITMAP, cardinality));
+    c->m_bitmap.assign(words, 0);
+    expanded.to_bitmap(&c->m_bitmap[0]);
+    c->m_bitmap_runs = runs.size();
+    return c;
+}
+
+
+inline RoaringContainer::Ptr
+RoaringContainer::from_words(std::vector<uint64_t>& bitmap,
+                             size_t cardinality, size_t runs)
+{
+    if (layout(cardinality, runs) != BITMAP) {
+        return from_bitmap(&bitmap[0]);
+    }
+    std::shared_ptr<RoaringContainer> c(
+        new RoaringContainer(BITMAP, cardinality));
+    c->m_bitmap.swap(bitmap);
+    c->m_bitmap_runs = runs;
+    return c;
+}
+
+
+inline void RoaringContainer::to_bitmap(uint64_t* bitmap) const
+{
+    if (m_kind == BITMAP) {
+        std::copy(m_bitmap.begin(), m_bitmap.end(), bitmap);
+    } else if (m_kind == ARRAY) {
+        for (size_t i=0; i<m_array.size(); ++i) {
+            bitmap[m_array[i] / 64] |= uint64_t(1) << (m_array[i] % 64);
+        }
+    } else {
+        for (size_t i=0; i<m_runs.size(); ++i) {
+            uint32_t end = static_cast<uint32_t>(m_runs[i].start)
+                         + m_runs[i].length;
+            for (uint32_t v=m_runs[i].start; v<=end; ++v) {
+                bitmap[v / 64] |= uint64_t(1) << (v % 64);
+            }
+        }
+    }
+}
+
+
+inline void RoaringContainer::and_words(const uint64_t* a, const uint64_t* b,
+                                        uint64_t* bitmap)
+{
+#ifdef __SSE2__
+    for (size_t w=0; w<words; w+=2) {
+        __m128i lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + w));
+        __m128i rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bitmap + w),
+                         _mm_and_si128(lhs, rhs));
+    }
+#else
+    for (size_t w=0; w<words; ++w) {
+        bitmap[w] = a[w] & b[w];
+    }
+#endif
+}
+
+
+inline void RoaringContainer::or_words(const uint64_t* a, const uint64_t* b,
+                                       uint64_t* bitmap)
+{
+#ifdef __SSE2__
+    for (size_t w=0; w<words; w+=2) {
+        __m128i lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + w));
+        __m128i rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bitmap + w),
+                         _mm_or_si128(lhs, rhs));
+    }
+#else
+    for (size_t w=0; w<words; ++w) {
+        bitmap[w] = a[w] | b[w];
+    }
+#endif
+}
+
+
+
+inline size_t RoaringSet::bytes() const
+{
+    size_t total = 0;
+    if (m_root.is_some()) {
+        std::list<Chunk> chunks(m_root->toList());
+        for (std::list<Chunk>::iterator it=chunks.begin();
+             it != chunks.end();
+             ++it) {
+            total += it->container->bytes();
+        }
+    }
+    return total;
+}
+
+
+inline bool RoaringSet::contains(uint32_t val) const
+{
+    if (m_root.is_none()) {
+        return false;
+    }
+    const Chunk* c = m_root->find(chunk(val >> 16));
+    return c != NULL && c->container->contains(val & 0xffff);
+}
+
+
+inline RoaringSet RoaringSet::insert(uint32_t val) const
+{
+    uint16_t key = val >> 16;
+    uint16_t low = val & 0xffff;
+    const Chunk* c = m_root.is_some() ? m_root->find(chunk(key)) : NULL;
+    if (c == NULL) {
+        return RoaringSet(put(m_root, chunk(key, RoaringContainer::single(low))),
+                          m_size + 1);
+    } else if (c->container->contains(low)) {
+        return *this;
+    } else {
+        return RoaringSet(put(m_root, chunk(key, c->container->with(low))),
+                          m_size + 1);
+    }
+}
+
+
+inline RoaringSet RoaringSet::remove(uint32_t val) const
+{
+    uint16_t key = val >> 16;
+    uint16_t low = val & 0xffff;
+    const Chunk* c = m_root.is_some() ? m_root->find(chunk(key)) : NULL;
+    if (c == NULL || !c->container->contains(low)) {
+        return *this;
+    }
+    RoaringContainer::Ptr rest = c->container->without(low);
+    if (rest == NULL) {
+        return RoaringSet(m_root->remove(chunk(key)), m_size - 1);
+    }
+    return RoaringSet(put(m_root, chunk(key, rest)), m_size - 1);
+}
+
+
+inline RoaringSet RoaringSet::intersect(const RoaringSet& rhs) const
+{
+    if (m_root.is_none() || rhs.m_root.is_none()) {
+        return RoaringSet();
+    }
+    TREE_TRACE_SCOPE(trace, "RoaringSet::intersect");
+    std::list<Chunk> ours(m_root->toList());
+    std::list<Chunk> theirs(rhs.m_root->toList());
+    TREE_TRACE_COUNT(trace, ours.size() + theirs.size(), 0);
+    Option<Tree<Chunk>> root = None<Tree<Chunk>>();
+    size_t size = 0;
+    std::list<Chunk>::iterator a = ours.begin();
+    std::list<Chunk>::iterator b = theirs.begin();
+    while (a != ours.end() && b != theirs.end()) {
+        if (a->key < b->key) {
+            ++a;
+        } else if (b->key < a->key) {
+            ++b;
+        } else {
+            RoaringContainer::Ptr both = (a->container == b->container)
+                ? a->container
+                : RoaringContainer::intersect(*a->container, *b->container);
+            if (both != NULL) {
+                root = put(root, chunk(a->key, both));
+                size += both->cardinality();
+            }
+            ++a;
+            ++b;
+        }
+    }
+    return RoaringSet(root, size);
+}
+
+
+inline RoaringSet RoaringSet::unite(const RoaringSet& rhs) const
+{
+    if (m_root.is_none()) {
+        return rhs;
+    } else if (rhs.m_root.is_none()) {
+        return *this;
+    }
+    // start from the larger set and merge the other one's chunks in
+    const RoaringSet& big = m_size >= rhs.m_size ? *this : rhs;
+    const RoaringSet& small = m_size >= rhs.m_size ? rhs : *this;
+    TREE_TRACE_SCOPE(trace, "RoaringSet::unite");
+    std::list<Chunk> chunks(small.m_root->toList());
+    TREE_TRACE_COUNT(trace, chunks.size(), 0);
+    Option<Tree<Chunk>> root = big.m_root;
+    size_t size = big.m_size;
+    for (std::list<Chunk>::iterator it=chunks.begin();
+         it != chunks.end();
+         ++it) {
+        const Chunk* c = root->find(*it);
+        if (c == NULL) {
+            root = put(root, *it);
+            size += it->container->cardinality();
+        } else if (c->container != it->container) {
+            RoaringContainer::Ptr both =
+                RoaringContainer::unite(*c->container, *it->container);
+            size += both->cardinality() - c->container->cardinality();
+            root = put(root, chunk(it->key, both));
+        }
+    }
+    return RoaringSet(root, size);
+}
+
+
+inline std::list<uint32_t> RoaringSet::toList() const
+{
+    std::list<uint32_t> l;
+    if (m_root.is_none()) {
+        return l;
+    }
+    std::list<Chunk> chunks(m_root->toList());
+    for (std::list<Chunk>::iterator it=chunks.begin();
+         it != chunks.end();
+         ++it) {
+        uint32_t high = static_cast<uint32_t>(it->key) << 16;
+        it->container->for_each([&l, high](uint16_t low) {
+            l.push_back(high | low);
+        });
+    }
+    return l;
+}
+
+
+inline Option<Tree<RoaringSet::Chunk>>
+RoaringSet::put(const Option<Tree<Chunk>>& root, const Chunk& c)
+{
+    if (root.is_none()) {
+        return Some(Tree<Chunk>(c));
+    } else if (root->find(c) != NULL) {
+        // same key, so the chunk is rewritten where it is
+        return Some(root->replace(c, c));
+    } else {
+        return Some(root->insert(c));
+    }
+}
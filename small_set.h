@@ -0,0 +1,271 @@
+/**
+ * @file
+ * @brief Persistent sets with an inline representation for few elements
+ *
+ * Contains a persistent set that keeps up to K elements in a sorted
+ * array inside the set itself, and only moves them into a Tree once it
+ * grows past K. Most sets in some workloads never hold more than a
+ * handful of elements; as an array they need no nodes, no reference
+ * counts and no allocations, and copying one copies K values.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <list>
+#include <new>          // placement new
+#include <type_traits>  // aligned_storage
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Persistent set, inline while it holds at most K elements
+ *
+ * Inserting into a full inline set promotes it to a Tree; removing from
+ * a Tree-backed set demotes it again once it is down to K / 2 elements,
+ * so a set hovering around K does not convert on every update. Like
+ * Tree, a SmallSet is never modified; every update returns a new set.
+ * Unlike Tree, inserting a value already present changes nothing.
+ */
+template<typename T, size_t K = 8>
+class SmallSet
+{
+public:
+    /**
+     * @brief creates an empty set
+     */
+    SmallSet() :
+        m_count(0),
+        m_tree(None<Tree<T>>())
+    {};
+
+    /**
+     * @brief copy constructor
+     */
+    SmallSet(const SmallSet<T, K>& rhs) :
+        m_count(0),
+        m_tree(rhs.m_tree)
+    {
+        for (size_t i=0; i < rhs.m_count; ++i) {
+            push(rhs.item(i));
+        }
+    };
+
+    /**
+     * @brief copy assignment operator
+     */
+    SmallSet<T, K>& operator=(const SmallSet<T, K>& rhs) {
+        if (this != &rhs) {
+            clear();
+            m_tree = rhs.m_tree;
+            for (size_t i=0; i < rhs.m_count; ++i) {
+                push(rhs.item(i));
+            }
+        }
+        return *this;
+    }
+
+    ~SmallSet() { clear(); }
+
+    /**
+     * @brief returns the number of elements in the set
+     */
+    size_t size() const {
+        return m_tree.is_some() ? m_tree->size() : m_count;
+    }
+
+    /**
+     * @brief returns true if the elements are held inline, not in a Tree
+     */
+    inline bool is_inline() const { return m_tree.is_none(); };
+
+    /**
+     * @brief returns True if val is in the set
+     */
+    bool contains(const T& val) const;
+
+    /**
+     * @brief returns a new set with val added
+     */
+    SmallSet<T, K> insert(const T& val) const;
+
+    /**
+     * @brief returns a new set with val removed
+     */
+    SmallSet<T, K> remove(const T& val) const;
+
+    /**
+     * @brief returns the elements as a Tree, or None if the set is empty
+     *
+     * Free for a Tree-backed set; an inline one builds its Tree in O(K).
+     */
+    Option<Tree<T>> tree() const;
+
+    std::list<T> toList() const;
+
+private:
+
+    typedef typename std::aligned_storage<
+        sizeof(T), std::alignment_of<T>::value>::type Slot;
+
+    static_assert(sizeof(Slot) == sizeof(T),
+                  "inline elements are read as an array of T");
+
+    const T& item(size_t i) const {
+        return *reinterpret_cast<const T*>(&m_items[i]);
+    }
+
+    /**
+     * @brief append val to the inline array, which must have room
+     */
+    void push(const T& val) {
+        new (&m_items[m_count]) T(val);
+        ++m_count;
+    }
+
+    /**
+     * @brief destroy the inline elements
+     */
+    void clear() {
+        for (size_t i=0; i < m_count; ++i) {
+            reinterpret_cast<T*>(&m_items[i])->~T();
+        }
+        m_count = 0;
+    }
+
+    /// number of elements in m_items; 0 once promoted
+    size_t m_count;
+
+    /// the inline elements, in ascending order
+    Slot m_items[K];
+
+    /// the elements once there are too many for m_items
+    Option<Tree<T>> m_tree;
+};
+
+
+
+template<typename T, size_t K>
+bool SmallSet<T, K>::contains(const T& val) const
+{
+    if (m_tree.is_some()) {
+        return m_tree->contains(val);
+    }
+    for (size_t i=0; i < m_count && !(item(i) > val); ++i) {
+        if (item(i) == val) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+template<typename T, size_t K>
+SmallSet<T, K> SmallSet<T, K>::insert(const T& val) const
+{
+    if (contains(val)) {
+        return *this;
+    }
+    SmallSet<T, K> result;
+    if (m_tree.is_some()) {
+        result.m_tree = Some(m_tree->insert(val));
+        return result;
+    }
+    size_t at = 0;
+    while (at < m_count && val > item(at)) {
+        ++at;
+    }
+    if (m_count < K) {
+        for (size_t i=0; i < m_count; ++i) {
+            if (i == at) {
+                result.push(val);
+            }
+            result.push(item(i));
+        }
+        if (at == m_count) {
+            result.push(val);
+        }
+        return result;
+    }
+    // full: promote to a tree of all K + 1 elements
+    std::vector<T> merged;
+    merged.reserve(K + 1);
+    for (size_t i=0; i < m_count; ++i) {
+        if (i == at) {
+            merged.push_back(val);
+        }
+        merged.push_back(item(i));
+    }
+    if (at == m_count) {
+        merged.push_back(val);
+    }
+    result.m_tree = Tree<T>::from_sorted(merged.begin(), merged.size());
+    return result;
+}
+
+
+template<typename T, size_t K>
+SmallSet<T, K> SmallSet<T, K>::remove(const T& val) const
+{
+    if (!contains(val)) {
+        return *this;
+    }
+    SmallSet<T, K> result;
+    if (m_tree.is_some()) {
+        Option<Tree<T>> rest = m_tree->remove(val);
+        if (tree_size(rest) > K / 2) {
+            result.m_tree = rest;
+        } else if (rest.is_some()) {
+            rest->for_each([&result](const T& node) { result.push(node); });
+        }
+        return result;
+    }
+    for (size_t i=0; i < m_count; ++i) {
+        if (!(item(i) == val)) {
+            result.push(item(i));
+        }
+    }
+    return result;
+}
+
+
+template<typename T, size_t K>
+Option<Tree<T>> SmallSet<T, K>::tree() const
+{
+    if (m_tree.is_some()) {
+        return m_tree;
+    }
+    return Tree<T>::from_sorted(&item(0), m_count);
+}
+
+
+template<typename T, size_t K>
+std::list<T> SmallSet<T, K>::toList() const
+{
+    if (m_tree.is_some()) {
+        return m_tree->toList();
+    }
+    std::list<T> l;
+    for (size_t i=0; i < m_count; ++i) {
+        l.push_back(item(i));
+    }
+    return l;
+}
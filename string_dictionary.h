@@ -0,0 +1,440 @@
+/**
+ * @file
+ * @brief Order-preserving dictionary encoding of string keys
+ *
+ * Contains a persistent dictionary that gives each string an integer
+ * code, such that codes compare the way their strings do, and a set of
+ * strings stored as a Tree of those codes. Inside the set every
+ * comparison is an integer compare and every node is the same small
+ * size, so it can be frozen or compressed like any other Tree<uint64_t>
+ * (see EliasFano); strings are only looked at when they come in or go
+ * out.
+ *
+ * Codes start from the middle of the code space, so there is as much
+ * room below the first string as above it. New strings take a code
+ * halfway between their neighbours'. When two neighbours have no code
+ * left between them, the whole dictionary is re-encoded with even gaps
+ * centred on the middle again, which starts a new epoch.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <algorithm>    // min
+#include <list>
+#include <stdexcept>    // out_of_range, invalid_argument
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief the most a re-encoding leaves between neighbouring codes
+ *
+ * Also the step taken past the ends of the dictionary, so strings that
+ * keep arriving in order do not use up the gap above them.
+ */
+const uint64_t STRING_CODE_SPACING = 1ull << 32;
+
+/**
+ * @brief the code the first string gets, and the centre of every
+ * re-encoding
+ */
+const uint64_t STRING_CODE_MIDDLE = 1ull << 63;
+
+/**
+ * @brief Persistent map from strings to order-preserving codes
+ *
+ * Codes are never 0. Within an epoch a string's code never changes;
+ * re-encoding changes every code and bumps the epoch, and anything
+ * holding codes from the old epoch has to be translated (see
+ * EncodedStringSet::recode). Strings are never removed. Like Tree, a
+ * dictionary is never modified; add() returns a new one.
+ */
+class StringDictionary
+{
+public:
+    /**
+     * @brief a string and its code
+     *
+     * Words order by text, which is also the order of their codes.
+     */
+    struct Word
+    {
+        std::string text;
+        uint64_t code;
+
+        bool operator==(const Word& rhs) const { return text == rhs.text; }
+        bool operator!=(const Word& rhs) const { return text != rhs.text; }
+        bool operator>(const Word& rhs) const { return text > rhs.text; }
+    };
+
+    /**
+     * @brief creates an empty dictionary
+     */
+    StringDictionary() :
+        m_words(None<Tree<Word>>()),
+        m_epoch(0)
+    {};
+
+    /**
+     * @brief returns the number of strings with codes
+     */
+    inline size_t size() const { return tree_size(m_words); };
+
+    /**
+     * @brief returns the number of times the codes have been reassigned
+     */
+    inline uint64_t epoch() const { return m_epoch; };
+
+    /**
+     * @brief returns the words, or None if there are none
+     */
+    inline const Option<Tree<Word>>& words() const { return m_words; };
+
+    /**
+     * @brief returns True if text has a code, setting code to it
+     */
+    bool encode(const std::string& text, uint64_t& code) const;
+
+    /**
+     * @brief returns the string whose code is code
+     *
+     * Throws std::out_of_range if no string has that code.
+     */
+    const std::string& decode(uint64_t code) const;
+
+    /**
+     * @brief returns a dictionary in which text has a code
+     *
+     * If there is no code left between text's neighbours, the result is
+     * re-encoded and its epoch() is one more than this one's.
+     */
+    StringDictionary add(const std::string& text) const;
+
+    /**
+     * @brief returns the same strings with evenly spaced codes, in the
+     * next epoch
+     */
+    StringDictionary reencoded() const {
+        std::vector<std::string> texts;
+        texts.reserve(size());
+        if (m_words.is_some()) {
+            m_words->for_each([&texts](const Word& w) {
+                texts.push_back(w.text);
+            });
+        }
+        return StringDictionary(texts, m_epoch + 1);
+    }
+
+private:
+
+    /**
+     * @brief creates a dictionary of texts, which must be sorted and
+     * distinct, spaced as evenly as the code space allows and centred
+     * on STRING_CODE_MIDDLE
+     */
+    StringDictionary(const std::vector<std::string>& texts, uint64_t epoch) :
+        m_words(None<Tree<Word>>()),
+        m_epoch(epoch)
+    {
+        if (texts.empty()) {
+            return;
+        }
+        uint64_t spacing = std::min<uint64_t>(STRING_CODE_SPACING,
+                                              UINT64_MAX / (texts.size() + 1));
+        // which leaves about a spacing free at either end
+        uint64_t first = STRING_CODE_MIDDLE - (texts.size() - 1) * spacing / 2;
+        std::vector<Word> words(texts.size());
+        for (size_t i=0; i < texts.size(); ++i) {
+            words[i].text = texts[i];
+            words[i].code = first + i * spacing;
+        }
+        m_words = Tree<Word>::from_sorted(words.begin(), words.size());
+    }
+
+    StringDictionary(const Option<Tree<Word>>& words, uint64_t epoch) :
+        m_words(words),
+        m_epoch(epoch)
+    {};
+
+    /// the strings, in order of text and so of code
+    Option<Tree<Word>> m_words;
+
+    /// re-encodings so far
+    uint64_t m_epoch;
+};
+
+
+/**
+ * @brief Persistent set of strings held as a Tree of their codes
+ *
+ * The set carries the dictionary its codes are from, and inserting a
+ * string it has never seen adds it there first. If that re-encodes the
+ * dictionary, the codes already in the set are translated to the new
+ * epoch, which costs O(n) in the size of the dictionary, as the
+ * re-encoding itself does. Sets that are to be compared code for code
+ * should be recoded to one dictionary. Inserting a string that is
+ * already present changes nothing.
+ */
+class EncodedStringSet
+{
+public:
+    /**
+     * @brief creates an empty set with an empty dictionary
+     */
+    EncodedStringSet() :
+        m_codes(None<Tree<uint64_t>>())
+    {};
+
+    /**
+     * @brief creates an empty set whose codes come from dictionary
+     */
+    explicit EncodedStringSet(const StringDictionary& dictionary) :
+        m_dictionary(dictionary),
+        m_codes(None<Tree<uint64_t>>())
+    {};
+
+    /**
+     * @brief returns the number of strings in the set
+     */
+    inline size_t size() const { return tree_size(m_codes); };
+
+    /**
+     * @brief returns the dictionary the codes are from
+     */
+    inline const StringDictionary& dictionary() const { return m_dictionary; };
+
+    /**
+     * @brief returns the codes of the strings in the set, or None if
+     * it is empty
+     */
+    inline const Option<Tree<uint64_t>>& codes() const { return m_codes; };
+
+    /**
+     * @brief returns True if text is in the set
+     */
+    bool contains(const std::string& text) const {
+        uint64_t code;
+        return m_codes.is_some() && m_dictionary.encode(text, code) &&
+               m_codes->contains(code);
+    }
+
+    /**
+     * @brief returns a new set with text inserted into it
+     */
+    EncodedStringSet insert(const std::string& text) const;
+
+    /**
+     * @brief returns a new set with text removed from it
+     */
+    EncodedStringSet remove(const std::string& text) const;
+
+    /**
+     * @brief returns the same strings coded by dictionary
+     *
+     * Walks the set and both dictionaries together in order, so this
+     * costs O(n) in the sizes of all three, with each string compared
+     * about once. Every string in the set must have a code in
+     * dictionary; throws std::invalid_argument if one does not.
+     */
+    EncodedStringSet recode(const StringDictionary& dictionary) const;
+
+    /**
+     * @brief returns the strings in the set, in order
+     */
+    std::list<std::string> toList() const;
+
+private:
+
+    EncodedStringSet(const StringDictionary& dictionary,
+                     const Option<Tree<uint64_t>>& codes) :
+        m_dictionary(dictionary),
+        m_codes(codes)
+    {};
+
+    /// where the codes come from
+    StringDictionary m_dictionary;
+
+    /// the codes of the strings in the set
+    Option<Tree<uint64_t>> m_codes;
+};
+
+
+
+inline bool StringDictionary::encode(const std::string& text,
+                                     uint64_t& code) const
+{
+    if (m_words.is_none()) {
+        return false;
+    }
+    Word probe = { text, 0 };
+    const Word* word = m_words->find(probe);
+    if (word == NULL) {
+        return false;
+    }
+    code = word->code;
+    return true;
+}
+
+
+inline const std::string& StringDictionary::decode(uint64_t code) const
+{
+    // codes are in the same order as the texts the tree is sorted by
+    const Tree<Word>* node = m_words.is_some() ? m_words.operator->() : NULL;
+    while (node != NULL) {
+        const Word& word = node->deref();
+        if (word.code == code) {
+            return word.text;
+        }
+        node = word.code > code ? node->left_node() : node->right_node();
+    }
+    throw std::out_of_range("no string has that code");
+}
+
+
+inline StringDictionary StringDictionary::add(const std::string& text) const
+{
+    if (m_words.is_none()) {
+        Word word = { text, STRING_CODE_MIDDLE };
+        return StringDictionary(Some(Tree<Word>(word)), m_epoch);
+    }
+    Word probe = { text, 0 };
+    if (m_words->contains(probe)) {
+        return *this;
+    }
+    const Word* below = m_words->floor(probe);
+    const Word* above = m_words->ceiling(probe);
+    // the new code goes strictly between lo and hi
+    uint64_t lo = below != NULL ? below->code : 0;
+    uint64_t hi = above != NULL ? above->code : UINT64_MAX;
+    if (hi - lo < 2) {
+        std::vector<std::string> texts;
+        texts.reserve(size() + 1);
+        m_words->for_each([&texts, &text](const Word& w) {
+            if (w.text > text && (texts.empty() || texts.back() < text)) {
+                texts.push_back(text);
+            }
+            texts.push_back(w.text);
+        });
+        if (texts.back() < text) {
+            texts.push_back(text);
+        }
+        return StringDictionary(texts, m_epoch + 1);
+    }
+    uint64_t step = std::min(STRING_CODE_SPACING, (hi - lo) / 2);
+    if (above == NULL) {
+        probe.code = lo + step;
+    } else if (below == NULL) {
+        probe.code = hi - step;
+    } else {
+        probe.code = lo + (hi - lo) / 2;
+    }
+    return StringDictionary(Some(m_words->insert(probe)), m_epoch);
+}
+
+
+
+inline EncodedStringSet EncodedStringSet::insert(const std::string& text) const
+{
+    StringDictionary dictionary = m_dictionary.add(text);
+    if (dictionary.epoch() != m_dictionary.epoch()) {
+        return recode(dictionary).insert(text);
+    }
+    uint64_t code = 0;
+    dictionary.encode(text, code);
+    if (m_codes.is_none()) {
+        return EncodedStringSet(dictionary, Some(Tree<uint64_t>(code)));
+    } else if (m_codes->contains(code)) {
+        return EncodedStringSet(dictionary, m_codes);
+    }
+    return EncodedStringSet(dictionary, Some(m_codes->insert(code)));
+}
+
+
+inline EncodedStringSet EncodedStringSet::remove(const std::string& text) const
+{
+    uint64_t code;
+    if (m_codes.is_none() || !m_dictionary.encode(text, code)) {
+        return *this;
+    }
+    return EncodedStringSet(m_dictionary, m_codes->remove(code));
+}
+
+
+inline EncodedStringSet
+EncodedStringSet::recode(const StringDictionary& dictionary) const
+{
+    typedef StringDictionary::Word Word;
+    std::vector<uint64_t> codes;
+    codes.reserve(size());
+    if (m_codes.is_some()) {
+        // codes and texts are in the same order in both dictionaries, so
+        // each cursor only moves forwards
+        std::vector<const Word*> from;
+        std::vector<const Word*> to;
+        from.reserve(m_dictionary.size());
+        to.reserve(dictionary.size());
+        m_dictionary.words()->for_each([&from](const Word& w) {
+            from.push_back(&w);
+        });
+        if (dictionary.words().is_some()) {
+            dictionary.words()->for_each([&to](const Word& w) {
+                to.push_back(&w);
+            });
+        }
+        size_t f = 0;
+        size_t t = 0;
+        m_codes->for_each([&codes, &from, &to, &f, &t](uint64_t code) {
+            while (f < from.size() && from[f]->code < code) {
+                ++f;
+            }
+            if (f == from.size() || from[f]->code != code) {
+                throw std::out_of_range("no string has that code");
+            }
+            const std::string& text = from[f]->text;
+            while (t < to.size() && text > to[t]->text) {
+                ++t;
+            }
+            if (t == to.size() || to[t]->text != text) {
+                throw std::invalid_argument("string missing from dictionary");
+            }
+            codes.push_back(to[t]->code);
+        });
+    }
+    // both dictionaries preserve order, so the new codes are sorted too
+    return EncodedStringSet(dictionary,
+                            Tree<uint64_t>::from_sorted(codes.begin(),
+                                                        codes.size()));
+}
+
+
+inline std::list<std::string> EncodedStringSet::toList() const
+{
+    std::list<std::string> l;
+    if (m_codes.is_some()) {
+        const StringDictionary& dictionary = m_dictionary;
+        m_codes->for_each([&l, &dictionary](uint64_t code) {
+            l.push_back(dictionary.decode(code));
+        });
+    }
+    return l;
+}
@@ -24,12 +24,47 @@
  */
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Trees
+// compile the trace points in; they stay off until a test enables them
+#define TREE_TRACE
+// count nodes built and visited, to check what operations cost
+#define TREE_COUNT_NODES
+#include<algorithm>
+#include<cmath>
 #include<iostream>
+#include<map>
+#include<set>
+#include<sstream>
+#include<stdlib.h>      // mkstemp
+#include<unistd.h>      // close
 #include<boost/test/unit_test.hpp>
 
 // link with -lboost_unit_test_framework
 #include "option.h"
 #include "tree.h"
+#include "node_pool.h"
+#include "windowed_quantiles.h"
+#include "atomic_root.h"
+#include "roaring_set.h"
+#include "range_set.h"
+#include "range_map.h"
+#include "art.h"
+#include "elias_fano.h"
+#include "learned_index.h"
+#include "access_counter.h"
+#include "paged_tree.h"
+#include "small_set.h"
+#include "multi_version.h"
+#include "incremental_fold.h"
+#include "tree_diff.h"
+#include "derived_set.h"
+#include "hash_ring.h"
+#include "columnar.h"
+#include "append_tree.h"
+#include "string_dictionary.h"
+#include "kd_tree.h"
+#include "gc_tree.h"
+#include "tree_tasks.h"
+#include "trace.h"
 
 BOOST_AUTO_TEST_CASE(test_option_some)
 {
@@ -272,3 +307,1794 @@ BOOST_AUTO_TEST_CASE(test_rebalance)
                         << " should be equal to 3");
     BOOST_CHECK(tree->is_balanced());
 }
+
+
+/**
+ * @brief a new, unique file in the temporary directory, removed again
+ * when this goes out of scope, however the test ends
+ */
+class TempPath
+{
+public:
+    explicit TempPath(const std::string& name) {
+        const char* dir = getenv("TMPDIR");
+        std::string pattern = std::string(dir != NULL ? dir : "/tmp") +
+                              "/" + name + ".XXXXXX";
+        std::vector<char> buffer(pattern.begin(), pattern.end());
+        buffer.push_back('\0');
+        int fd = mkstemp(&buffer[0]);
+        BOOST_REQUIRE( fd >= 0 );
+        close(fd);
+        m_path = &buffer[0];
+    }
+
+    ~TempPath() { std::remove(m_path.c_str()); }
+
+    const char* c_str() const { return m_path.c_str(); }
+
+private:
+    TempPath(const TempPath&);
+    TempPath& operator=(const TempPath&);
+
+    std::string m_path;
+};
+
+
+/**
+ * @brief true if every node in tree is AVL balanced and has a correct size
+ */
+template<typename T>
+bool check_avl(const Option<Tree<T>> tree)
+{
+    if (tree.is_none()) {
+        return true;
+    }
+    return tree->is_balanced() &&
+           tree->size() == tree_size(tree->left()) + 1
+                           + tree_size(tree->right()) &&
+           check_avl(tree->left()) &&
+           check_avl(tree->right());
+}
+
+BOOST_AUTO_TEST_CASE(test_rebalance_every_node)
+{
+    // every node stays balanced through inserts and removals,
+    // including the double-rotation cases
+    const int inserts[] = { 50, 20, 80, 10, 30, 25, 27, 26, 90, 85, 87, 86 };
+    const size_t len = sizeof(inserts)/sizeof(inserts[0]);
+    Option<Tree<int>> tree(Some(Tree<int>(40)));
+    for (size_t i=0; i<len; ++i) {
+        tree = tree->insert(inserts[i]);
+        BOOST_CHECK( check_avl(tree) );
+    }
+    Option<Tree<int>> before(tree);
+    for (size_t i=0; i<len; ++i) {
+        tree = tree->remove(inserts[i]);
+        BOOST_CHECK( check_avl(tree) );
+        BOOST_CHECK( !tree->contains(inserts[i]) );
+        BOOST_CHECK( tree->size() == len - i );
+    }
+    // the old version is untouched
+    BOOST_CHECK( before->size() == len + 1 );
+    for (size_t i=0; i<len; ++i) {
+        BOOST_CHECK( before->contains(inserts[i]) );
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_node_pool)
+{
+    // updates draw from the pool and fail cleanly when it runs out
+    NodePool<int> pool(16);
+    Option<Tree<int>> tree = None<Tree<int>>();
+    int inserted = 0;
+    for (int i=0; i<100; ++i) {
+        Option<Tree<int>> next = None<Tree<int>>();
+        if (!pool.try_insert(tree, i, next)) {
+            break;
+        }
+        tree = next;
+        ++inserted;
+    }
+    BOOST_CHECK( inserted > 0 && inserted < 100 );
+    BOOST_CHECK( tree->size() == static_cast<size_t>(inserted) );
+    BOOST_CHECK( check_avl(tree) );
+    // a failed update leaves both the tree and the pool alone
+    size_t available = pool.available();
+    Option<Tree<int>> untouched = tree;
+    BOOST_CHECK( !pool.try_insert(tree, 1000, untouched) );
+    BOOST_CHECK( untouched.operator->() == tree.operator->() );
+    BOOST_CHECK( pool.available() == available );
+    // removing a missing value needs no nodes at all
+    Option<Tree<int>> same = None<Tree<int>>();
+    BOOST_CHECK( pool.try_remove(tree, 1000, same) );
+    BOOST_CHECK( same.operator->() == tree.operator->() );
+    // dropping versions gives their nodes back
+    tree = None<Tree<int>>();
+    same = None<Tree<int>>();
+    untouched = None<Tree<int>>();
+    BOOST_CHECK( pool.available() == pool.capacity() );
+    for (int i=0; i<4; ++i) {
+        BOOST_REQUIRE( pool.try_insert(tree, i, tree) );
+    }
+    BOOST_REQUIRE( pool.try_remove(tree, 2, tree) );
+    BOOST_CHECK( tree->size() == 3 && !tree->contains(2) );
+
+    // an impossible capacity is refused before anything is allocated
+    BOOST_CHECK_THROW( NodePool<int> huge(static_cast<size_t>(-1)),
+                       std::length_error );
+    BOOST_CHECK_THROW( NodePool<int> wide(0xffffffffull),
+                       std::length_error );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tree_order_statistics)
+{
+    // nth and rank agree with the sorted order, duplicates included
+    const int inserts[] = { 5, 3, 9, 3, 7, 1, 9, 9 };
+    const size_t len = sizeof(inserts)/sizeof(inserts[0]);
+    Option<Tree<int>> tree(Some(Tree<int>(4)));
+    std::list<int> sorted(1, 4);
+    for (size_t i=0; i<len; ++i) {
+        tree = tree->insert(inserts[i]);
+        sorted.push_back(inserts[i]);
+    }
+    sorted.sort();
+    size_t index = 0;
+    for (std::list<int>::iterator it=sorted.begin();
+         it != sorted.end();
+         ++it, ++index) {
+        BOOST_CHECK_EQUAL( tree->nth(index), *it );
+    }
+    BOOST_CHECK_THROW( tree->nth(len + 1), std::out_of_range );
+    BOOST_CHECK_EQUAL( tree->rank(0), 0u );
+    BOOST_CHECK_EQUAL( tree->rank(3), 1u );
+    BOOST_CHECK_EQUAL( tree->rank(4), 3u );
+    BOOST_CHECK_EQUAL( tree->rank(9), 6u );
+    BOOST_CHECK_EQUAL( tree->rank(10), 9u );
+}
+
+BOOST_AUTO_TEST_CASE(test_windowed_quantiles)
+{
+    WindowedQuantiles<int> window(10);
+    BOOST_CHECK( window.snapshot().is_none() );
+    for (int i=1; i<=10; ++i) {
+        window.push(i);
+    }
+    BOOST_CHECK_EQUAL( window.quantile(0.5), 5 );
+    BOOST_CHECK_EQUAL( window.quantile(0.99), 10 );
+    BOOST_CHECK_EQUAL( window.quantile(0.0), 1 );
+    Option<Tree<int>> before = window.snapshot();
+    // push 11..15: 1..5 expire
+    for (int i=11; i<=15; ++i) {
+        window.push(i);
+    }
+    BOOST_CHECK_EQUAL( window.size(), 10u );
+    BOOST_CHECK_EQUAL( window.quantile(0.0), 6 );
+    BOOST_CHECK_EQUAL( window.quantile(0.5), 10 );
+    BOOST_CHECK_EQUAL( window.quantile(1.0), 15 );
+    BOOST_CHECK( !window.snapshot()->contains(5) );
+    // the snapshot taken earlier still sees the old window
+    BOOST_CHECK_EQUAL( tree_quantile(before.get_bare(), 0.5), 5 );
+    BOOST_CHECK_EQUAL( tree_quantile(before.get_bare(), std::nan("")),
+                       before->min() );
+    BOOST_CHECK( before->contains(1) );
+}
+
+BOOST_AUTO_TEST_CASE(test_atomic_root)
+{
+    AtomicRoot<int> root;
+    BOOST_CHECK( root.load().is_none() );
+    // readers only ever see whole versions, each a prefix 0..n-1
+    std::atomic<bool> done(false);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> readers;
+    for (int r=0; r<3; ++r) {
+        readers.push_back(std::thread([&root, &done, &failures]() {
+            size_t last = 0;
+            while (!done.load()) {
+                Option<Tree<int>> version = root.load();
+                size_t size = tree_size(version);
+                if (size < last || (size > 0 &&
+                        (version->min() != 0 ||
+                         version->max() != static_cast<int>(size) - 1))) {
+                    ++failures;
+                }
+                last = size;
+            }
+        }));
+    }
+    Option<Tree<int>> tree = None<Tree<int>>();
+    for (int i=0; i<5000; ++i) {
+        tree = tree.is_some() ? Some(tree->insert(i)) : Some(Tree<int>(i));
+        root.store(tree);
+    }
+    done = true;
+    for (size_t r=0; r < readers.size(); ++r) {
+        readers[r].join();
+    }
+    BOOST_CHECK_EQUAL( failures.load(), 0 );
+    BOOST_CHECK_EQUAL( tree_size(root.load()), 5000u );
+    root.store(None<Tree<int>>());
+    BOOST_CHECK( root.load().is_none() );
+}
+
+BOOST_AUTO_TEST_CASE(test_changed_since)
+{
+    Option<Tree<int>> tree(Some(Tree<int>(0)));
+    for (int i=1; i<64; ++i) {
+        tree = tree->insert(i * 10);
+    }
+    uint64_t checkpoint = Tree<int>::current_generation();
+    BOOST_CHECK( changed_since(tree, checkpoint).empty() );
+    BOOST_CHECK( tree->max_generation() <= checkpoint );
+    // one new value: it and the path copied above it are new
+    Option<Tree<int>> next(tree->insert(333));
+    std::list<int> changed(changed_since(next, checkpoint));
+    BOOST_CHECK( std::find(changed.begin(), changed.end(), 333)
+                 != changed.end() );
+    BOOST_CHECK( changed.size() <= next->height() + 1 );
+    BOOST_CHECK( next->max_generation() > checkpoint );
+    // after a removal, the new nodes are on the path to the removed value
+    uint64_t second = Tree<int>::current_generation();
+    next = next->remove(100);
+    changed = changed_since(next, second);
+    BOOST_CHECK( !changed.empty() );
+    BOOST_CHECK( changed.size() <= 2 * next->height() );
+    BOOST_CHECK( changed_since(next, checkpoint).size() >= changed.size() );
+    // the old version is unaffected
+    BOOST_CHECK( changed_since(tree, checkpoint).empty() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_roaring_set)
+{
+    // a dense block, a sparse scatter and a long run, in three chunks
+    RoaringSet set;
+    std::set<uint32_t> expected;
+    for (uint32_t i=0; i<20000; i+=2) {
+        set = set.insert(i);
+        expected.insert(i);
+    }
+    for (uint32_t i=0; i<20; ++i) {
+        set = set.insert(0x10000 + i * 997);
+        expected.insert(0x10000 + i * 997);
+    }
+    for (uint32_t i=0; i<30000; ++i) {
+        set = set.insert(0x20000 + i);
+        expected.insert(0x20000 + i);
+    }
+    BOOST_CHECK_EQUAL( set.size(), expected.size() );
+    BOOST_CHECK_EQUAL( set.chunks(), 3u );
+    // bitmap (8 KiB) + array (40 bytes) + one run (4 bytes)
+    BOOST_CHECK_EQUAL( set.bytes(), 8192u + 40u + 4u );
+    BOOST_CHECK( set.contains(19998) && !set.contains(19999) );
+    BOOST_CHECK( set.contains(0x20000 + 29999) && !set.contains(0x20000 + 30000) );
+    std::list<uint32_t> values(set.toList());
+    BOOST_CHECK( std::equal(values.begin(), values.end(), expected.begin()) );
+
+    // removing from inside the run splits it; the old version keeps it
+    RoaringSet split = set.remove(0x20000 + 500);
+    BOOST_CHECK( !split.contains(0x20000 + 500) );
+    BOOST_CHECK( set.contains(0x20000 + 500) );
+    BOOST_CHECK_EQUAL( split.bytes(), set.bytes() + 4u );
+
+    // set operations against a plain std::set computation
+    RoaringSet other;
+    std::set<uint32_t> theirs;
+    for (uint32_t i=0; i<0x28000; i+=7) {
+        other = other.insert(i);
+        theirs.insert(i);
+    }
+    std::list<uint32_t> both(split.intersect(other).toList());
+    std::list<uint32_t> either(split.unite(other).toList());
+    std::set<uint32_t> ours(expected);
+    ours.erase(0x20000 + 500);
+    std::vector<uint32_t> want_both;
+    std::vector<uint32_t> want_either;
+    std::set_intersection(ours.begin(), ours.end(), theirs.begin(),
+                          theirs.end(), std::back_inserter(want_both));
+    std::set_union(ours.begin(), ours.end(), theirs.begin(),
+                   theirs.end(), std::back_inserter(want_either));
+    BOOST_CHECK( both.size() == want_both.size() &&
+                 std::equal(both.begin(), both.end(), want_both.begin()) );
+    BOOST_CHECK( either.size() == want_either.size() &&
+                 std::equal(either.begin(), either.end(), want_either.begin()) );
+    BOOST_CHECK_EQUAL( split.unite(other).size(), want_either.size() );
+    BOOST_CHECK_EQUAL( split.intersect(other).size(), want_both.size() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_roaring_updates_in_place)
+{
+    // chunk 0 is a few long runs, chunk 1 a dense bitmap; single updates
+    // to either keep the layout a fresh build of the result would pick
+    RoaringSet set;
+    std::set<uint32_t> expected;
+    for (uint32_t v=0; v<65536; ++v) {
+        if ((v / 1000) % 2 == 0) {
+            expected.insert(v);
+        }
+        if (v % 3 != 0) {
+            expected.insert(0x10000 + v);
+        }
+    }
+    for (std::set<uint32_t>::iterator it=expected.begin();
+         it != expected.end(); ++it) {
+        set = set.insert(*it);
+    }
+    // 33 runs and one bitmap
+    BOOST_CHECK_EQUAL( set.bytes(), 33 * 4 + 8192u );
+    unsigned int state = 5;
+    for (int i=0; i<4000; ++i) {
+        state = state * 1103515245u + 12345u;
+        uint32_t val = (state >> 8) % 0x20000;
+        if (i % 2 == 0) {
+            set = set.insert(val);
+            expected.insert(val);
+        } else {
+            set = set.remove(val);
+            expected.erase(val);
+        }
+        if (i % 500 == 0) {
+            BOOST_REQUIRE_EQUAL( set.size(), expected.size() );
+            BOOST_REQUIRE_EQUAL( set.bytes(), set.intersect(set).bytes() );
+        }
+    }
+    // runs grow, merge and split
+    for (uint32_t v=0; v<3000; ++v) {
+        set = set.insert(v);
+        expected.insert(v);
+    }
+    set = set.remove(1500).remove(0).remove(2999);
+    expected.erase(1500);
+    expected.erase(0);
+    expected.erase(2999);
+    std::list<uint32_t> values(set.toList());
+    BOOST_CHECK_EQUAL( set.size(), expected.size() );
+    BOOST_CHECK( values.size() == expected.size() &&
+                 std::equal(values.begin(), values.end(), expected.begin()) );
+    BOOST_CHECK_EQUAL( set.bytes(), set.intersect(set).bytes() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tree_floor_ceiling)
+{
+    Option<Tree<int>> tree(Some(Tree<int>(10)));
+    for (int i=20; i<=100; i+=10) {
+        tree = tree->insert(i);
+    }
+    BOOST_CHECK( tree->floor(5) == NULL );
+    BOOST_CHECK_EQUAL( *tree->floor(10), 10 );
+    BOOST_CHECK_EQUAL( *tree->floor(55), 50 );
+    BOOST_CHECK_EQUAL( *tree->floor(1000), 100 );
+    BOOST_CHECK_EQUAL( *tree->ceiling(5), 10 );
+    BOOST_CHECK_EQUAL( *tree->ceiling(55), 60 );
+    BOOST_CHECK_EQUAL( *tree->ceiling(60), 60 );
+    BOOST_CHECK( tree->ceiling(101) == NULL );
+}
+
+BOOST_AUTO_TEST_CASE(test_range_set)
+{
+    // a billion values in a thousand runs is a thousand nodes
+    RangeSet<uint64_t> big;
+    for (uint64_t i=0; i<1000; ++i) {
+        big = big.insert(i * 2000000, i * 2000000 + 999999);
+    }
+    BOOST_CHECK_EQUAL( big.size(), 1000000000u );
+    BOOST_CHECK_EQUAL( big.runs(), 1000u );
+    BOOST_CHECK( big.contains(2000000 + 999999) );
+    BOOST_CHECK( !big.contains(2000000 + 1000000) );
+
+    RangeSet<int> set;
+    set = set.insert(1).insert(2).insert(3);
+    BOOST_CHECK_EQUAL( set.runs(), 1u );
+    set = set.insert(5).insert(6);
+    BOOST_CHECK_EQUAL( set.runs(), 2u );
+    BOOST_CHECK_EQUAL( set.size(), 5u );
+    // 4 bridges [1, 3] and [5, 6]
+    RangeSet<int> bridged = set.insert(4);
+    BOOST_CHECK_EQUAL( bridged.runs(), 1u );
+    BOOST_CHECK_EQUAL( bridged.size(), 6u );
+    BOOST_CHECK_EQUAL( bridged.toList().front().lo, 1 );
+    BOOST_CHECK_EQUAL( bridged.toList().front().hi, 6 );
+    // removing from the middle splits the run again
+    RangeSet<int> split = bridged.remove(3);
+    BOOST_CHECK_EQUAL( split.runs(), 2u );
+    BOOST_CHECK_EQUAL( split.size(), 5u );
+    BOOST_CHECK( !split.contains(3) && split.contains(2) && split.contains(4) );
+    // a range swallowing several runs merges them all
+    RangeSet<int> merged = split.insert(20, 25).insert(0, 21);
+    BOOST_CHECK_EQUAL( merged.runs(), 1u );
+    BOOST_CHECK_EQUAL( merged.size(), 26u );
+    // older versions are untouched
+    BOOST_CHECK_EQUAL( set.runs(), 2u );
+    BOOST_CHECK( bridged.contains(3) );
+    BOOST_CHECK( merged.remove(0).remove(25).size() == 24u );
+    BOOST_CHECK( RangeSet<int>().insert(7).remove(7).size() == 0u );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_range_map)
+{
+    // random puts, removes and range adds against a std::map
+    RangeMap<int, long> map;
+    std::map<int, long> expected;
+    unsigned int state = 7;
+    std::list<std::pair<RangeMap<int, long>, std::map<int, long> > > versions;
+    for (int step=0; step<2000; ++step) {
+        state = state * 1103515245u + 12345u;
+        int op = (state >> 16) % 4;
+        int a = (state >> 4) % 200;
+        int b = a + (state >> 20) % 50;
+        if (op == 0 || op == 1) {
+            map = map.put(a, step);
+            expected[a] = step;
+        } else if (op == 2) {
+            map = map.remove(a);
+            expected.erase(a);
+        } else {
+            map = map.add(a, b, 3);
+            for (std::map<int, long>::iterator it=expected.lower_bound(a);
+                 it != expected.end() && it->first <= b;
+                 ++it) {
+                it->second += 3;
+            }
+        }
+        if (step % 250 == 0) {
+            versions.push_back(std::make_pair(map, expected));
+        }
+        long want = 0;
+        for (std::map<int, long>::iterator it=expected.lower_bound(a);
+             it != expected.end() && it->first <= b;
+             ++it) {
+            want += it->second;
+        }
+        BOOST_REQUIRE_EQUAL( map.sum(a, b), want );
+    }
+    BOOST_CHECK_EQUAL( map.size(), expected.size() );
+    for (std::map<int, long>::iterator it=expected.begin();
+         it != expected.end();
+         ++it) {
+        BOOST_CHECK_EQUAL( map.get(it->first), it->second );
+    }
+    // every saved version still has the values it had
+    for (std::list<std::pair<RangeMap<int, long>,
+                             std::map<int, long> > >::iterator
+             v=versions.begin();
+         v != versions.end();
+         ++v) {
+        std::list<std::pair<int, long> > want(v->second.begin(),
+                                              v->second.end());
+        BOOST_CHECK( v->first.toList() == want );
+    }
+    RangeMap<int, long> empty;
+    BOOST_CHECK_THROW( empty.get(1), std::out_of_range );
+}
+
+BOOST_AUTO_TEST_CASE(test_tree_replace)
+{
+    Option<Tree<int>> tree(Some(Tree<int>(0)));
+    std::multiset<int> expected;
+    expected.insert(0);
+    for (int i=1; i<100; ++i) {
+        tree = tree->insert(i * 10);
+        expected.insert(i * 10);
+    }
+    // staying in place only copies the path to the node
+    uint64_t checkpoint = Tree<int>::current_generation();
+    Option<Tree<int>> moved(tree->replace(500, 505));
+    BOOST_CHECK( moved->contains(505) && !moved->contains(500) );
+    BOOST_CHECK( changed_since(moved, checkpoint).size()
+                 <= tree->height() );
+    BOOST_CHECK( tree->contains(500) );
+    // moving across the tree, in both directions, and to a missing key
+    unsigned int state = 3;
+    for (int step=0; step<500; ++step) {
+        state = state * 1103515245u + 12345u;
+        int from = ((state >> 8) % 100) * 10;
+        int to = (state >> 20) % 1200;
+        tree = tree->replace(from, to);
+        std::multiset<int>::iterator it = expected.find(from);
+        if (it != expected.end()) {
+            expected.erase(it);
+        }
+        expected.insert(to);
+        BOOST_REQUIRE( check_avl(tree) );
+    }
+    std::list<int> values(tree->toList());
+    BOOST_CHECK( values.size() == expected.size() &&
+                 std::equal(values.begin(), values.end(), expected.begin()) );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_art_set)
+{
+    // random keys, some prefixes of others, with enough fan-out to
+    // grow and shrink every node size; checked against std::set
+    ArtSet art;
+    std::set<std::string> expected;
+    unsigned int state = 11;
+    std::list<std::pair<ArtSet, std::set<std::string> > > versions;
+    for (int step=0; step<6000; ++step) {
+        state = state * 1103515245u + 12345u;
+        std::string key;
+        size_t length = (state >> 8) % 4;
+        key.push_back(static_cast<char>((state >> 12) % 200));
+        for (size_t i=0; i<length; ++i) {
+            state = state * 1103515245u + 12345u;
+            key.push_back(static_cast<char>('a' + (state >> 16) % 20));
+        }
+        if (step % 3 == 2) {
+            art = art.remove(key);
+            expected.erase(key);
+        } else {
+            art = art.insert(key);
+            expected.insert(key);
+        }
+        BOOST_REQUIRE_EQUAL( art.size(), expected.size() );
+        BOOST_REQUIRE( art.contains(key) == (expected.count(key) == 1) );
+        if (step % 1000 == 0) {
+            versions.push_back(std::make_pair(art, expected));
+        }
+    }
+    std::list<std::string> keys(art.toList());
+    BOOST_CHECK( keys.size() == expected.size() &&
+                 std::equal(keys.begin(), keys.end(), expected.begin()) );
+    for (std::list<std::pair<ArtSet, std::set<std::string> > >::iterator
+             v=versions.begin();
+         v != versions.end();
+         ++v) {
+        std::list<std::string> then(v->first.toList());
+        BOOST_CHECK( then.size() == v->second.size() &&
+                     std::equal(then.begin(), then.end(), v->second.begin()) );
+    }
+    // long shared prefixes are compressed, and still split correctly
+    ArtSet paths;
+    paths = paths.insert("/usr/local/lib/libfoo.so")
+                 .insert("/usr/local/lib/libbar.so")
+                 .insert("/usr/local")
+                 .insert("/usr/local/lib/libfoo.so.1");
+    BOOST_CHECK( paths.contains("/usr/local") );
+    BOOST_CHECK( !paths.contains("/usr/local/lib") );
+    BOOST_CHECK( !paths.contains("/usr/loc") );
+    paths = paths.remove("/usr/local/lib/libfoo.so");
+    BOOST_CHECK( paths.contains("/usr/local/lib/libfoo.so.1") );
+    BOOST_CHECK( !paths.contains("/usr/local/lib/libfoo.so") );
+    BOOST_CHECK_EQUAL( paths.size(), 3u );
+    BOOST_CHECK_EQUAL( paths.toList().front(), "/usr/local" );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_elias_fano)
+{
+    // values spread over 2^40 plus a dense run and both extremes, so
+    // some buckets are empty and some hold many values
+    std::set<uint64_t> expected;
+    uint64_t state = 5;
+    for (int i=0; i<5000; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        expected.insert(state >> 24);
+    }
+    for (uint64_t v=1000; v<1600; ++v) {
+        expected.insert(v);
+    }
+    expected.insert(0);
+    expected.insert(~uint64_t(0));
+    Option<Tree<uint64_t>> tree = Tree<uint64_t>::from_sorted(expected.begin(),
+                                                              expected.size());
+    BOOST_REQUIRE( tree.is_some() );
+    BOOST_CHECK( check_avl(tree) );
+    EliasFano ef(tree);
+    BOOST_REQUIRE_EQUAL( ef.size(), expected.size() );
+    BOOST_CHECK( std::equal(ef.begin(), ef.end(), expected.begin()) );
+    size_t index = 0;
+    for (std::set<uint64_t>::iterator it=expected.begin();
+         it != expected.end();
+         ++it, ++index) {
+        BOOST_REQUIRE_EQUAL( ef.nth(index), *it );
+        BOOST_REQUIRE( ef.contains(*it) );
+        BOOST_REQUIRE_EQUAL( ef.rank(*it), index );
+        if (*it == ~uint64_t(0)) {
+            continue;
+        }
+        BOOST_REQUIRE( !ef.contains(*it + 1) || expected.count(*it + 1) );
+        EliasFano::const_iterator found = ef.lower_bound(*it + 1);
+        std::set<uint64_t>::iterator next = expected.upper_bound(*it);
+        BOOST_REQUIRE( next == expected.end() ? found == ef.end()
+                                              : *found == *next );
+    }
+    BOOST_CHECK_THROW( ef.nth(expected.size()), std::out_of_range );
+    // a small fraction of the node representation
+    BOOST_CHECK_LT( ef.bytes(), expected.size() * 8 );
+    BOOST_CHECK( ef.to_tree().get_bare() == tree.get_bare() );
+    BOOST_CHECK( check_avl(ef.to_tree()) );
+
+    EliasFano empty(None<Tree<uint64_t>>());
+    BOOST_CHECK_EQUAL( empty.size(), 0u );
+    BOOST_CHECK( !empty.contains(0) );
+    BOOST_CHECK( empty.begin() == empty.end() );
+    BOOST_CHECK( empty.to_tree().is_none() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_learned_index)
+{
+    // clustered keys with gaps, duplicates and negatives, so the model
+    // needs several segments and must fall back for unseen keys
+    Option<Tree<int64_t>> tree = None<Tree<int64_t>>();
+    std::multiset<int64_t> expected;
+    unsigned int state = 17;
+    for (int i=0; i<4000; ++i) {
+        state = state * 1103515245u + 12345u;
+        int64_t cluster = static_cast<int64_t>(state % 7) * 1000000000000ll
+                          - 3000000000000ll;
+        state = state * 1103515245u + 12345u;
+        int64_t key = cluster + (state >> 8) % (1000 + 100000 * (cluster > 0));
+        tree = tree.is_some() ? Some(tree->insert(key))
+                              : Some(Tree<int64_t>(key));
+        expected.insert(key);
+    }
+    LearnedIndex<int64_t> index(tree, 8);
+    BOOST_REQUIRE_EQUAL( index.size(), expected.size() );
+    BOOST_CHECK( index.segments() > 1 );
+    BOOST_CHECK( index.segments() < expected.size() / 4 );
+    for (std::multiset<int64_t>::iterator it=expected.begin();
+         it != expected.end();
+         ++it) {
+        for (int64_t delta=-1; delta<=1; ++delta) {
+            int64_t key = *it + delta;
+            size_t rank = std::distance(expected.begin(),
+                                        expected.lower_bound(key));
+            BOOST_REQUIRE_EQUAL( index.rank(key), rank );
+            BOOST_REQUIRE_EQUAL( index.contains(key), expected.count(key) > 0 );
+        }
+    }
+    BOOST_CHECK( index.lower_bound(*expected.rbegin() + 1) == NULL );
+    BOOST_CHECK_EQUAL( *index.lower_bound(-4000000000000ll),
+                       *expected.begin() );
+    BOOST_CHECK_EQUAL( index.nth(0), *expected.begin() );
+    BOOST_CHECK_THROW( index.nth(expected.size()), std::out_of_range );
+
+    // the index keeps its version alive
+    tree = None<Tree<int64_t>>();
+    BOOST_CHECK_EQUAL( index.tree()->size(), expected.size() );
+
+    LearnedIndex<int64_t> empty(None<Tree<int64_t>>());
+    BOOST_CHECK_EQUAL( empty.rank(5), 0u );
+    BOOST_CHECK( !empty.contains(5) );
+}
+
+
+/**
+ * @brief number of nodes visited to find val
+ */
+size_t lookup_depth(const Tree<int>& tree, int val)
+{
+    if (tree.deref() == val) {
+        return 1;
+    }
+    return 1 + lookup_depth(tree.deref() > val ? tree.left().get_bare()
+                                               : tree.right().get_bare(),
+                            val);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_reshape_by_weights)
+{
+    // Zipfian weights over shuffled keys: the hot keys are scattered
+    // through the order, so a balanced tree puts most of them deep
+    std::vector<int> keys;
+    for (int i=0; i<1000; ++i) {
+        keys.push_back(i);
+    }
+    Option<Tree<int>> balanced = Tree<int>::from_sorted(keys.begin(),
+                                                        keys.size());
+    std::vector<double> weights(keys.size());
+    for (size_t i=0; i < keys.size(); ++i) {
+        weights[(i * 389) % keys.size()] = 1.0 / (i + 1);
+    }
+    Tree<int> reshaped = balanced->reshape_by_weights(weights);
+    BOOST_CHECK( reshaped == balanced.get_bare() );
+    double before = 0;
+    double after = 0;
+    for (size_t i=0; i < keys.size(); ++i) {
+        before += weights[i] * lookup_depth(balanced.get_bare(), keys[i]);
+        after += weights[i] * lookup_depth(reshaped, keys[i]);
+    }
+    BOOST_CHECK_LT( after, before * 0.75 );
+    // the heaviest key is also the least, so AVL keeps it some way down
+    BOOST_CHECK_LT( lookup_depth(reshaped, 0),
+                    lookup_depth(balanced.get_bare(), 0) );
+    BOOST_CHECK( check_avl(Some(reshaped)) );
+
+    // every size and skew still gives a valid AVL tree
+    for (size_t n=1; n<200; n += 7) {
+        Option<Tree<int>> small = Tree<int>::from_sorted(keys.begin(), n);
+        std::vector<double> skewed(n, 0.0);
+        skewed[n / 3] = 100.0;
+        skewed[n - 1] = 1.0;
+        BOOST_REQUIRE( check_avl(Some(small->reshape_by_weights(skewed))) );
+        BOOST_REQUIRE( check_avl(Some(small->reshape_by_weights(
+            std::vector<double>(n, 1.0)))) );
+    }
+
+    // still a working tree
+    std::multiset<int> expected(keys.begin(), keys.end());
+    Option<Tree<int>> updated = Some(reshaped);
+    for (int i=0; i<600; ++i) {
+        int key = (i * 7919) % 1200;
+        if (i % 2) {
+            updated = Some(updated->insert(key));
+            expected.insert(key);
+        } else if (expected.count(key)) {
+            updated = updated->remove(key);
+            expected.erase(expected.find(key));
+        }
+    }
+    BOOST_CHECK( check_avl(updated) );
+    std::list<int> values(updated->toList());
+    BOOST_CHECK( values.size() == expected.size() &&
+                 std::equal(values.begin(), values.end(), expected.begin()) );
+    BOOST_CHECK_THROW( reshaped.reshape_by_weights(std::vector<double>(3)),
+                       std::invalid_argument );
+
+    // sampled counts bring the hottest key up near the head
+    AccessCounter<int> counter(balanced.get_bare(), 2);
+    for (int i=0; i<400; ++i) {
+        counter.contains(777);
+        counter.contains(i);
+        counter.contains(-1);
+    }
+    BOOST_CHECK_GT( counter.weights()[777], 100.0 );
+    Tree<int> hot = counter.reshape();
+    BOOST_CHECK_LE( lookup_depth(hot, 777), 2u );
+    BOOST_CHECK( check_avl(Some(hot)) );
+    BOOST_CHECK( hot == balanced.get_bare() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_paged_tree)
+{
+    Option<Tree<int>> tree = None<Tree<int>>();
+    for (int i=0; i<5000; ++i) {
+        int key = (i * 7919) % 10000;
+        tree = tree.is_some() ? Some(tree->insert(key)) : Some(Tree<int>(key));
+    }
+    TempPath file("test_paged_tree");
+    const char* path = file.c_str();
+    PagedTree<int>::write(tree, path);
+    PagedTree<int> paged = PagedTree<int>::open(path, 64);
+    BOOST_CHECK_EQUAL( paged.size(), tree->size() );
+    BOOST_CHECK_EQUAL( paged.loaded(), 0u );
+
+    // a lookup loads only its path
+    BOOST_CHECK( paged.contains(7919) );
+    BOOST_CHECK_LE( paged.loaded(), paged.height() );
+    for (int i=-5; i<10005; ++i) {
+        BOOST_REQUIRE_EQUAL( paged.contains(i), tree->contains(i) );
+        BOOST_REQUIRE_LE( paged.loaded(), 64u );
+    }
+
+    // updates copy the touched path and leave the file version intact
+    std::multiset<int> expected;
+    tree->for_each([&expected](int key) { expected.insert(key); });
+    PagedTree<int> updated = paged;
+    for (int i=0; i<300; ++i) {
+        int key = (i * 104729) % 20000;
+        updated = updated.insert(key);
+        expected.insert(key);
+    }
+    BOOST_CHECK_LE( paged.loaded(), 64u );
+    std::list<int> values(updated.toList());
+    BOOST_CHECK( values.size() == expected.size() &&
+                 std::equal(values.begin(), values.end(), expected.begin()) );
+    BOOST_CHECK( paged.toList() == tree->toList() );
+    BOOST_CHECK_LE( paged.loaded(), 64u );
+    std::remove(path);
+
+    PagedTree<int>::write(None<Tree<int>>(), path);
+    PagedTree<int> empty = PagedTree<int>::open(path, 4);
+    BOOST_CHECK_EQUAL( empty.size(), 0u );
+    BOOST_CHECK( !empty.contains(1) );
+    BOOST_CHECK_EQUAL( empty.insert(1).toList().size(), 1u );
+    std::remove(path);
+    BOOST_CHECK_THROW( PagedTree<int>::open(path, 4), std::runtime_error );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_small_set)
+{
+    // a set that grows past K, shrinks back, and grows again
+    typedef SmallSet<std::string, 4> Tags;
+    Tags tags;
+    std::set<std::string> expected;
+    std::list<std::pair<Tags, std::set<std::string> > > versions;
+    unsigned int state = 23;
+    for (int step=0; step<400; ++step) {
+        state = state * 1103515245u + 12345u;
+        std::string tag(1, static_cast<char>('a' + (state >> 16) % 10));
+        bool growing = (step / 50) % 2 == 0;
+        if (growing == ((state >> 8) % 4 != 0)) {
+            tags = tags.insert(tag);
+            expected.insert(tag);
+        } else {
+            tags = tags.remove(tag);
+            expected.erase(tag);
+        }
+        BOOST_REQUIRE_EQUAL( tags.size(), expected.size() );
+        BOOST_REQUIRE( tags.contains(tag) == (expected.count(tag) == 1) );
+        if (expected.size() <= 2) {
+            BOOST_REQUIRE( tags.is_inline() );
+        } else if (expected.size() > 4) {
+            BOOST_REQUIRE( !tags.is_inline() );
+        }
+        versions.push_back(std::make_pair(tags, expected));
+    }
+    for (std::list<std::pair<Tags, std::set<std::string> > >::iterator
+             v=versions.begin();
+         v != versions.end();
+         ++v) {
+        std::list<std::string> then(v->first.toList());
+        BOOST_REQUIRE( then.size() == v->second.size() &&
+                       std::equal(then.begin(), then.end(),
+                                  v->second.begin()) );
+        Option<Tree<std::string>> tree = v->first.tree();
+        BOOST_REQUIRE_EQUAL( tree_size(tree), v->second.size() );
+        BOOST_REQUIRE( tree.is_none() || tree->toList() == then );
+    }
+
+    SmallSet<int> ids;
+    ids = ids.insert(3).insert(1).insert(2).insert(2);
+    BOOST_CHECK_EQUAL( ids.size(), 3u );
+    BOOST_CHECK( ids.is_inline() );
+    BOOST_CHECK_EQUAL( ids.toList().front(), 1 );
+    BOOST_CHECK( ids.remove(7).toList() == ids.toList() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_multi_version_queries)
+{
+    // 500 versions of one tree, each a small change from the last
+    std::vector<Option<Tree<int>>> versions;
+    Option<Tree<int>> tree = None<Tree<int>>();
+    versions.push_back(tree);
+    for (int i=0; i<500; ++i) {
+        int key = (i * 7919) % 300;
+        if (i % 3 == 2 && tree.is_some() && tree->contains(key / 2)) {
+            tree = tree->remove(key / 2);
+        } else {
+            tree = tree.is_some() ? Some(tree->insert(key))
+                                  : Some(Tree<int>(key));
+        }
+        versions.push_back(tree);
+    }
+    for (int key=-1; key<=300; ++key) {
+        std::vector<bool> contains = contains_in_versions(versions, key);
+        std::vector<const int*> found = find_in_versions(versions, key);
+        BOOST_REQUIRE_EQUAL( contains.size(), versions.size() );
+        for (size_t v=0; v < versions.size(); ++v) {
+            bool expected = versions[v].is_some() &&
+                            versions[v]->contains(key);
+            BOOST_REQUIRE_EQUAL( contains[v], expected );
+            BOOST_REQUIRE( expected ? found[v] != NULL && *found[v] == key
+                                    : found[v] == NULL );
+        }
+    }
+
+    // a node on the search path of many versions is looked at only once
+    for (int key=0; key<=300; key+=50) {
+        std::set<const Tree<int>*> distinct;
+        size_t path_nodes = 0;
+        for (size_t v=0; v < versions.size(); ++v) {
+            const Tree<int>* node = versions[v].is_some()
+                                    ? versions[v].operator->() : NULL;
+            while (node != NULL) {
+                distinct.insert(node);
+                ++path_nodes;
+                if (node->deref() == key) {
+                    break;
+                }
+                node = node->deref() > key ? node->left_node()
+                                           : node->right_node();
+            }
+        }
+        size_t before = versions_nodes_visited();
+        find_in_versions(versions, key);
+        size_t visited = versions_nodes_visited() - before;
+        BOOST_CHECK_EQUAL( visited, distinct.size() );
+        BOOST_CHECK_LT( visited * 2, path_nodes );
+    }
+    BOOST_CHECK( find_in_versions(std::vector<Option<Tree<int>>>(), 1).empty() );
+}
+
+
+/**
+ * @brief fold of a tree into the sum of its values
+ */
+struct SumFold
+{
+    typedef long result_type;
+
+    long operator()(const long& left, const int& value, const long& right) const {
+        return left + value + right;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_incremental_fold)
+{
+    Option<Tree<int>> tree = None<Tree<int>>();
+    for (int i=0; i<2000; ++i) {
+        int key = (i * 7919) % 5000;
+        tree = tree.is_some() ? Some(tree->insert(key)) : Some(Tree<int>(key));
+    }
+    IncrementalFold<Tree<int>, SumFold> sum;
+    long expected = 0;
+    tree->for_each([&expected](int key) { expected += key; });
+    BOOST_CHECK_EQUAL( sum.fold(tree), expected );
+    BOOST_CHECK_EQUAL( sum.evaluations(), tree->size() );
+    BOOST_CHECK_EQUAL( sum.fold(tree), expected );
+    BOOST_CHECK_EQUAL( sum.evaluations(), tree->size() );
+
+    // each new version evaluates only the nodes its update created
+    for (int i=0; i<200; ++i) {
+        uint64_t g = Tree<int>::current_generation();
+        int key = (i * 104729) % 5000;
+        if (i % 2 && tree->contains(key)) {
+            tree = tree->remove(key);
+            expected -= key;
+        } else {
+            tree = Some(tree->insert(key));
+            expected += key;
+        }
+        size_t before = sum.evaluations();
+        BOOST_REQUIRE_EQUAL( sum.fold(tree), expected );
+        BOOST_REQUIRE_LE( sum.evaluations() - before,
+                          changed_since(tree, g).size() + 1 );
+        // entries for replaced versions are dropped as folds go on
+        BOOST_REQUIRE_LE( sum.cached(), tree->size() + tree->size() / 2 );
+    }
+
+    // the cache holds no version alive, and forgets dead ones
+    Option<Tree<int>> last = tree;
+    tree = None<Tree<int>>();
+    last = Some(Tree<int>(1));
+    for (int i=0; i<1000; ++i) {
+        sum.fold(last);
+    }
+    BOOST_CHECK_LE( sum.cached(), 1u );
+    sum.prune();
+    BOOST_CHECK_EQUAL( sum.fold(last), 1 );
+    BOOST_CHECK_LE( sum.cached(), 1u );
+    BOOST_CHECK_EQUAL( sum.fold(None<Tree<int>>()), 0 );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tree_diff)
+{
+    Option<Tree<int>> tree = None<Tree<int>>();
+    for (int i=0; i<3000; ++i) {
+        int key = (i * 7919) % 4000;
+        tree = tree.is_some() ? Some(tree->insert(key)) : Some(Tree<int>(key));
+    }
+    // a handful of changes, then a diff against the original
+    Option<Tree<int>> changed = tree;
+    std::multiset<int> removed;
+    std::multiset<int> added;
+    for (int i=0; i<5; ++i) {
+        int key = (i * 104729) % 4000;
+        if (changed->contains(key)) {
+            changed = changed->remove(key);
+            removed.insert(key);
+        }
+        changed = Some(changed->insert(key * 3 + 1));
+        added.insert(key * 3 + 1);
+    }
+    TreeDiff<int> diff(tree, changed);
+    TreeDiff<int>::Change change;
+    std::multiset<int> seen_removed;
+    std::multiset<int> seen_added;
+    int last = -1;
+    while (diff.next(change)) {
+        BOOST_REQUIRE( !(last > *change.value) );
+        last = *change.value;
+        if (change.kind == TreeDiff<int>::REMOVED) {
+            seen_removed.insert(*change.value);
+        } else {
+            seen_added.insert(*change.value);
+        }
+    }
+    BOOST_CHECK( diff.done() );
+    BOOST_CHECK( seen_removed == removed );
+    BOOST_CHECK( seen_added == added );
+    // only the nodes around the changes are opened
+    BOOST_CHECK_LT( diff.opened(), 10 * 4 * tree->height() );
+
+    TreeDiff<int> same(tree, tree);
+    BOOST_CHECK( !same.next(change) );
+    BOOST_CHECK_EQUAL( same.opened(), 0u );
+    TreeDiff<int> everything(None<Tree<int>>(), tree);
+    size_t count = 0;
+    while (everything.next(change)) {
+        BOOST_REQUIRE( change.kind == TreeDiff<int>::ADDED );
+        ++count;
+    }
+    BOOST_CHECK_EQUAL( count, tree->size() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_derived_set)
+{
+    // the even ids, scaled by ten
+    DerivedSet<int, long> evens(
+        [](const int& id, long& derived) {
+            derived = id * 10L;
+            return id % 2 == 0;
+        },
+        None<Tree<int>>());
+    BOOST_CHECK( evens.view().is_none() );
+    std::multiset<int> ids;
+    Option<Tree<int>> source = None<Tree<int>>();
+    for (int step=0; step<300; ++step) {
+        int id = (step * 7919) % 250;
+        for (int j=0; j<3; ++j, id = (id * 31 + 7) % 250) {
+            if (ids.count(id) && (step + j) % 3 == 0) {
+                source = source->remove(id);
+                ids.erase(ids.find(id));
+            } else {
+                source = source.is_some() ? Some(source->insert(id))
+                                          : Some(Tree<int>(id));
+                ids.insert(id);
+            }
+        }
+        evens.update(source);
+        BOOST_REQUIRE_LE( evens.changes(), 3u );
+        std::list<long> expected;
+        for (std::multiset<int>::iterator it=ids.begin(); it != ids.end(); ++it) {
+            if (*it % 2 == 0) {
+                expected.push_back(*it * 10L);
+            }
+        }
+        std::list<long> view = evens.view().is_some() ? evens.view()->toList()
+                                                      : std::list<long>();
+        BOOST_REQUIRE( view == expected );
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_hash_ring)
+{
+    HashRing ring(100);
+    BOOST_CHECK_THROW( ring.route("key"), std::out_of_range );
+    std::vector<std::string> backends;
+    backends.push_back("alpha");
+    backends.push_back("beta");
+    backends.push_back("gamma");
+    backends.push_back("delta");
+    ring.update(backends, std::vector<std::string>());
+    ring.add("alpha");
+    BOOST_CHECK_EQUAL( ring.backends(), 4u );
+
+    std::vector<std::string> keys;
+    for (int i=0; i<4000; ++i) {
+        std::ostringstream key;
+        key << "user:" << i;
+        keys.push_back(key.str());
+    }
+    std::vector<std::string> before = ring.route(keys);
+    std::map<std::string, int> load;
+    for (size_t i=0; i < keys.size(); ++i) {
+        BOOST_REQUIRE_EQUAL( ring.route(keys[i]), before[i] );
+        ++load[before[i]];
+    }
+    BOOST_CHECK_EQUAL( load.size(), 4u );
+    for (std::map<std::string, int>::iterator it=load.begin();
+         it != load.end();
+         ++it) {
+        BOOST_CHECK_GT( it->second, 500 );
+    }
+
+    // a held snapshot keeps routing as it did; the ring moves only the
+    // keys of the backend that left
+    Option<Tree<HashRing::Token>> old = ring.snapshot();
+    ring.remove("gamma");
+    BOOST_CHECK_EQUAL( ring.backends(), 3u );
+    std::vector<std::string> after = ring.route(keys);
+    for (size_t i=0; i < keys.size(); ++i) {
+        BOOST_REQUIRE_EQUAL( HashRing::route(old, keys[i]), before[i] );
+        if (before[i] == "gamma") {
+            BOOST_REQUIRE_NE( after[i], "gamma" );
+        } else {
+            BOOST_REQUIRE_EQUAL( after[i], before[i] );
+        }
+    }
+    // routing goes on while membership changes underneath it
+    ring.add("alpha");
+    std::atomic<bool> done(false);
+    std::atomic<int> failures(0);
+    std::thread router([&ring, &keys, &done, &failures]() {
+        while (!done.load()) {
+            for (size_t i=0; i < keys.size(); i += 97) {
+                std::string backend = ring.route(keys[i]);
+                if (backend != "alpha" && backend != "beta" &&
+                    backend != "delta") {
+                    ++failures;
+                }
+            }
+        }
+    });
+    for (int i=0; i<50; ++i) {
+        ring.add(i % 2 ? "beta" : "delta");
+        ring.remove(i % 2 ? "delta" : "beta");
+    }
+    done = true;
+    router.join();
+    BOOST_CHECK_EQUAL( failures.load(), 0 );
+
+    ring.update(std::vector<std::string>(), backends);
+    BOOST_CHECK( ring.snapshot().is_none() );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_columnar_export)
+{
+    // big enough that the export is split across threads
+    std::vector<std::pair<int, double> > entries;
+    for (int i=0; i<100000; ++i) {
+        entries.push_back(std::make_pair(i * 3, i * 0.5));
+    }
+    Option<Tree<std::pair<int, double> > > map =
+        Tree<std::pair<int, double> >::from_sorted(entries.begin(),
+                                                   entries.size());
+    map = Some(map->insert(std::make_pair(7, -1.0)));
+    map = map->remove(std::make_pair(300, 50.0));
+    std::list<std::pair<int, double> > expected(map->toList());
+
+    std::vector<int> keys(map->size());
+    std::vector<double> values(map->size());
+    export_columns(map, &keys[0], &values[0], 4);
+    size_t i = 0;
+    for (std::list<std::pair<int, double> >::iterator it=expected.begin();
+         it != expected.end();
+         ++it, ++i) {
+        BOOST_REQUIRE_EQUAL( keys[i], it->first );
+        BOOST_REQUIRE_EQUAL( values[i], it->second );
+    }
+
+    // the same columns, in a file
+    TempPath temp("test_columnar");
+    const char* path = temp.c_str();
+    export_columns(map, path);
+    std::FILE* file = std::fopen(path, "rb");
+    BOOST_REQUIRE( file != NULL );
+    ColumnFileHeader header;
+    BOOST_REQUIRE_EQUAL( std::fread(&header, sizeof(header), 1, file), 1u );
+    BOOST_CHECK_EQUAL( std::string(header.magic, 8), "COLUMNS1" );
+    BOOST_REQUIRE_EQUAL( header.count, map->size() );
+    std::vector<int> file_keys(header.count);
+    std::vector<double> file_values(header.count);
+    BOOST_REQUIRE_EQUAL( std::fread(&file_keys[0], sizeof(int), header.count,
+                                    file), header.count );
+    std::fseek(file, static_cast<long>(header.values_offset()), SEEK_SET);
+    BOOST_REQUIRE_EQUAL( std::fread(&file_values[0], sizeof(double),
+                                    header.count, file), header.count );
+    std::fclose(file);
+    std::remove(path);
+    BOOST_CHECK( file_keys == keys );
+    BOOST_CHECK( file_values == values );
+
+    // elements split by a caller-supplied function
+    Option<Tree<int> > squares = Tree<int>::from_sorted(keys.begin(), 1000);
+    std::vector<int> roots(1000);
+    std::vector<long> products(1000);
+    export_columns(squares,
+                   [](const int& key, int& root, long& product) {
+                       root = key;
+                       product = static_cast<long>(key) * key;
+                   },
+                   &roots[0], &products[0]);
+    BOOST_CHECK_EQUAL( roots[999], keys[999] );
+    BOOST_CHECK_EQUAL( products[10], static_cast<long>(keys[10]) * keys[10] );
+}
+
+
+BOOST_AUTO_TEST_CASE(test_trace_events)
+{
+    std::vector<int> keys;
+    for (int i=0; i<5000; ++i) {
+        keys.push_back(i);
+    }
+    // nothing is recorded while tracing is off
+    Trace::clear();
+    Tree<int>::from_sorted(keys.begin(), keys.size());
+    BOOST_CHECK_EQUAL( Trace::size(), 0u );
+
+    Trace::enable();
+    Option<Tree<int> > tree = Tree<int>::from_sorted(keys.begin(), keys.size());
+    RoaringSet a;
+    RoaringSet b;
+    for (uint32_t i=0; i<1000; ++i) {
+        a = a.insert(i * 7);
+        b = b.insert(i * 70000);
+    }
+    a.unite(b);
+    Trace::enable(false);
+    BOOST_CHECK_EQUAL( Trace::size(), 2u );
+
+    std::ostringstream json;
+    Trace::write_json(json);
+    std::string out = json.str();
+    BOOST_CHECK_EQUAL( out.find("{\"traceEvents\":["), 0u );
+    BOOST_CHECK( out.find("\"name\":\"Tree::from_sorted\"") != std::string::npos );
+    BOOST_CHECK( out.find("\"name\":\"RoaringSet::unite\"") != std::string::npos );
+    BOOST_CHECK( out.find("\"ph\":\"X\"") != std::string::npos );
+    BOOST_CHECK( out.find("\"nodes\":5000") != std::string::npos );
+    BOOST_CHECK( out.find("\"tid\":") != std::string::npos );
+
+    // the ring keeps the newest events once it wraps
+    Trace::enable();
+    for (size_t i=0; i < Trace::capacity + 10; ++i) {
+        TraceScope scope("wrap");
+        scope.count(i);
+    }
+    Trace::enable(false);
+    BOOST_CHECK_EQUAL( Trace::size(), static_cast<size_t>(Trace::capacity) );
+    std::ostringstream wrapped;
+    Trace::write_json(wrapped);
+    BOOST_CHECK( wrapped.str().find("from_sorted") == std::string::npos );
+    Trace::clear();
+}
+
+
+BOOST_AUTO_TEST_CASE( test_tree_join )
+{
+    std::vector<int> small_keys{1, 2, 3};
+    Option<Tree<int> > small = Tree<int>::from_sorted(small_keys.begin(), 3);
+    std::vector<int> big_keys;
+    for (int i=10; i<1000; ++i) {
+        big_keys.push_back(i);
+    }
+    Option<Tree<int> > big = Tree<int>::from_sorted(big_keys.begin(),
+                                                    big_keys.size());
+
+    Tree<int> joined = Tree<int>::join(small, 5, big);
+    BOOST_CHECK_EQUAL( joined.size(), 994u );
+    BOOST_CHECK( check_avl(Some(joined)) );
+    BOOST_CHECK_EQUAL( joined.rank(5), 3u );
+
+    Tree<int> mirrored = Tree<int>::join(big, 2000, Some(Tree<int>(3000)));
+    BOOST_CHECK( check_avl(Some(mirrored)) );
+    BOOST_CHECK_EQUAL( mirrored.max(), 3000 );
+
+    Tree<int> single = Tree<int>::join(None<Tree<int> >(), 7, None<Tree<int> >());
+    BOOST_CHECK_EQUAL( single.size(), 1u );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_append_tree )
+{
+    AppendTree<int> empty;
+    BOOST_CHECK_EQUAL( empty.size(), 0u );
+    BOOST_CHECK( empty.tree().is_none() );
+    BOOST_CHECK_THROW( empty.remove_min(), std::out_of_range );
+
+    // time-ordered keys with the occasional late arrival and duplicate
+    AppendTree<int> window;
+    std::multiset<int> expected;
+    unsigned int state = 7;
+    for (int t=0; t<5000; ++t) {
+        state = state * 1103515245u + 12345u;
+        int key = (state >> 8) % 16 == 0 ? t - static_cast<int>((state >> 12) % 50)
+                                         : t;
+        window = window.insert(key);
+        expected.insert(key);
+        if (t % 100 == 99) {
+            window = window.remove_below(t - 1000);
+            expected.erase(expected.begin(), expected.lower_bound(t - 1000));
+        }
+        BOOST_REQUIRE_EQUAL( window.size(), expected.size() );
+        BOOST_REQUIRE_EQUAL( window.min(), *expected.begin() );
+        BOOST_REQUIRE_EQUAL( window.max(), *expected.rbegin() );
+    }
+    std::list<int> keys(expected.begin(), expected.end());
+    BOOST_CHECK( window.toList() == keys );
+    BOOST_CHECK( window.tree()->toList() == keys );
+    BOOST_CHECK( check_avl(window.tree()) );
+    BOOST_CHECK( window.spine() <= 2 * window.tree()->height() );
+    for (int k=3900; k<5010; ++k) {
+        BOOST_REQUIRE_EQUAL( window.contains(k), expected.count(k) > 0 );
+    }
+
+    // dropping the old end of a window is one split, however much goes
+    AppendTree<int> stream;
+    for (int t=0; t<100000; ++t) {
+        stream = stream.insert(t);
+    }
+    size_t height = stream.tree()->height();
+    for (int bound=1; bound<=99999; bound=bound * 7 + 3) {
+        size_t built = Tree<int>::nodes_built();
+        AppendTree<int> rest = stream.remove_below(bound);
+        built = Tree<int>::nodes_built() - built;
+        BOOST_REQUIRE_EQUAL( rest.size(), 100000u - bound );
+        BOOST_REQUIRE_EQUAL( rest.min(), bound );
+        BOOST_REQUIRE( check_avl(rest.tree()) );
+        BOOST_REQUIRE_LE( built, 3 * height );
+    }
+    BOOST_CHECK_EQUAL( stream.remove_below(100000).size(), 0u );
+    BOOST_CHECK_EQUAL( stream.remove_below(-5).size(), stream.size() );
+
+    // earlier versions are unaffected
+    AppendTree<int> before = window;
+    AppendTree<int> after = window.insert(10000).remove_min();
+    BOOST_CHECK( before.toList() == keys );
+    BOOST_CHECK_EQUAL( after.max(), 10000 );
+    BOOST_CHECK_EQUAL( after.size(), before.size() );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_string_dictionary )
+{
+    StringDictionary dictionary;
+    std::vector<std::string> texts;
+    unsigned int state = 3;
+    for (int i=0; i<500; ++i) {
+        state = state * 1103515245u + 12345u;
+        std::ostringstream text;
+        text << "/var/log/service-" << (state >> 8) % 100000 << ".log";
+        texts.push_back(text.str());
+        dictionary = dictionary.add(text.str());
+    }
+    std::sort(texts.begin(), texts.end());
+    texts.erase(std::unique(texts.begin(), texts.end()), texts.end());
+    BOOST_REQUIRE_EQUAL( dictionary.size(), texts.size() );
+    uint64_t previous = 0;
+    for (size_t i=0; i < texts.size(); ++i) {
+        uint64_t code = 0;
+        BOOST_REQUIRE( dictionary.encode(texts[i], code) );
+        BOOST_REQUIRE( code > previous );
+        BOOST_REQUIRE_EQUAL( dictionary.decode(code), texts[i] );
+        previous = code;
+    }
+    uint64_t code;
+    BOOST_CHECK( !dictionary.encode("missing", code) );
+    BOOST_CHECK_THROW( dictionary.decode(previous + 1), std::out_of_range );
+
+    // squeezing strings into one gap forces a re-encoding
+    StringDictionary squeezed = StringDictionary().add("a").add("b");
+    std::string text = "a";
+    for (int i=0; i<80; ++i) {
+        text += "a";
+        squeezed = squeezed.add(text);
+    }
+    BOOST_CHECK( squeezed.epoch() > 0 );
+    BOOST_CHECK_EQUAL( squeezed.size(), 82u );
+    uint64_t a = 0, aa = 0, b = 0;
+    squeezed.encode("a", a);
+    squeezed.encode("aa", aa);
+    squeezed.encode("b", b);
+    BOOST_CHECK( a < aa && aa < b );
+    BOOST_CHECK( squeezed.reencoded().epoch() == squeezed.epoch() + 1 );
+
+    // strings arriving in either order have room before a re-encoding,
+    // both from the first string and from a re-encoded dictionary
+    StringDictionary ascending;
+    StringDictionary descending;
+    for (int i=0; i<4000; ++i) {
+        std::ostringstream up, down;
+        up << "key-" << 10000 + i;
+        down << "key-" << 20000 - i;
+        ascending = ascending.add(up.str());
+        descending = descending.add(down.str());
+    }
+    BOOST_CHECK_EQUAL( ascending.epoch(), 0u );
+    BOOST_CHECK_EQUAL( descending.epoch(), 0u );
+    StringDictionary recentred = squeezed.reencoded();
+    for (int i=0; i<4000; ++i) {
+        std::ostringstream below, above;
+        below << "A" << 20000 - i;
+        above << "c" << 10000 + i;
+        recentred = recentred.add(below.str()).add(above.str());
+    }
+    BOOST_CHECK_EQUAL( recentred.epoch(), squeezed.epoch() + 1 );
+    BOOST_CHECK_EQUAL( recentred.size(), squeezed.size() + 8000 );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_encoded_string_set )
+{
+    EncodedStringSet set;
+    std::set<std::string> expected;
+    std::string text = "k";
+    for (int i=0; i<200; ++i) {
+        // keep inserting just after "k" so the gap runs out
+        text += (i % 3 == 0) ? "a" : "b";
+        set = set.insert(text);
+        set = set.insert("z" + text);
+        expected.insert(text);
+        expected.insert("z" + text);
+    }
+    set = set.insert("k").remove("zka");
+    expected.insert("k");
+    expected.erase("zka");
+    BOOST_CHECK( set.dictionary().epoch() > 0 );
+    BOOST_CHECK_EQUAL( set.size(), expected.size() );
+    std::list<std::string> strings(expected.begin(), expected.end());
+    BOOST_CHECK( set.toList() == strings );
+    BOOST_CHECK( set.contains("k") );
+    BOOST_CHECK( !set.contains("zka") );
+    BOOST_CHECK( !set.contains("never") );
+    BOOST_CHECK( check_avl(set.codes()) );
+
+    // the codes are an ordinary integer tree
+    EliasFano frozen(set.codes());
+    BOOST_CHECK_EQUAL( frozen.size(), set.size() );
+
+    EncodedStringSet moved = set.recode(set.dictionary().reencoded());
+    BOOST_CHECK( moved.toList() == strings );
+    BOOST_CHECK_THROW( set.recode(StringDictionary()), std::invalid_argument );
+
+    // a dictionary with words the set does not use, in between its own
+    StringDictionary wider = set.dictionary();
+    for (std::set<std::string>::iterator it=expected.begin();
+         it != expected.end(); ++it) {
+        wider = wider.add(*it + "0").add("0" + *it);
+    }
+    EncodedStringSet widened = set.recode(wider);
+    BOOST_CHECK( widened.toList() == strings );
+    std::list<uint64_t> codes(widened.codes()->toList());
+    std::list<uint64_t>::iterator code = codes.begin();
+    for (std::list<std::string>::iterator it=strings.begin();
+         it != strings.end(); ++it, ++code) {
+        uint64_t want = 0;
+        BOOST_REQUIRE( wider.encode(*it, want) );
+        BOOST_REQUIRE_EQUAL( *code, want );
+    }
+    BOOST_CHECK_THROW( widened.insert("q").recode(set.dictionary()),
+                       std::invalid_argument );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_kd_tree )
+{
+    typedef KdTree<int, 2> Plane;
+    Plane empty;
+    Plane::Point origin = {{0, 0}};
+    BOOST_CHECK_EQUAL( empty.size(), 0u );
+    BOOST_CHECK( empty.nearest(origin, 3).empty() );
+    BOOST_CHECK_EQUAL( empty.remove(origin).size(), 0u );
+
+    // a cluster that keeps moving right, so subtrees go lopsided
+    Plane tree;
+    std::vector<Plane::Point> points;
+    std::vector<Plane> versions;
+    std::vector<std::vector<Plane::Point> > snapshots;
+    unsigned int state = 11;
+    for (int i=0; i<3000; ++i) {
+        state = state * 1103515245u + 12345u;
+        Plane::Point p = {{ i / 3 + static_cast<int>((state >> 8) % 20),
+                            static_cast<int>((state >> 16) % 100) }};
+        tree = tree.insert(p);
+        points.push_back(p);
+        if (i % 4 == 3) {
+            // moving a point is a remove and an insert
+            size_t old = (state >> 4) % points.size();
+            tree = tree.remove(points[old]);
+            points.erase(points.begin() + old);
+        }
+        if (i % 1000 == 999) {
+            versions.push_back(tree);
+            snapshots.push_back(points);
+        }
+    }
+    BOOST_CHECK_EQUAL( tree.size(), points.size() );
+    // 3/4 balance keeps the depth within log base 4/3
+    BOOST_CHECK( tree.height() <= 2 + std::log(points.size()) / std::log(4.0 / 3) );
+
+    for (size_t v=0; v < versions.size(); ++v) {
+        const Plane& version = versions[v];
+        const std::vector<Plane::Point>& expected = snapshots[v];
+        BOOST_REQUIRE_EQUAL( version.size(), expected.size() );
+        BOOST_CHECK( version.contains(expected[expected.size() / 2]) );
+
+        Plane::Point lo = {{ 300, 20 }};
+        Plane::Point hi = {{ 400, 60 }};
+        std::vector<Plane::Point> found = version.range(lo, hi);
+        std::vector<Plane::Point> brute;
+        for (size_t i=0; i < expected.size(); ++i) {
+            if (expected[i][0] >= 300 && expected[i][0] <= 400 &&
+                expected[i][1] >= 20 && expected[i][1] <= 60) {
+                brute.push_back(expected[i]);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        std::sort(brute.begin(), brute.end());
+        BOOST_CHECK( found == brute );
+
+        Plane::Point center = {{ 250, 50 }};
+        found = version.within(center, 12.5);
+        brute.clear();
+        for (size_t i=0; i < expected.size(); ++i) {
+            if (Plane::distance2(expected[i], center) <= 12.5 * 12.5) {
+                brute.push_back(expected[i]);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        std::sort(brute.begin(), brute.end());
+        BOOST_CHECK( found == brute );
+
+        found = version.nearest(center, 10);
+        std::vector<double> distances;
+        for (size_t i=0; i < expected.size(); ++i) {
+            distances.push_back(Plane::distance2(expected[i], center));
+        }
+        std::sort(distances.begin(), distances.end());
+        BOOST_REQUIRE_EQUAL( found.size(), 10u );
+        for (size_t i=0; i < found.size(); ++i) {
+            BOOST_CHECK_EQUAL( Plane::distance2(found[i], center), distances[i] );
+        }
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE( test_kd_tree_bulk )
+{
+    typedef KdTree<double, 3> Space;
+    std::vector<Space::Point> points;
+    for (int x=0; x<10; ++x) {
+        for (int y=0; y<10; ++y) {
+            for (int z=0; z<10; ++z) {
+                Space::Point p = {{ x * 1.0, y * 1.0, z * 1.0 }};
+                points.push_back(p);
+            }
+        }
+    }
+    Space space(points);
+    BOOST_CHECK_EQUAL( space.size(), 1000u );
+    BOOST_CHECK_EQUAL( space.height(), 10u );
+
+    Space::Point center = {{ 4.6, 4.4, 0.0 }};
+    std::vector<Space::Point> near = space.nearest(center, 1);
+    Space::Point closest = {{ 5.0, 4.0, 0.0 }};
+    BOOST_REQUIRE_EQUAL( near.size(), 1u );
+    BOOST_CHECK( near[0] == closest );
+    BOOST_CHECK_EQUAL( space.nearest(center, 5000).size(), 1000u );
+    BOOST_CHECK_EQUAL( space.within(center, 1.0).size(), 4u );
+
+    // emptying it in order still keeps it balanced
+    Space shrinking = space;
+    for (size_t i=0; i < 900; ++i) {
+        shrinking = shrinking.remove(points[i]);
+    }
+    BOOST_CHECK_EQUAL( shrinking.size(), 100u );
+    BOOST_CHECK( shrinking.height() <= 2 + std::log(100.0) / std::log(4.0 / 3) );
+    BOOST_CHECK( !shrinking.contains(points[0]) );
+    BOOST_CHECK( shrinking.contains(points[999]) );
+    BOOST_CHECK_EQUAL( space.size(), 1000u );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_gc_tree )
+{
+    GcHeap<int> heap;
+    {
+        GcTree<int> tree(heap);
+        std::multiset<int> expected;
+        std::vector<GcTree<int> > kept;
+        std::vector<std::list<int> > kept_keys;
+        for (int i=0; i<2000; ++i) {
+            int key = (i * 7919) % 1000;
+            tree = tree.insert(key);
+            expected.insert(key);
+            if (i % 3 == 0) {
+                tree = tree.remove((i * 31) % 1000);
+                std::multiset<int>::iterator it = expected.find((i * 31) % 1000);
+                if (it != expected.end()) {
+                    expected.erase(it);
+                }
+            }
+            if (i % 500 == 499) {
+                kept.push_back(tree);
+                kept_keys.push_back(std::list<int>(expected.begin(),
+                                                   expected.end()));
+            }
+        }
+        std::list<int> keys(expected.begin(), expected.end());
+        BOOST_CHECK( tree.toList() == keys );
+        BOOST_CHECK( tree.contains(*expected.begin()) );
+        BOOST_CHECK( tree.height() <= 1.45 * std::log2(tree.size() + 2) );
+
+        // only the versions still held survive a collection
+        size_t before = heap.nodes();
+        heap.collect();
+        BOOST_CHECK( heap.nodes() < before );
+        BOOST_CHECK_EQUAL( heap.roots(), kept.size() );
+        BOOST_CHECK( tree.toList() == keys );
+        for (size_t i=0; i < kept.size(); ++i) {
+            BOOST_CHECK( kept[i].toList() == kept_keys[i] );
+        }
+
+        // incremental collection reaches the same point in small steps
+        kept.clear();
+        size_t steps = 1;
+        while (!heap.collect_step(16)) {
+            ++steps;
+        }
+        BOOST_CHECK( steps > 1 );
+        heap.collect();
+        BOOST_CHECK_EQUAL( heap.nodes(), tree.size() );
+        BOOST_CHECK( tree.toList() == keys );
+    }
+    heap.collect();
+    BOOST_CHECK_EQUAL( heap.nodes(), 0u );
+    BOOST_CHECK_EQUAL( heap.roots(), 0u );
+
+    // a heap destroyed part way through a sweep frees each node once
+    GcHeap<int> sweeping;
+    {
+        GcTree<int> survivor(sweeping);
+        {
+            GcTree<int> dropped(sweeping);
+            for (int i=0; i<500; ++i) {
+                dropped = dropped.insert(i);
+                survivor = survivor.insert(i);
+            }
+        }
+        while (sweeping.reclaimed() == 0) {
+            BOOST_REQUIRE( !sweeping.collect_step(1) );
+        }
+        BOOST_CHECK( sweeping.nodes() > survivor.size() );
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE( test_gc_tree_concurrent )
+{
+    GcHeap<int> heap;
+    std::atomic<bool> done(false);
+    std::thread collector([&heap, &done]() {
+        while (!done.load()) {
+            heap.collect_step(64);
+        }
+    });
+    std::vector<std::thread> writers;
+    std::atomic<int> failures(0);
+    for (int w=0; w<3; ++w) {
+        writers.push_back(std::thread([&heap, &failures, w]() {
+            GcTree<int> tree(heap);
+            GcTree<int> snapshot(heap);
+            for (int i=0; i<3000; ++i) {
+                tree = tree.insert(w * 100000 + i);
+                if (i % 2 == 1) {
+                    tree = tree.remove(w * 100000 + i - 1);
+                }
+                if (i % 100 == 0) {
+                    snapshot = tree;
+                }
+                if (i % 250 == 0 && (snapshot.size() != static_cast<size_t>(
+                        (i / 100 * 100 + 2) / 2) ||
+                        !snapshot.contains(w * 100000 + i / 100 * 100))) {
+                    ++failures;
+                }
+            }
+            if (tree.size() != 1500 || !tree.contains(w * 100000 + 2999)) {
+                ++failures;
+            }
+        }));
+    }
+    for (size_t w=0; w < writers.size(); ++w) {
+        writers[w].join();
+    }
+    done = true;
+    collector.join();
+    BOOST_CHECK_EQUAL( failures.load(), 0 );
+    BOOST_CHECK( heap.reclaimed() > 0 );
+    heap.collect();
+    BOOST_CHECK_EQUAL( heap.nodes(), 0u );
+}
+
+
+BOOST_AUTO_TEST_CASE( test_tree_tasks )
+{
+    std::vector<int> evens;
+    std::vector<int> thirds;
+    for (int i=0; i<30000; ++i) {
+        evens.push_back(2 * i);
+        thirds.push_back(3 * i);
+    }
+
+    BuildTask<int> build(evens);
+    size_t steps = 0;
+    while (!build.step(1000)) {
+        ++steps;
+        BOOST_REQUIRE_EQUAL( build.progress(), 1000 * steps );
+        BOOST_REQUIRE( build.result().is_none() );
+    }
+    BOOST_CHECK_EQUAL( steps, 29u );
+    BOOST_CHECK( build.done() );
+    Option<Tree<int> > a = build.result();
+    BOOST_REQUIRE_EQUAL( tree_size(a), evens.size() );
+    BOOST_CHECK( check_avl(a) );
+    Option<Tree<int> > b = Tree<int>::from_sorted(thirds.begin(), thirds.size());
+
+    // the inputs are pinned, so dropping them between steps is safe
+    SetOpTask<int>* both = new SetOpTask<int>(a, b, SET_INTERSECTION);
+    SetOpTask<int> either(a, b, SET_UNION);
+    SetOpTask<int> only(a, b, SET_DIFFERENCE);
+    both->step(10);
+    a = None<Tree<int> >();
+    both->run_all();
+    either.run_all();
+    while (!only.run_for(std::chrono::microseconds(50), 64)) {
+    }
+    BOOST_CHECK_EQUAL( tree_size(both->result()), 10000u );
+    BOOST_CHECK_EQUAL( tree_size(either.result()), 50000u );
+    BOOST_CHECK_EQUAL( tree_size(only.result()), 20000u );
+    BOOST_CHECK( check_avl(either.result()) );
+    BOOST_CHECK( both->result()->contains(6) && !both->result()->contains(4) );
+    BOOST_CHECK( only.result()->contains(4) && !only.result()->contains(6) );
+    BOOST_CHECK_EQUAL( both->progress(), both->total() );
+
+    // a step reads at most its budget, matches included
+    SetOpTask<int> paced(build.result(), b, SET_INTERSECTION);
+    size_t seen = 0;
+    while (!paced.step(3)) {
+        BOOST_REQUIRE_LE( paced.progress() - seen, 3u );
+        seen = paced.progress();
+    }
+    BOOST_CHECK_EQUAL( paced.progress(), paced.total() );
+    BOOST_CHECK( paced.result()->toList() == both->result()->toList() );
+    delete both;
+
+    // compaction gives the same elements in new nodes
+    Option<Tree<int> > updated = either.result()->insert(-1);
+    CompactTask<int> compact(updated);
+    compact.run_all();
+    BOOST_CHECK( compact.result()->toList() == updated->toList() );
+    BOOST_CHECK( compact.result()->generation() != updated->generation() );
+
+    DiffTask<int> diff(either.result(), updated->remove(0));
+    diff.run_all();
+    BOOST_REQUIRE_EQUAL( diff.added().size(), 1u );
+    BOOST_CHECK_EQUAL( diff.added()[0], -1 );
+    BOOST_REQUIRE_EQUAL( diff.removed().size(), 1u );
+    BOOST_CHECK_EQUAL( diff.removed()[0], 0 );
+    BOOST_CHECK( diff.progress() < 200 );
+
+    // versions built separately share nothing, and every node is opened
+    std::vector<int> many;
+    for (int i=0; i<200000; ++i) {
+        many.push_back(i);
+    }
+    DiffTask<int> apart(Tree<int>::from_sorted(many.begin(), many.size()),
+                        Tree<int>::from_sorted(many.begin(), many.size()));
+    BOOST_CHECK( !apart.step(1) );
+    BOOST_CHECK_LE( apart.progress(), 1u );
+    size_t before = apart.progress();
+    steps = 0;
+    while (!apart.step(5000)) {
+        BOOST_REQUIRE_LE( apart.progress() - before, 5000u );
+        before = apart.progress();
+        ++steps;
+    }
+    BOOST_CHECK( steps >= 400000 / 5000 - 1 );
+    BOOST_CHECK( apart.added().empty() && apart.removed().empty() );
+    BOOST_CHECK_EQUAL( apart.progress(), 400000u );
+
+    std::ostringstream out;
+    SerializeTask<int> serialize(b, out);
+    serialize.step(5);
+    serialize.cancel();
+    BOOST_CHECK( serialize.step(5) );
+    BOOST_CHECK( serialize.cancelled() && !serialize.done() );
+    BOOST_CHECK_EQUAL( serialize.progress(), 5u );
+
+    std::ostringstream whole;
+    SerializeTask<int> again(b, whole);
+    again.run_all();
+    std::string bytes = whole.str();
+    BOOST_REQUIRE_EQUAL( bytes.size(), sizeof(uint64_t) + thirds.size() * sizeof(int) );
+    std::vector<int> read(thirds.size());
+    std::memcpy(&read[0], bytes.data() + sizeof(uint64_t), thirds.size() * sizeof(int));
+    BOOST_CHECK( read == thirds );
+}
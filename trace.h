@@ -0,0 +1,295 @@
+/**
+ * @file
+ * @brief Trace events for long-running tree operations
+ *
+ * Contains scoped trace events that record when a phase of work (a bulk
+ * build, a set operation, a checkpoint, an eviction sweep...) started,
+ * how long it took, on which thread, and how many nodes and bytes it
+ * handled. Events go into a fixed-size ring in memory and can be dumped
+ * as Chrome trace-event JSON, which chrome://tracing and Perfetto open.
+ *
+ * Tracing is compiled in only when TREE_TRACE is defined; otherwise the
+ * TREE_TRACE_* macros expand to nothing. When compiled in, it is still
+ * off until Trace::enable() is called, and an event costs one relaxed
+ * atomic load while it is off.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#ifdef TREE_TRACE
+
+#include <atomic>
+#include <chrono>   // steady_clock
+#include <ostream>
+#include <stdint.h>
+
+/**
+ * @brief The trace ring buffer and its switches
+ *
+ * Recording is lock-free: each event claims the next slot with one
+ * atomic increment and overwrites whatever was there, so the ring holds
+ * the most recent events. Dump it once the work being traced is done;
+ * events still being written while it is dumped are left out. A slot's
+ * fields are relaxed atomics guarded by its sequence number, so reading
+ * one while it is overwritten is detected rather than a data race.
+ */
+class Trace
+{
+public:
+    /// number of events the ring holds
+    enum { capacity = 1 << 16 };
+
+    /**
+     * @brief one finished phase of work
+     */
+    struct Event
+    {
+        /// name of the phase; must be a string literal
+        const char* name;
+
+        /// when it started, in microseconds on the steady clock
+        uint64_t start;
+
+        /// how long it took, in microseconds
+        uint64_t duration;
+
+        /// small number identifying the thread that did it
+        uint64_t thread;
+
+        /// nodes handled, or 0 if not counted
+        uint64_t nodes;
+
+        /// bytes handled, or 0 if not counted
+        uint64_t bytes;
+    };
+
+    /**
+     * @brief starts or stops recording
+     */
+    static void enable(bool on = true) {
+        state().enabled.store(on, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief returns True while recording
+     */
+    static bool enabled() {
+        return state().enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief discards every event recorded so far
+     */
+    static void clear() {
+        State& s = state();
+        for (size_t i=0; i < capacity; ++i) {
+            s.slots[i].sequence.store(0, std::memory_order_relaxed);
+        }
+        s.next.store(0, std::memory_order_release);
+    }
+
+    /**
+     * @brief returns the number of events now in the ring
+     */
+    static size_t size() {
+        uint64_t recorded = state().next.load(std::memory_order_acquire);
+        uint64_t held = capacity;
+        return recorded < held ? recorded : held;
+    }
+
+    /**
+     * @brief adds a finished event to the ring
+     */
+    static void record(const Event& event) {
+        State& s = state();
+        uint64_t n = s.next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = s.slots[n % capacity];
+        // 0 marks the slot as being written until the event is complete
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.store(event);
+        slot.sequence.store(n + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief writes the events in the ring, oldest first, as a Chrome
+     * trace-event JSON document
+     */
+    static void write_json(std::ostream& out);
+
+    /**
+     * @brief returns the current time in microseconds
+     */
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * @brief returns the number identifying the calling thread
+     */
+    static uint64_t thread() {
+        static std::atomic<uint64_t> threads(0);
+        static thread_local uint64_t id = threads.fetch_add(1) + 1;
+        return id;
+    }
+
+private:
+
+    /**
+     * @brief an Event held field by field, so a reader may copy it out
+     * while a writer overwrites it
+     */
+    struct Slot
+    {
+        /// one more than the number of the event in the slot, or 0
+        std::atomic<uint64_t> sequence;
+
+        std::atomic<const char*> name;
+        std::atomic<uint64_t> start;
+        std::atomic<uint64_t> duration;
+        std::atomic<uint64_t> thread;
+        std::atomic<uint64_t> nodes;
+        std::atomic<uint64_t> bytes;
+
+        void store(const Event& e) {
+            name.store(e.name, std::memory_order_relaxed);
+            start.store(e.start, std::memory_order_relaxed);
+            duration.store(e.duration, std::memory_order_relaxed);
+            thread.store(e.thread, std::memory_order_relaxed);
+            nodes.store(e.nodes, std::memory_order_relaxed);
+            bytes.store(e.bytes, std::memory_order_relaxed);
+        }
+
+        Event load() const {
+            Event e = { name.load(std::memory_order_relaxed),
+                        start.load(std::memory_order_relaxed),
+                        duration.load(std::memory_order_relaxed),
+                        thread.load(std::memory_order_relaxed),
+                        nodes.load(std::memory_order_relaxed),
+                        bytes.load(std::memory_order_relaxed) };
+            return e;
+        }
+    };
+
+    struct State
+    {
+        std::atomic<bool> enabled;
+
+        /// number of events ever recorded
+        std::atomic<uint64_t> next;
+
+        Slot slots[capacity];
+    };
+
+    static State& state() {
+        static State s;
+        return s;
+    }
+};
+
+
+/**
+ * @brief Records an event covering its own lifetime
+ *
+ * Whether to record is decided when the scope starts: a scope begun
+ * while tracing is off records nothing.
+ */
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name) :
+        m_name(Trace::enabled() ? name : NULL),
+        m_start(m_name != NULL ? Trace::now() : 0),
+        m_nodes(0),
+        m_bytes(0)
+    {};
+
+    ~TraceScope() {
+        if (m_name != NULL) {
+            Trace::Event event = { m_name, m_start, Trace::now() - m_start,
+                                   Trace::thread(), m_nodes, m_bytes };
+            Trace::record(event);
+        }
+    }
+
+    /**
+     * @brief adds to the nodes and bytes the event reports
+     */
+    void count(uint64_t nodes, uint64_t bytes = 0) {
+        m_nodes += nodes;
+        m_bytes += bytes;
+    }
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+
+    const char* m_name;
+    uint64_t m_start;
+    uint64_t m_nodes;
+    uint64_t m_bytes;
+};
+
+
+
+inline void Trace::write_json(std::ostream& out)
+{
+    State& s = state();
+    uint64_t end = s.next.load(std::memory_order_acquire);
+    uint64_t held = capacity;
+    uint64_t begin = end > held ? end - held : 0;
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (uint64_t n = begin; n < end; ++n) {
+        const Slot& slot = s.slots[n % capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != n + 1) {
+            continue;
+        }
+        Event e = slot.load();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != n + 1) {
+            // overwritten while it was copied
+            continue;
+        }
+        out << (first ? "\n" : ",\n")
+            << "{\"name\":\"" << e.name << "\",\"cat\":\"tree\",\"ph\":\"X\""
+            << ",\"ts\":" << e.start << ",\"dur\":" << e.duration
+            << ",\"pid\":1,\"tid\":" << e.thread
+            << ",\"args\":{\"nodes\":" << e.nodes
+            << ",\"bytes\":" << e.bytes << "}}";
+        first = false;
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+
+/// starts an event named name that ends with the enclosing scope
+#define TREE_TRACE_SCOPE(var, name) TraceScope var(name)
+
+/// adds nodes and bytes to the event started as var
+#define TREE_TRACE_COUNT(var, nodes, bytes) var.count(nodes, bytes)
+
+#else
+
+#define TREE_TRACE_SCOPE(var, name)
+#define TREE_TRACE_COUNT(var, nodes, bytes)
+
+#endif
@@ -5,7 +5,7 @@
  * Contains a persistent binary search tree implementation.
  * Shared Pointers are used to manage the tree's memory, allowing
  * for parts of the tree to be used.
- * No balancing algorithm is currently implemented.
+ * Trees are kept balanced with the AVL algorithm.
  *
  *
  * Copyright (C) 2014  Vernon R. Jones
@@ -27,12 +27,19 @@
 
 #pragma once
 
+#include <algorithm> // lower_bound
+#include <atomic>   // generation counter
 #include <list>     // used for iterators
 #include <memory>   // shared_ptr
+#include <stdexcept> // length_error, out_of_range, invalid_argument
+#include <stdint.h>
+#include <vector>   // reshape_by_weights
 
 #include "option.h"
+#include "trace.h"
 
 template<typename T> class TreeIter;
+template<typename T> class NodePool;
 
 /**
  * @brief Persistent Tree
@@ -91,16 +98,83 @@ public:
      */
     bool contains(const T& val) const;
 
+    /**
+     * @brief returns a pointer to the element equal to val, or NULL
+     *
+     * Useful when elements compare on only part of their contents.
+     *
+     * @note behavior is undefined if the element is used after the
+     * tree (or node) is destroyed
+     */
+    const T* find(const T& val) const;
+
+    /**
+     * @brief returns a pointer to the greatest element not greater
+     * than val, or NULL if every element is greater
+     *
+     * @note behavior is undefined if the element is used after the
+     * tree (or node) is destroyed
+     */
+    const T* floor(const T& val) const;
+
+    /**
+     * @brief returns a pointer to the least element not less than val,
+     * or NULL if every element is less
+     *
+     * @note behavior is undefined if the element is used after the
+     * tree (or node) is destroyed
+     */
+    const T* ceiling(const T& val) const;
+
     /**
      * @brief returns the number of elements in the tree
      */
     inline size_t size() const { return m_size; };
 
+    /**
+     * @brief return a reference to the element at index in sorted order
+     *
+     * Runs in O(log n) using the subtree sizes. Throws std::out_of_range
+     * if index is not less than size().
+     *
+     * @note behavior is undefined if the element is used after the
+     * tree (or node) is destroyed
+     */
+    const T& nth(size_t index) const;
+
+    /**
+     * @brief returns the number of elements less than val
+     *
+     * Runs in O(log n) using the subtree sizes.
+     */
+    size_t rank(const T& val) const;
+
     /**
      * @brief returns the maximum height of the tree
      */
     inline size_t height() const { return m_height; };
 
+    /**
+     * @brief returns the generation in which this node was created
+     *
+     * Every update takes the next generation from a counter shared by
+     * all trees of this element type, and stamps it on each node it
+     * creates. Nodes shared with older versions keep their stamps.
+     */
+    inline uint64_t generation() const { return m_generation; };
+
+    /**
+     * @brief returns the newest generation of any node in the tree
+     */
+    inline uint64_t max_generation() const { return m_max_generation; };
+
+    /**
+     * @brief returns the most recent generation handed out
+     *
+     * Every node created after this call has a greater generation.
+     */
+    static uint64_t current_generation() { return generations().load(); }
+
     /**
      * @brief return true if tree is balanced
      */
@@ -156,6 +230,40 @@ public:
      */
     const Option<Tree<T>> remove(const T& node) const;
 
+    /**
+     * @brief returns a new tree with old_node replaced by new_node.
+     *
+     * Equivalent to remove(old_node) followed by insert(new_node), but
+     * done in one descent: the path the two share is copied once, and
+     * if new_node belongs where old_node was, that node is rewritten
+     * in the copy with no rebalancing. If old_node is not in the tree,
+     * new_node is just inserted.
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    Tree<T> replace(const T& old_node, const T new_node) const;
+
+    /**
+     * @brief returns a copy of the tree rebuilt so that heavier elements
+     * sit nearer the head
+     *
+     * weights[i] is how often nth(i) is looked up. Each subtree is headed
+     * by the element where its running weight crosses half its total
+     * (Mehlhorn's rule), so an element of weight w is reached in about
+     * log2(total / w) steps, as far as the AVL shape allows: each head
+     * is moved off the median just enough for its two sides to differ
+     * in height by at most one, and the tree is at most about 1.44
+     * log2(n) high. The result is an ordinary, valid AVL Tree; later
+     * updates rebalance only the paths they touch. Throws
+     * std::invalid_argument if weights is the wrong length or holds a
+     * negative weight.
+     *
+     * @note this is NOT an in-place operation.
+     * The previous version of the tree is preserved.
+     */
+    Tree<T> reshape_by_weights(const std::vector<double>& weights) const;
+
     /**
      * @brief rebalances a tree (if required) using the AVL algorithm
      */
@@ -183,6 +291,26 @@ public:
      */
     inline const Option<Tree<T>> right() const { return m_child_right; };
 
+    /**
+     * @brief returns the left subtree, or NULL if it is empty
+     *
+     * Unlike left(), no reference is taken: the pointer is only valid
+     * for as long as this node is. Its address identifies the subtree,
+     * which may be shared by many versions.
+     */
+    inline const Tree<T>* left_node() const {
+        return m_child_left.is_some() ? m_child_left.operator->() : NULL;
+    }
+
+    /**
+     * @brief returns the right subtree, or NULL if it is empty
+     *
+     * @see left_node
+     */
+    inline const Tree<T>* right_node() const {
+        return m_child_right.is_some() ? m_child_right.operator->() : NULL;
+    }
+
     std::list<T> toList() const {
         std::list<T> l;
         if (m_child_left.is_some()) {
@@ -195,6 +323,50 @@ public:
         return l;
     }
 
+    /**
+     * @brief calls f on each element in ascending order
+     *
+     * Unlike toList, nothing is copied or allocated.
+     */
+    template<typename F>
+    void for_each(F&& f) const {
+        if (m_child_left.is_some()) {
+            m_child_left->for_each(f);
+        }
+        f(m_node);
+        if (m_child_right.is_some()) {
+            m_child_right->for_each(f);
+        }
+    }
+
+    /**
+     * @brief returns a balanced tree of the next n elements from first,
+     * or None if n is 0
+     *
+     * The elements must already be in ascending order. Each is read
+     * once and becomes one node, so this is O(n) where n inserts would
+     * be O(n log n). All nodes share one new generation.
+     */
+    template<typename Iter>
+    static Option<Tree<T>> from_sorted(Iter first, size_t n) {
+        TREE_TRACE_SCOPE(trace, "Tree::from_sorted");
+        TREE_TRACE_COUNT(trace, n, n * sizeof(Tree<T>));
+        return from_sorted(first, n, next_generation());
+    }
+
+    /**
+     * @brief returns a tree of the elements of left, then node, then the
+     * elements of right
+     *
+     * Nothing in left may be greater than node, and node may not be
+     * greater than anything in right. The shorter side is hung from the
+     * spine of the taller one at the level where their heights meet, so
+     * this copies only O(|height(left) - height(right)| + 1) nodes.
+     */
+    static Tree<T> join(const Option<Tree<T>>& left,
+                        const T& node,
+                        const Option<Tree<T>>& right);
+
     /**
      * @brief equality operator overload
      *
@@ -266,66 +438,101 @@ public:
 
 private:
 
+    /**
+     * @brief key restricting the node constructor below to Tree itself
+     *
+     * Both the type and its constructor are private, so only Tree can
+     * make one. std::make_shared and std::allocate_shared only pass a
+     * copy through to the constructor, which they can do without
+     * naming the type.
+     */
+    class Internal
+    {
+        friend class Tree<T>;
+        Internal() {};
+    };
+
+public:
+
     /**
      * @brief internal constructor for supplying children
+     *
+     * This is public only so that std::make_shared can reach it (one
+     * allocation for node and refcount). Callers outside Tree cannot
+     * make the Internal key it takes, so they cannot use it to build
+     * nodes with arbitrary children or generations.
      */
-    Tree(const T node,
-         const Option<Tree<T>> left,
-         const Option<Tree<T>> right) :
+    Tree(Internal,
+         uint64_t generation,
+         const T& node,
+         const Option<Tree<T>>& left,
+         const Option<Tree<T>>& right) :
         m_node(node),
         m_child_left(left),
         m_child_right(right),
-        m_size(tree_size(left) + tree_size(right)),
-        m_height(std::max(tree_height(left), tree_height(right)) + 1)
+        m_size(tree_size(left) + 1 + tree_size(right)),
+        m_height(std::max(tree_height(left), tree_height(right)) + 1),
+        m_generation(generation),
+        m_max_generation(std::max(generation,
+                                  std::max(tree_max_generation(left),
+                                           tree_max_generation(right))))
     {};
 
+#ifdef TREE_COUNT_NODES
     /**
-     * @brief blocked copy assignment operator, not implemented
+     * @brief number of nodes built by insert/remove/balance so far
+     *
+     * Only compiled in with TREE_COUNT_NODES, for the benchmarks.
      */
-    Tree<T>& operator=(const Tree<T>& head);
+    static size_t& nodes_built() { static size_t count = 0; return count; }
+#endif
 
-    /**
-     * @brief remove this node from the tree, preserving any children
-     */
-    const Option<Tree<T>> removeThisNode() const;
+private:
 
-    /**
-     * @brief Return a new tree with the minimum value removed.
-     *
-     * @param[out] min_node the node containing the
-     * minimum value that was removed
-     */
-    const Option<Tree<T>> popMin(Option<Tree<T>>& min_node=None<Tree<T>>()) const;
+    friend class NodePool<T>;
 
-    /**
-     * @brief Return a new tree with the maximum value removed.
-     *
-     * @param[out] min_node the node containing the
-     * maximum value that was removed
-     */
-    const Option<Tree<T>> popMax(Option<Tree<T>>& max_node=None<Tree<T>>()) const;
+    class Scratch;
 
     /**
-     * @used for AVL algorithm to rebalance
-     *
-     *   H   -->   R
-     *    R  -->  H B
-     *     B -->
-     *
-     * Swap(Head->Right, Right->Left), Right becomes root
+     * @brief blocked copy assignment operator, not implemented
      */
-    const Tree<T> rotLeft() const;
+    Tree<T>& operator=(const Tree<T>& head);
 
     /**
-     * @used for AVL algorithm to rebalance
-     *
-     *     H -->   L
-     *    L  -->  B H
-     *   B   -->
+     * @brief reference to a subtree while an update is being planned
      *
-     * Swap(Head->Left, Left->Right), Left becomes root
+     * Either points at an existing node, which the new version shares,
+     * or at a frame in a Scratch, which only becomes a real node if it
+     * is still part of the result once all rebalancing is decided.
      */
-    const Tree<T> rotRight() const;
+    struct Sub
+    {
+        /// index of the frame in the Scratch, or -1 for an existing node
+        int frame;
+
+        /// the existing node, or NULL if this subtree is empty
+        const Tree<T>* node;
+
+        /// the Option holding node (NULL when node is a root)
+        const Option<Tree<T>>* opt;
+
+        static Sub none() { Sub s = { -1, NULL, NULL }; return s; }
+
+        static Sub of(const Tree<T>& tree) {
+            Sub s = { -1, &tree, NULL };
+            return s;
+        }
+
+        static Sub of(const Option<Tree<T>>& tree) {
+            if (tree.is_none()) {
+                return none();
+            }
+            Sub s = { -1, tree.operator->(), &tree };
+            return s;
+        }
+
+        static Sub at(int frame) { Sub s = { frame, NULL, NULL }; return s; }
+    };
 
     // Private members
 
@@ -343,6 +550,103 @@ private:
 
     /// the max height of the left and right subtrees, plus one
     const size_t m_height;
+
+    /// the generation of the update that created this node
+    const uint64_t m_generation;
+
+    /// the newest generation in this subtree
+    const uint64_t m_max_generation;
+
+    /**
+     * @brief counter generations are taken from
+     */
+    static std::atomic<uint64_t>& generations() {
+        static std::atomic<uint64_t> counter(0);
+        return counter;
+    }
+
+    /**
+     * @brief take a generation for a new update
+     */
+    static uint64_t next_generation() { return generations().fetch_add(1) + 1; }
+
+    /**
+     * @brief build the weight-balanced subtree of nodes[lo, hi), exactly
+     * height levels high
+     *
+     * prefix[i] is the total weight of nodes before i. Each head is the
+     * weighted median, moved as little as it takes for both sides to
+     * still make AVL subtrees of heights within one of each other.
+     */
+    static Option<Tree<T>> weighted(const std::vector<const T*>& nodes,
+                                    const std::vector<double>& prefix,
+                                    size_t lo,
+                                    size_t hi,
+                                    size_t height,
+                                    uint64_t generation);
+
+    /**
+     * @brief the fewest elements an AVL tree of height levels can hold
+     */
+    static size_t min_avl(size_t height) {
+        size_t shorter = 0;
+        size_t taller = 0;
+        for (size_t h=1; h <= height; ++h) {
+            size_t next = taller + shorter + 1;
+            shorter = taller;
+            taller = next;
+        }
+        return taller;
+    }
+
+    /**
+     * @brief the most elements a tree of height levels can hold
+     */
+    static size_t max_avl(size_t height) {
+        return height >= 8 * sizeof(size_t) ? SIZE_MAX
+                                             : (size_t(1) << height) - 1;
+    }
+
+    /**
+     * @brief how far n elements are from filling height levels too
+     * sparsely or too densely, as a ratio; higher leaves the subtree
+     * more freedom in where it puts its heads
+     */
+    static double slack(size_t n, size_t height) {
+        if (n == 0) {
+            return height == 0 ? 1.0 : 0.0;
+        }
+        return std::min(static_cast<double>(n) / min_avl(height),
+                        static_cast<double>(max_avl(height)) / n);
+    }
+
+    /**
+     * @brief the left-subtree size nearest to want for a head over n
+     * elements exactly height levels high
+     *
+     * Sets left_height and right_height to the child heights that size
+     * needs, and returns how far it is from want, or SIZE_MAX if no
+     * AVL tree of that height holds n elements.
+     */
+    static size_t avl_split(size_t n, size_t height, size_t want,
+                            size_t& left, size_t& left_height,
+                            size_t& right_height);
+
+    /**
+     * @brief build a perfectly balanced subtree from the next n elements
+     */
+    template<typename Iter>
+    static Option<Tree<T>> from_sorted(Iter& it, size_t n, uint64_t generation) {
+        if (n == 0) {
+            return None<Tree<T>>();
+        }
+        Option<Tree<T>> left = from_sorted(it, n / 2, generation);
+        const T node = *it;
+        ++it;
+        Option<Tree<T>> right = from_sorted(it, n - n / 2 - 1, generation);
+        return Some(std::make_shared<Tree<T>>(Internal(), generation,
+                                              node, left, right));
+    }
 };
 
 
@@ -351,14 +655,12 @@ private:
  * @brief return the tree size of a tree wrapped in an Option type
  */
 template<typename T>
-size_t tree_size(const Option<Tree<T>> tree)
+size_t tree_size(const Option<Tree<T>>& tree)
 {
     if (tree.is_none()) {
         return 0;
     } else {
-        return tree_size(tree->left()) +
-               1 +
-               tree_size(tree->right());
+        return tree->size();
     }
 }
 
@@ -367,14 +669,54 @@ size_t tree_size(const Option<Tree<T>> tree)
  * @brief return the tree height of a tree wrapped in an Option type
  */
 template<typename T>
-size_t tree_height(const Option<Tree<T>> tree)
+size_t tree_height(const Option<Tree<T>>& tree)
 {
     if (tree.is_none()) {
         return 0;
     } else {
-        return std::max(tree_height(tree->left()),
-                        tree_height(tree->right())) + 1;
+        return tree->height();
+    }
+}
+
+
+
+
+/**
+ * @brief return the newest generation in a tree wrapped in an Option type
+ */
+template<typename T>
+uint64_t tree_max_generation(const Option<Tree<T>>& tree)
+{
+    if (tree.is_none()) {
+        return 0;
+    } else {
+        return tree->max_generation();
+    }
+}
+
+
+/**
+ * @brief return the values of every node created after generation g
+ *
+ * Only subtrees holding a node newer than g are entered, so this costs
+ * O(changes * log n) rather than O(n). A node is created by an update
+ * when it holds a new value and also when it is copied on the path to
+ * one, so ancestors of changed values are reported too.
+ * Values are returned in order.
+ */
+template<typename T>
+std::list<T> changed_since(const Option<Tree<T>>& tree, uint64_t g)
+{
+    std::list<T> l;
+    if (tree.is_none() || tree->max_generation() <= g) {
+        return l;
+    }
+    l.splice(l.end(), changed_since(tree->left(), g));
+    if (tree->generation() > g) {
+        l.push_back(tree->deref());
     }
+    l.splice(l.end(), changed_since(tree->right(), g));
+    return l;
 }
 
 
@@ -385,9 +727,10 @@ Tree<T>::Tree(const Tree<T>& head) :
     m_node(*head),
     m_child_left(head.m_child_left),
     m_child_right(head.m_child_right),
-    m_size(tree_size(head.m_child_left) + 1 + tree_size(head.m_child_right)),
-    m_height(std::max(tree_height(head.m_child_left),
-                      tree_height(head.m_child_right)) + 1)
+    m_size(head.m_size),
+    m_height(head.m_height),
+    m_generation(head.m_generation),
+    m_max_generation(head.m_max_generation)
 {};
 
 
@@ -395,7 +738,9 @@ template<typename T>
 Tree<T>::Tree(const T node) :
     m_node(node),
     m_size(1),
-    m_height(1)
+    m_height(1),
+    m_generation(next_generation()),
+    m_max_generation(m_generation)
 {};
 
 
@@ -444,190 +789,648 @@ bool Tree<T>::contains(const T& val) const
 }
 
 
-
 template<typename T>
-Tree<T> Tree<T>::insert(const T node) const
+const T* Tree<T>::find(const T& val) const
 {
-    if (m_node > node) {
-        // left
-        if (m_child_left.is_none()) {
-            // empty left side, at a leaf: do the insertion here
-            return Tree<T>(m_node,
-                           Some(Tree<T>(node)),
-                           m_child_right).balance();
+    const Tree<T>* node = this;
+    while (node != NULL) {
+        if (node->m_node == val) {
+            return &node->m_node;
+        } else if (node->m_node > val) {
+            node = node->m_child_left.is_some()
+                 ? node->m_child_left.operator->() : NULL;
         } else {
-            // non-empty left side, continue recursing to a leaf
-            std::shared_ptr<Tree<T>> lchld = m_child_left.get_ref();
-            return Tree<T>(m_node,
-                           Some(lchld->insert(node)),
-                           m_child_right).balance();
-        }
-    } else {
-        // right
-        if (m_child_right.is_none()) {
-            // empty right side, at a leaf: do the insertion here
-            return Tree<T>(m_node,
-                           m_child_left,
-                           Some(Tree<T>(node))).balance();
-        } else {
-            // non-empty right side, continue recursing to a leaf
-            std::shared_ptr<Tree<T>> rchld = m_child_right.get_ref();
-            return Tree<T>(m_node,
-                           m_child_left,
-                           rchld->insert(node)).balance();
+            node = node->m_child_right.is_some()
+                 ? node->m_child_right.operator->() : NULL;
         }
     }
+    return NULL;
 }
 
 
 template<typename T>
-const Option<Tree<T>> Tree<T>::remove(const T& node) const
+const T* Tree<T>::floor(const T& val) const
 {
-    if (m_node == node) {
-        return removeThisNode();
-    } else if (m_node > node) {
-        // go left to find the node to remove
-        if (m_child_left.is_none()) {
-            // oops, node doesn't exist in the tree!
-            // don't throw an error, just act normal
-            return Some(*this);
-        } else {
-            // continue recursing to the left
-            Tree<T> head(m_node,
-                         m_child_left->remove(node),
-                         m_child_right);
-            return Some(head.balance());
-        }
+    if (m_node > val) {
+        return m_child_left.is_some() ? m_child_left->floor(val) : NULL;
+    } else if (m_node == val || m_child_right.is_none()) {
+        return &m_node;
     } else {
-        // go right to find the node to remove
-        if (m_child_right.is_none()) {
-            // oops, node doesn't exist in the tree!
-            // don't throw an error, you didn't see nuthin
-            return Some(*this);
-        } else {
-            // continue recursing to the right
-            Tree<T> head(m_node,
-                         m_child_left,
-                         m_child_right->remove(node));
-            return Some(head.balance());
-        }
+        const T* right = m_child_right->floor(val);
+        return right != NULL ? right : &m_node;
     }
 }
 
 
 template<typename T>
-const Tree<T> Tree<T>::balance() const
+const T* Tree<T>::ceiling(const T& val) const
 {
-    if (tree_height(m_child_left) > tree_height(m_child_right) + 1) {
-        // left contains too many nodes. Rebalance
-        return rotRight();
-    }
-    if (tree_height(m_child_right) > tree_height(m_child_left) + 1) {
-        // right contains too many nodes. Rebalance
-        return rotLeft();
+    if (m_node == val) {
+        // an equal element to the left would come first
+        const T* left = m_child_left.is_some() ? m_child_left->ceiling(val)
+                                               : NULL;
+        return (left != NULL && *left == val) ? left : &m_node;
+    } else if (m_node > val) {
+        const T* left = m_child_left.is_some() ? m_child_left->ceiling(val)
+                                               : NULL;
+        return left != NULL ? left : &m_node;
+    } else {
+        return m_child_right.is_some() ? m_child_right->ceiling(val) : NULL;
     }
-    return *this;
 }
 
 
-// Private methods
-
-
 template<typename T>
-const Option<Tree<T>> Tree<T>::removeThisNode() const
+const T& Tree<T>::nth(size_t index) const
 {
-    // remove this node
-    if (is_leaf()) {
-        // Has neither left side or right side,
-        // so the node can be safely removed
-        return None<Tree<T>>();
-    } else if (m_child_left.is_some()) {
-        // At least has a left side.
-        // Use maximum from left side to replace this node
-        Option<Tree<T>> max_node = None<Tree<T>>();
-        Option<Tree<T>> lchld = m_child_left->popMax(max_node);
-        // max_node gets our children
-        return Some(Tree<T>(max_node->deref(),
-                            lchld,
-                            m_child_right));
+    size_t left_size = tree_size(m_child_left);
+    if (index < left_size) {
+        return m_child_left->nth(index);
+    } else if (index == left_size) {
+        return m_node;
+    } else if (m_child_right.is_some()) {
+        return m_child_right->nth(index - left_size - 1);
     } else {
-        // At least has a right side.
-        // Use minimum from right side to replace this node
-        Option<Tree<T>> min_node = None<Tree<T>>();
-        Option<Tree<T>> rchld = m_child_right->popMin(min_node);
-        // min_node gets our children
-        return Some(Tree<T>(min_node->deref(),
-                            m_child_left,
-                            rchld));
+        throw std::out_of_range("tree index out of range");
     }
 }
 
 
 template<typename T>
-const Option<Tree<T>> Tree<T>::popMin(Option<Tree<T>>& min_node) const
+size_t Tree<T>::rank(const T& val) const
 {
-    if (m_child_left.is_some()) {
-        return Some(Tree<T>(m_node,
-                            m_child_left->popMin(min_node),
-                            m_child_right));
+    if (m_node > val || m_node == val) {
+        // everything less than val is to the left
+        return m_child_left.is_some() ? m_child_left->rank(val) : 0;
     } else {
-        // this is the min node
-        min_node = Some(*this);
-        return m_child_right;
+        // this node and everything to its left is less than val
+        size_t less = tree_size(m_child_left) + 1;
+        if (m_child_right.is_some()) {
+            less += m_child_right->rank(val);
+        }
+        return less;
     }
 }
 
 
+
 template<typename T>
-const Option<Tree<T>> Tree<T>::popMax(Option<Tree<T>>& max_node) const
+Tree<T> Tree<T>::insert(const T node) const
 {
-    if (m_child_right.is_some()) {
-        return Some(Tree<T>(m_node,
-                            m_child_left,
-                            m_child_right->popMax(max_node)));
-    } else {
-        // this is the max node
-        max_node = Some(*this);
-        return m_child_left;
+    Scratch scratch;
+    return scratch.build_root(scratch.insert(Sub::of(*this), node));
+}
+
+
+template<typename T>
+const Option<Tree<T>> Tree<T>::remove(const T& node) const
+{
+    Scratch scratch;
+    bool found = false;
+    Sub head = scratch.remove(Sub::of(*this), node, found);
+    if (!found) {
+        // oops, node doesn't exist in the tree!
+        // don't throw an error, just act normal
+        return Some(*this);
     }
+    return scratch.build(head);
 }
 
 
+template<typename T>
+Tree<T> Tree<T>::replace(const T& old_node, const T new_node) const
+{
+    Scratch scratch;
+    return scratch.build_root(scratch.replace(Sub::of(*this),
+                                              old_node,
+                                              new_node));
+}
+
 
 template<typename T>
-const Tree<T> Tree<T>::rotLeft() const
+Tree<T> Tree<T>::reshape_by_weights(const std::vector<double>& weights) const
 {
-    // swap head->right and right->left. Right becomes root
-    Option<Tree<T>> rchld = m_child_right;
-    if (rchld.is_none()) {
-        // if we're rotating left, the right node should NOT be None.
-        // we'll handle it gracefully, and not do the rotation.
-        return *this;
+    if (weights.size() != m_size) {
+        throw std::invalid_argument("one weight is needed per element");
+    }
+    TREE_TRACE_SCOPE(trace, "Tree::reshape_by_weights");
+    TREE_TRACE_COUNT(trace, m_size, m_size * sizeof(Tree<T>));
+    std::vector<const T*> nodes;
+    nodes.reserve(m_size);
+    for_each([&nodes](const T& node) { nodes.push_back(&node); });
+    std::vector<double> prefix(1, 0.0);
+    prefix.reserve(m_size + 1);
+    for (size_t i=0; i < m_size; ++i) {
+        if (!(weights[i] >= 0)) {
+            throw std::invalid_argument("weights must not be negative");
+        }
+        prefix.push_back(prefix.back() + weights[i]);
     }
-    Option<Tree<T>> rleft = rchld->left();
-    Tree<T> new_head = Tree<T>(m_node, m_child_left, rleft);
-    Tree<T> new_right = Tree<T>(rchld->m_node, new_head, rchld->right());
-    return new_right;
+    // the height whose head can sit nearest the weighted median
+    double half = prefix[m_size] / 2;
+    size_t want = prefix[m_size] > 0
+        ? std::lower_bound(prefix.begin() + 1, prefix.end(), half)
+              - prefix.begin() - 1
+        : m_size / 2;
+    size_t height = 0;
+    size_t best = SIZE_MAX;
+    for (size_t h = 1; min_avl(h) <= m_size; ++h) {
+        size_t left, left_height, right_height;
+        size_t distance = avl_split(m_size, h, want,
+                                    left, left_height, right_height);
+        if (distance < best ||
+            (distance == best && slack(m_size, h) > slack(m_size, height))) {
+            best = distance;
+            height = h;
+        }
+    }
+    return weighted(nodes, prefix, 0, m_size, height,
+                    next_generation()).get_bare();
 }
 
 
 template<typename T>
-const Tree<T> Tree<T>::rotRight() const
+Option<Tree<T>> Tree<T>::weighted(const std::vector<const T*>& nodes,
+                                  const std::vector<double>& prefix,
+                                  size_t lo,
+                                  size_t hi,
+                                  size_t height,
+                                  uint64_t generation)
 {
-    // swap head->left and left->right. Left becomes root
-    Option<Tree<T>> lchld = m_child_left;
-    if (lchld.is_none()) {
-        // if we're rotating right, the left node should NOT be None.
-        // we'll handle it gracefully, and not do the rotation.
-        return *this;
+    if (lo == hi) {
+        return None<Tree<T>>();
+    }
+    size_t want = (hi - lo) / 2;
+    if (prefix[hi] > prefix[lo]) {
+        // the first element whose weight reaches the middle
+        double half = (prefix[lo] + prefix[hi]) / 2;
+        want = std::lower_bound(prefix.begin() + lo + 1,
+                                prefix.begin() + hi,
+                                half) - prefix.begin() - 1 - lo;
     }
-    Option<Tree<T>> lright = lchld->right();
-    Tree<T> new_head = Tree<T>(m_node, lright, m_child_right);
-    Tree<T> new_left = Tree<T>(lchld->m_node, lchld->left(), new_head);
-    return new_left;
+    size_t left, left_height, right_height;
+    avl_split(hi - lo, height, want, left, left_height, right_height);
+    size_t head = lo + left;
+    Option<Tree<T>> left_tree = weighted(nodes, prefix, lo, head,
+                                         left_height, generation);
+    Option<Tree<T>> right_tree = weighted(nodes, prefix, head + 1, hi,
+                                          right_height, generation);
+    return Some(std::make_shared<Tree<T>>(Internal(), generation,
+                                          *nodes[head], left_tree, right_tree));
 }
 
 
+template<typename T>
+size_t Tree<T>::avl_split(size_t n, size_t height, size_t want,
+                          size_t& left, size_t& left_height,
+                          size_t& right_height)
+{
+    size_t best = SIZE_MAX;
+    if (height == 0) {
+        return best;
+    }
+    // (left, right) child heights: even, or either side one taller
+    const size_t shapes[3][2] = { { height - 1, height - 1 },
+                                  { height - 1, height - 2 },
+                                  { height - 2, height - 1 } };
+    for (size_t i=0; i < 3; ++i) {
+        size_t hl = shapes[i][0];
+        size_t hr = shapes[i][1];
+        if (height < 2 && i > 0) {
+            break;
+        }
+        // left must fit hl, and the n - 1 - left on the right must fit hr
+        size_t rest = n - 1;
+        size_t first = std::max(min_avl(hl),
+                                rest > max_avl(hr) ? rest - max_avl(hr) : 0);
+        if (min_avl(hr) > rest) {
+            continue;
+        }
+        size_t last = std::min(max_avl(hl), rest - min_avl(hr));
+        if (first > last) {
+            continue;
+        }
+        size_t at = std::min(std::max(want, first), last);
+        size_t distance = at > want ? at - want : want - at;
+        if (distance < best ||
+            (distance == best &&
+             std::min(slack(at, hl), slack(rest - at, hr)) >
+             std::min(slack(left, left_height),
+                      slack(rest - left, right_height)))) {
+            best = distance;
+            left = at;
+            left_height = hl;
+            right_height = hr;
+        }
+    }
+    return best;
+}
+
+
+template<typename T>
+Tree<T> Tree<T>::join(const Option<Tree<T>>& left,
+                      const T& node,
+                      const Option<Tree<T>>& right)
+{
+    Scratch scratch;
+    return scratch.build_root(scratch.join(Sub::of(left), &node,
+                                           Sub::of(right)));
+}
+
+
+template<typename T>
+const Tree<T> Tree<T>::balance() const
+{
+    Scratch scratch;
+    return scratch.build_root(scratch.balance(&m_node,
+                                              Sub::of(m_child_left),
+                                              Sub::of(m_child_right)));
+}
+
+
+
+/**
+ * @brief Planning area for a single insert, remove or replace
+ *
+ * Updates walk the tree and record the nodes they would create as frames
+ * instead of building them. Rebalancing rearranges frames, abandoning
+ * the ones a rotation takes apart, so by the time the update finishes
+ * only frames that belong to the new version are still reachable from
+ * its head. Those are the only ones turned into nodes by build(), which
+ * makes every level of the copied path cost exactly the nodes that
+ * survive.
+ *
+ * The frames live on the stack. An AVL tree addressable by size_t is
+ * less than 96 levels deep, and an update uses at most a handful of
+ * frames per level.
+ */
+template<typename T>
+class Tree<T>::Scratch
+{
+public:
+    Scratch() : m_generation(next_generation()), m_used(0) {};
+
+    inline bool is_none(const Sub& s) const {
+        return s.frame < 0 && s.node == NULL;
+    }
+
+    inline size_t height(const Sub& s) const {
+        if (s.frame >= 0) {
+            return m_frames[s.frame].height;
+        }
+        return s.node == NULL ? 0 : s.node->m_height;
+    }
+
+    inline size_t size(const Sub& s) const {
+        if (s.frame >= 0) {
+            return m_frames[s.frame].size;
+        }
+        return s.node == NULL ? 0 : s.node->m_size;
+    }
+
+    inline const T& value(const Sub& s) const {
+        if (s.frame >= 0) {
+            return *m_frames[s.frame].value;
+        }
+        return s.node->m_node;
+    }
+
+    inline Sub left(const Sub& s) const {
+        if (s.frame >= 0) {
+            return m_frames[s.frame].left;
+        }
+        return Sub::of(s.node->m_child_left);
+    }
+
+    inline Sub right(const Sub& s) const {
+        if (s.frame >= 0) {
+            return m_frames[s.frame].right;
+        }
+        return Sub::of(s.node->m_child_right);
+    }
+
+    /**
+     * @brief plan a new node holding value with the given children
+     */
+    Sub make(const T* value, const Sub& left, const Sub& right) {
+        if (m_used == max_frames) {
+            throw std::length_error("tree update too deep");
+        }
+        Frame& f = m_frames[m_used];
+        f.value = value;
+        f.left = left;
+        f.right = right;
+        f.size = size(left) + 1 + size(right);
+        f.height = std::max(height(left), height(right)) + 1;
+        return Sub::at(static_cast<int>(m_used++));
+    }
+
+    /**
+     * @brief plan a new node, rotating first if it would be out of balance
+     *
+     * The rotation is done on the planned children, so the node that
+     * would have been built and thrown away never exists.
+     */
+    Sub balance(const T* value, const Sub& left, const Sub& right) {
+        size_t left_height = height(left);
+        size_t right_height = height(right);
+        if (left_height > right_height + 1) {
+            Sub outer = this->left(left);
+            Sub inner = this->right(left);
+            if (height(outer) >= height(inner)) {
+                //     H -->   L
+                //    L  -->  B H
+                //   B   -->
+                return make(&this->value(left),
+                            outer,
+                            make(value, inner, right));
+            }
+            // left-right case: the inner grandchild becomes the head
+            return make(&this->value(inner),
+                        make(&this->value(left), outer, this->left(inner)),
+                        make(value, this->right(inner), right));
+        }
+        if (right_height > left_height + 1) {
+            Sub outer = this->right(right);
+            Sub inner = this->left(right);
+            if (height(outer) >= height(inner)) {
+                //   H   -->   R
+                //    R  -->  H B
+                //     B -->
+                return make(&this->value(right),
+                            make(value, left, inner),
+                            outer);
+            }
+            // right-left case: the inner grandchild becomes the head
+            return make(&this->value(inner),
+                        make(value, left, this->left(inner)),
+                        make(&this->value(right), this->right(inner), outer));
+        }
+        return make(value, left, right);
+    }
+
+    /**
+     * @brief plan inserting node into the subtree at
+     */
+    Sub insert(const Sub& at, const T& node) {
+        if (is_none(at)) {
+            return make(&node, Sub::none(), Sub::none());
+        } else if (value(at) > node) {
+            return balance(&value(at), insert(left(at), node), right(at));
+        } else {
+            return balance(&value(at), left(at), insert(right(at), node));
+        }
+    }
+
+    /**
+     * @brief plan removing node from the subtree at
+     *
+     * @param[out] found set to true if node was in the subtree. If it
+     * was not, at is returned and no frames are used.
+     */
+    Sub remove(const Sub& at, const T& node, bool& found) {
+        if (is_none(at)) {
+            return at;
+        } else if (value(at) == node) {
+            found = true;
+            return removeHead(at);
+        } else if (value(at) > node) {
+            Sub lchld = remove(left(at), node, found);
+            return found ? balance(&value(at), lchld, right(at)) : at;
+        } else {
+            Sub rchld = remove(right(at), node, found);
+            return found ? balance(&value(at), left(at), rchld) : at;
+        }
+    }
+
+    /**
+     * @brief plan replacing old_node with new_node in the subtree at
+     *
+     * Follows old_node and new_node down together while they go the
+     * same way. Where they part, old_node is removed from one side and
+     * new_node inserted into the other, under a single copied node.
+     */
+    Sub replace(const Sub& at, const T& old_node, const T& new_node) {
+        if (is_none(at)) {
+            // old_node isn't here; new_node still goes in
+            return insert(at, new_node);
+        } else if (value(at) == old_node) {
+            return replaceHead(at, new_node);
+        }
+        bool old_left = value(at) > old_node;
+        bool new_left = value(at) > new_node;
+        if (old_left && new_left) {
+            return balance(&value(at),
+                           replace(left(at), old_node, new_node),
+                           right(at));
+        } else if (!old_left && !new_left) {
+            return balance(&value(at),
+                           left(at),
+                           replace(right(at), old_node, new_node));
+        }
+        bool found = false;
+        if (old_left) {
+            Sub lchld = remove(left(at), old_node, found);
+            return balance(&value(at), lchld, insert(right(at), new_node));
+        } else {
+            Sub rchld = remove(right(at), old_node, found);
+            return balance(&value(at), insert(left(at), new_node), rchld);
+        }
+    }
+
+    /**
+     * @brief plan replacing the head of at with node
+     *
+     * Every ancestor sent node the same way as the old head, so node
+     * belongs in this subtree; if it also sorts between the head's
+     * children, the head is simply rewritten.
+     */
+    Sub replaceHead(const Sub& at, const T& node) {
+        const T* below = max_value(left(at));
+        const T* above = min_value(right(at));
+        if ((below == NULL || !(*below > node)) &&
+            (above == NULL || !(node > *above))) {
+            return make(&node, left(at), right(at));
+        }
+        return insert(removeHead(at), node);
+    }
+
+    /**
+     * @brief the least value in a subtree, or NULL if it is empty
+     */
+    const T* min_value(Sub at) const {
+        const T* min_node = NULL;
+        for (; !is_none(at); at = left(at)) {
+            min_node = &value(at);
+        }
+        return min_node;
+    }
+
+    /**
+     * @brief the greatest value in a subtree, or NULL if it is empty
+     */
+    const T* max_value(Sub at) const {
+        const T* max_node = NULL;
+        for (; !is_none(at); at = right(at)) {
+            max_node = &value(at);
+        }
+        return max_node;
+    }
+
+    /**
+     * @brief plan removing the head of at, preserving any children
+     */
+    Sub removeHead(const Sub& at) {
+        Sub lchld = left(at);
+        Sub rchld = right(at);
+        if (is_none(lchld) && is_none(rchld)) {
+            return Sub::none();
+        } else if (!is_none(lchld)) {
+            // Use maximum from left side to replace this node
+            const T* max_node = NULL;
+            Sub rest = popMax(lchld, max_node);
+            return balance(max_node, rest, rchld);
+        } else {
+            // Use minimum from right side to replace this node
+            const T* min_node = NULL;
+            Sub rest = popMin(rchld, min_node);
+            return balance(min_node, lchld, rest);
+        }
+    }
+
+    /**
+     * @brief plan removing the minimum of a non-empty subtree
+     *
+     * @param[out] min_node the minimum value that was removed
+     */
+    Sub popMin(const Sub& at, const T*& min_node) {
+        if (is_none(left(at))) {
+            min_node = &value(at);
+            return right(at);
+        }
+        return balance(&value(at), popMin(left(at), min_node), right(at));
+    }
+
+    /**
+     * @brief plan removing the maximum of a non-empty subtree
+     *
+     * @param[out] max_node the maximum value that was removed
+     */
+    Sub popMax(const Sub& at, const T*& max_node) {
+        if (is_none(right(at))) {
+            max_node = &value(at);
+            return left(at);
+        }
+        return balance(&value(at), left(at), popMax(right(at), max_node));
+    }
+
+    /**
+     * @brief plan joining lchld, value and rchld into one subtree
+     *
+     * Descends the taller side's inner spine until the heights are
+     * within one, plants the new node there and rebalances on the way
+     * back up.
+     */
+    Sub join(const Sub& lchld, const T* value, const Sub& rchld) {
+        size_t left_height = height(lchld);
+        size_t right_height = height(rchld);
+        if (left_height > right_height + 1) {
+            return balance(&this->value(lchld),
+                           left(lchld),
+                           join(right(lchld), value, rchld));
+        } else if (right_height > left_height + 1) {
+            return balance(&this->value(rchld),
+                           join(lchld, value, left(rchld)),
+                           right(rchld));
+        }
+        return make(value, lchld, rchld);
+    }
+
+    /**
+     * @brief number of frames that build() will turn into nodes
+     */
+    size_t pending(const Sub& s) const {
+        if (s.frame < 0) {
+            return 0;
+        }
+        const Frame& f = m_frames[s.frame];
+        return 1 + pending(f.left) + pending(f.right);
+    }
+
+    /**
+     * @brief turn a planned subtree into nodes, sharing existing ones
+     */
+    Option<Tree<T>> build(const Sub& s) const {
+        return build(s, std::allocator<Tree<T>>());
+    }
+
+    /**
+     * @brief turn a planned subtree into nodes allocated with alloc
+     */
+    template<typename Alloc>
+    Option<Tree<T>> build(const Sub& s, const Alloc& alloc) const {
+        if (s.frame < 0) {
+            if (s.node == NULL) {
+                return None<Tree<T>>();
+            } else if (s.opt != NULL) {
+                return *s.opt;
+            } else {
+                return Some(std::allocate_shared<Tree<T>>(alloc, *s.node));
+            }
+        }
+        const Frame& f = m_frames[s.frame];
+#ifdef TREE_COUNT_NODES
+        ++nodes_built();
+#endif
+        return Some(std::allocate_shared<Tree<T>>(alloc,
+                                                  Internal(),
+                                                  m_generation,
+                                                  *f.value,
+                                                  build(f.left, alloc),
+                                                  build(f.right, alloc)));
+    }
+
+    /**
+     * @brief turn a planned, non-empty tree into a head node by value
+     */
+    Tree<T> build_root(const Sub& s) const {
+        if (s.frame < 0) {
+            return Tree<T>(*s.node);
+        }
+        const Frame& f = m_frames[s.frame];
+#ifdef TREE_COUNT_NODES
+        ++nodes_built();
+#endif
+        return Tree<T>(Internal(), m_generation, *f.value,
+                       build(f.left), build(f.right));
+    }
+
+private:
+
+    /**
+     * @brief a node that has been planned but not built
+     */
+    struct Frame
+    {
+        const T* value;
+        Sub left;
+        Sub right;
+        size_t size;
+        size_t height;
+    };
+
+    /// upper bound on frames a single update can use
+    static const size_t max_frames = 512;
+
+    /// generation stamped on every node this update builds
+    const uint64_t m_generation;
+
+    Frame m_frames[max_frames];
+
+    size_t m_used;
+};
+
+
 
 
 
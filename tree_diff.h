@@ -0,0 +1,238 @@
+/**
+ * @file
+ * @brief Differences between two versions of a tree
+ *
+ * Contains a cursor that walks two versions of a Tree side by side in
+ * order and reports the elements only one of them has. Subtrees that
+ * the versions share are recognised by identity and skipped whole, so
+ * the cost follows the number of changes between the versions, not
+ * their size.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <vector>   // explicit stacks
+
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief Cursor over the differences between two versions of a tree
+ *
+ * Each side is kept as a stack of what remains of it in order: whole
+ * subtrees not yet looked into, and single elements. When both sides
+ * next hold the same subtree it is dropped from both; otherwise the
+ * taller subtree is opened up. Versions made from one another by path
+ * copying line their shared subtrees up this way, so only the nodes
+ * around each change are opened.
+ *
+ * Changes come out in ascending order. Elements that compare equal are
+ * taken to be unchanged, even when held in different nodes.
+ *
+ * The cursor keeps both versions alive until it is destroyed.
+ */
+template<typename T>
+class TreeDiff
+{
+public:
+    /**
+     * @brief which version a changed element is in
+     */
+    enum Kind { REMOVED, ADDED };
+
+    /**
+     * @brief an element in one version but not the other
+     */
+    struct Change
+    {
+        Kind kind;
+
+        /// the element, valid for as long as the cursor is
+        const T* value;
+    };
+
+    /**
+     * @brief starts a diff from version from to version to, either of
+     * which may be None
+     */
+    TreeDiff(const Option<Tree<T>>& from, const Option<Tree<T>>& to) :
+        m_from_root(from),
+        m_to_root(to),
+        m_opened(0)
+    {
+        push(m_from, from.is_some() ? from.operator->() : NULL);
+        push(m_to, to.is_some() ? to.operator->() : NULL);
+    };
+
+    /**
+     * @brief moves to the next change, returning false once there are
+     * none left
+     */
+    bool next(Change& change);
+
+    /**
+     * @brief moves to the next change, opening at most budget subtrees
+     * on the way and taking the ones it opens off budget
+     *
+     * Returns false, with change unset, if there are no changes left or
+     * the budget ran out first; done() tells the two apart. A later call
+     * carries on from where this one stopped.
+     */
+    bool next(Change& change, size_t& budget);
+
+    /**
+     * @brief returns True once every change has been returned
+     */
+    bool done() const { return m_from.empty() && m_to.empty(); }
+
+    /**
+     * @brief returns the number of subtrees opened up so far
+     */
+    inline size_t opened() const { return m_opened; };
+
+private:
+
+    /**
+     * @brief a whole subtree, or just the element at its head
+     */
+    struct Item
+    {
+        const Tree<T>* node;
+        bool single;
+    };
+
+    typedef std::vector<Item> Stack;
+
+    static void push(Stack& stack, const Tree<T>* node, bool single = false) {
+        if (node != NULL) {
+            Item item = { node, single };
+            stack.push_back(item);
+        }
+    }
+
+    /**
+     * @brief replace the subtree on top of stack by its parts, in order,
+     * returning false instead if budget is spent
+     */
+    bool open(Stack& stack, size_t& budget) {
+        if (budget == 0) {
+            return false;
+        }
+        --budget;
+        const Tree<T>* node = stack.back().node;
+        stack.pop_back();
+        push(stack, node->right_node());
+        push(stack, node, true);
+        push(stack, node->left_node());
+        ++m_opened;
+        return true;
+    }
+
+    /// the versions, pinned while the cursor walks them
+    const Option<Tree<T>> m_from_root;
+    const Option<Tree<T>> m_to_root;
+
+    /// what remains of each version, next in order on top
+    Stack m_from;
+    Stack m_to;
+
+    /// subtrees opened so far
+    size_t m_opened;
+};
+
+
+
+template<typename T>
+bool TreeDiff<T>::next(Change& change)
+{
+    size_t unlimited = static_cast<size_t>(-1);
+    return next(change, unlimited);
+}
+
+
+template<typename T>
+bool TreeDiff<T>::next(Change& change, size_t& budget)
+{
+    for (;;) {
+        if (m_from.empty() || m_to.empty()) {
+            Stack& rest = m_from.empty() ? m_to : m_from;
+            if (rest.empty()) {
+                return false;
+            }
+            if (!rest.back().single) {
+                if (!open(rest, budget)) {
+                    return false;
+                }
+                continue;
+            }
+            change.kind = m_from.empty() ? ADDED : REMOVED;
+            change.value = &rest.back().node->deref();
+            rest.pop_back();
+            return true;
+        }
+        const Item& a = m_from.back();
+        const Item& b = m_to.back();
+        if (!a.single && !b.single) {
+            if (a.node == b.node) {
+                // shared by both versions
+                m_from.pop_back();
+                m_to.pop_back();
+                continue;
+            }
+            size_t a_height = a.node->height();
+            size_t b_height = b.node->height();
+            if (a_height >= b_height && !open(m_from, budget)) {
+                return false;
+            }
+            if (b_height >= a_height && !open(m_to, budget)) {
+                return false;
+            }
+            continue;
+        }
+        if (!a.single) {
+            if (!open(m_from, budget)) {
+                return false;
+            }
+            continue;
+        }
+        if (!b.single) {
+            if (!open(m_to, budget)) {
+                return false;
+            }
+            continue;
+        }
+        const T& from = a.node->deref();
+        const T& to = b.node->deref();
+        if (from == to) {
+            m_from.pop_back();
+            m_to.pop_back();
+        } else if (to > from) {
+            change.kind = REMOVED;
+            change.value = &from;
+            m_from.pop_back();
+            return true;
+        } else {
+            change.kind = ADDED;
+            change.value = &to;
+            m_to.pop_back();
+            return true;
+        }
+    }
+}
@@ -0,0 +1,518 @@
+/**
+ * @file
+ * @brief Resumable, budgeted versions of long-running tree operations
+ *
+ * Contains bulk builds, compaction, set operations, diffs and
+ * serialisation of trees as tasks that do their work in steps: each
+ * step does at most a given number of node operations, or runs for at
+ * most a given time, and then returns with the task's state kept for
+ * the next step. A thread that has to stay responsive, such as an event
+ * loop, can run a large operation a slice at a time between requests,
+ * watch its progress, and cancel it.
+ *
+ * A task holds on to the versions it reads, so they stay valid however
+ * long it is left between steps.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>       // steady_clock
+#include <ostream>
+#include <stdexcept>    // runtime_error
+#include <stdint.h>
+#include <type_traits>  // is_trivially_copyable
+#include <vector>
+
+#include "append_tree.h"
+#include "option.h"
+#include "trace.h"
+#include "tree.h"
+#include "tree_diff.h"
+
+/**
+ * @brief A long operation that can be run a step at a time
+ *
+ * Work is measured in node operations: an element read, compared or
+ * written. Steps are not safe to run from two threads at once, but
+ * cancel() may be called from any thread.
+ */
+class TreeTask
+{
+public:
+    virtual ~TreeTask() {};
+
+    /**
+     * @brief does up to budget node operations
+     *
+     * Returns True once the task has finished, whether because it is
+     * done or because it was cancelled; further steps do nothing.
+     */
+    bool step(size_t budget) {
+        if (!finished()) {
+            TREE_TRACE_SCOPE(trace, "TreeTask::step");
+            size_t before = progress();
+            m_done = run(budget);
+            TREE_TRACE_COUNT(trace, progress() - before, 0);
+        }
+        return finished();
+    }
+
+    /**
+     * @brief runs steps of grain node operations until the task finishes
+     * or limit has passed
+     *
+     * The step under way when limit passes is completed, so limit can be
+     * overrun by one step. Returns True once the task has finished.
+     */
+    bool run_for(std::chrono::microseconds limit, size_t grain = 1024) {
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + limit;
+        while (!step(grain) && std::chrono::steady_clock::now() < deadline) {
+        }
+        return finished();
+    }
+
+    /**
+     * @brief runs the task to the end
+     */
+    void run_all() {
+        while (!step(SIZE_MAX)) {
+        }
+    }
+
+    /**
+     * @brief asks the task to stop; it stops before its next step
+     */
+    void cancel() { m_cancelled.store(true); }
+
+    /**
+     * @brief returns True if the task was cancelled
+     */
+    bool cancelled() const { return m_cancelled.load(); }
+
+    /**
+     * @brief returns True if the task ran to the end
+     */
+    bool done() const { return m_done; }
+
+    /**
+     * @brief returns True if there is nothing more for the task to do
+     */
+    bool finished() const { return m_done || cancelled(); }
+
+    /**
+     * @brief returns the node operations done so far
+     */
+    virtual size_t progress() const = 0;
+
+    /**
+     * @brief returns the most node operations the whole task can take
+     */
+    virtual size_t total() const = 0;
+
+protected:
+    TreeTask() :
+        m_done(false),
+        m_cancelled(false)
+    {};
+
+    /**
+     * @brief does up to budget node operations, returning True if that
+     * finished the task
+     */
+    virtual bool run(size_t budget) = 0;
+
+private:
+
+    /**
+     * @brief blocked copy constructor, not implemented
+     */
+    TreeTask(const TreeTask&);
+
+    /**
+     * @brief blocked copy assignment operator, not implemented
+     */
+    TreeTask& operator=(const TreeTask&);
+
+    bool m_done;
+    std::atomic<bool> m_cancelled;
+};
+
+
+/**
+ * @brief Resumable in-order walk of one version of a tree
+ *
+ * Holds the version until it is destroyed.
+ */
+template<typename T>
+class TreeCursor
+{
+public:
+    /**
+     * @brief starts at the least element of tree, which may be None
+     */
+    explicit TreeCursor(const Option<Tree<T>>& tree) :
+        m_tree(tree)
+    {
+        descend(tree.is_some() ? tree.operator->() : NULL);
+    };
+
+    /**
+     * @brief returns the current element, or NULL past the end
+     */
+    const T* get() const {
+        return m_stack.empty() ? NULL : &m_stack.back()->deref();
+    }
+
+    /**
+     * @brief moves to the next element; must not be past the end
+     */
+    void next() {
+        const Tree<T>* node = m_stack.back();
+        m_stack.pop_back();
+        descend(node->right_node());
+    }
+
+private:
+    void descend(const Tree<T>* node) {
+        for (; node != NULL; node = node->left_node()) {
+            m_stack.push_back(node);
+        }
+    }
+
+    /// the version walked
+    const Option<Tree<T>> m_tree;
+
+    /// the current node, under the ancestors still to be visited
+    std::vector<const Tree<T>*> m_stack;
+};
+
+
+/**
+ * @brief Builds a tree from a sorted vector
+ *
+ * Elements are appended to an AppendTree one per node operation, so a
+ * step builds O(1) nodes per element. The result is a balanced Tree.
+ */
+template<typename T>
+class BuildTask : public TreeTask
+{
+public:
+    /**
+     * @brief a task building a tree of elements, which should be in
+     * ascending order; the task keeps its own copy
+     */
+    explicit BuildTask(const std::vector<T>& elements) :
+        m_elements(elements),
+        m_next(0),
+        m_result(None<Tree<T>>())
+    {};
+
+    virtual size_t progress() const { return m_next; }
+    virtual size_t total() const { return m_elements.size(); }
+
+    /**
+     * @brief returns the tree built, or None until the task is done or
+     * if there were no elements
+     */
+    const Option<Tree<T>>& result() const { return m_result; }
+
+protected:
+    virtual bool run(size_t budget) {
+        for (; budget > 0 && m_next < m_elements.size(); --budget) {
+            m_built = m_built.insert(m_elements[m_next++]);
+        }
+        if (m_next < m_elements.size()) {
+            return false;
+        }
+        m_result = m_built.tree();
+        return true;
+    }
+
+private:
+    const std::vector<T> m_elements;
+    size_t m_next;
+    AppendTree<T> m_built;
+    Option<Tree<T>> m_result;
+};
+
+
+/**
+ * @brief Rebuilds one version of a tree into freshly allocated,
+ * balanced nodes
+ *
+ * Useful once a long-lived version has been updated enough that its
+ * nodes are scattered across memory and many generations.
+ */
+template<typename T>
+class CompactTask : public TreeTask
+{
+public:
+    explicit CompactTask(const Option<Tree<T>>& tree) :
+        m_cursor(tree),
+        m_total(tree_size(tree)),
+        m_copied(0),
+        m_result(None<Tree<T>>())
+    {};
+
+    virtual size_t progress() const { return m_copied; }
+    virtual size_t total() const { return m_total; }
+
+    /**
+     * @brief returns the compacted tree, or None until the task is done
+     * or if the tree was empty
+     */
+    const Option<Tree<T>>& result() const { return m_result; }
+
+protected:
+    virtual bool run(size_t budget) {
+        for (; budget > 0 && m_cursor.get() != NULL; --budget) {
+            m_built = m_built.insert(*m_cursor.get());
+            m_cursor.next();
+            ++m_copied;
+        }
+        if (m_cursor.get() != NULL) {
+            return false;
+        }
+        m_result = m_built.tree();
+        return true;
+    }
+
+private:
+    TreeCursor<T> m_cursor;
+    const size_t m_total;
+    size_t m_copied;
+    AppendTree<T> m_built;
+    Option<Tree<T>> m_result;
+};
+
+
+/**
+ * @brief set operations a SetOpTask can do
+ */
+enum SetOp { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE };
+
+
+/**
+ * @brief Union, intersection or difference of two versions
+ *
+ * Both are merged in order, as std::set_union and friends do, so
+ * elements held more than once are counted: the union holds the larger
+ * count of each, the intersection the smaller, and the difference what
+ * the first has beyond the second. Each unit of budget takes one
+ * element from one side, so progress() grows by at most the budget of
+ * a step; an element found in both takes two.
+ */
+template<typename T>
+class SetOpTask : public TreeTask
+{
+public:
+    SetOpTask(const Option<Tree<T>>& a, const Option<Tree<T>>& b, SetOp op) :
+        m_a(a),
+        m_b(b),
+        m_op(op),
+        m_total(tree_size(a) + tree_size(b)),
+        m_read(0),
+        m_matched(false),
+        m_result(None<Tree<T>>())
+    {};
+
+    virtual size_t progress() const { return m_read; }
+    virtual size_t total() const { return m_total; }
+
+    /**
+     * @brief returns the result, or None until the task is done or if
+     * the result is empty
+     */
+    const Option<Tree<T>>& result() const { return m_result; }
+
+protected:
+    virtual bool run(size_t budget);
+
+private:
+    TreeCursor<T> m_a;
+    TreeCursor<T> m_b;
+    const SetOp m_op;
+    const size_t m_total;
+
+    /// elements taken from either side so far
+    size_t m_read;
+
+    /// True if the next element of m_b matched the last taken from m_a
+    bool m_matched;
+
+    AppendTree<T> m_built;
+    Option<Tree<T>> m_result;
+};
+
+
+/**
+ * @brief Collects the differences between two versions
+ *
+ * Runs a TreeDiff, so only the nodes around each change are visited.
+ * The budget counts subtrees opened, which is also what progress()
+ * reports, so a step advances progress() by at most its budget however
+ * far apart the changes are; total() is the most work the diff could
+ * take.
+ */
+template<typename T>
+class DiffTask : public TreeTask
+{
+public:
+    DiffTask(const Option<Tree<T>>& from, const Option<Tree<T>>& to) :
+        m_diff(from, to),
+        m_total(tree_size(from) + tree_size(to))
+    {};
+
+    virtual size_t progress() const { return m_diff.opened(); }
+    virtual size_t total() const { return m_total; }
+
+    /**
+     * @brief returns the elements only in from, in ascending order
+     */
+    const std::vector<T>& removed() const { return m_removed; }
+
+    /**
+     * @brief returns the elements only in to, in ascending order
+     */
+    const std::vector<T>& added() const { return m_added; }
+
+protected:
+    virtual bool run(size_t budget) {
+        typename TreeDiff<T>::Change change;
+        while (m_diff.next(change, budget)) {
+            if (change.kind == TreeDiff<T>::REMOVED) {
+                m_removed.push_back(*change.value);
+            } else {
+                m_added.push_back(*change.value);
+            }
+        }
+        return m_diff.done();
+    }
+
+private:
+    TreeDiff<T> m_diff;
+    const size_t m_total;
+    std::vector<T> m_removed;
+    std::vector<T> m_added;
+};
+
+
+/**
+ * @brief Writes one version of a tree to a stream
+ *
+ * The format is the element count as a uint64_t, then the elements in
+ * ascending order, all as raw bytes; reading them back into a vector
+ * and running a BuildTask restores the tree. Throws std::runtime_error
+ * from a step if the stream fails.
+ */
+template<typename T>
+class SerializeTask : public TreeTask
+{
+public:
+    SerializeTask(const Option<Tree<T>>& tree, std::ostream& out) :
+        m_cursor(tree),
+        m_total(tree_size(tree)),
+        m_written(0),
+        m_out(out),
+        m_started(false)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "elements are written as raw bytes");
+    };
+
+    virtual size_t progress() const { return m_written; }
+    virtual size_t total() const { return m_total; }
+
+protected:
+    virtual bool run(size_t budget) {
+        if (!m_started) {
+            uint64_t count = m_total;
+            m_out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            m_started = true;
+        }
+        for (; budget > 0 && m_cursor.get() != NULL; --budget) {
+            m_out.write(reinterpret_cast<const char*>(m_cursor.get()),
+                        sizeof(T));
+            m_cursor.next();
+            ++m_written;
+        }
+        if (!m_out) {
+            throw std::runtime_error("could not write tree");
+        }
+        return m_cursor.get() == NULL;
+    }
+
+private:
+    TreeCursor<T> m_cursor;
+    const size_t m_total;
+    size_t m_written;
+    std::ostream& m_out;
+    bool m_started;
+};
+
+
+
+template<typename T>
+bool SetOpTask<T>::run(size_t budget)
+{
+    for (; budget > 0; --budget) {
+        if (m_matched) {
+            // already dealt with along with its match
+            m_b.next();
+            ++m_read;
+            m_matched = false;
+            continue;
+        }
+        const T* a = m_a.get();
+        const T* b = m_b.get();
+        if (a == NULL && b == NULL) {
+            break;
+        }
+        ++m_read;
+        if (b == NULL || (a != NULL && *b > *a)) {
+            // a only
+            if (m_op != SET_INTERSECTION) {
+                m_built = m_built.insert(*a);
+            }
+            m_a.next();
+        } else if (a == NULL || *a > *b) {
+            // b only
+            if (m_op == SET_UNION) {
+                m_built = m_built.insert(*b);
+            }
+            m_b.next();
+        } else {
+            // in both: kept once, or dropped by a difference; b's copy
+            // is taken with the next unit of budget
+            if (m_op != SET_DIFFERENCE) {
+                m_built = m_built.insert(*a);
+            }
+            m_a.next();
+            m_matched = true;
+        }
+    }
+    if (m_a.get() != NULL || m_b.get() != NULL) {
+        return false;
+    }
+    m_result = m_built.tree();
+    return true;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file
+ * @brief Sliding-window quantiles
+ *
+ * Contains a streaming quantile estimator over the last N samples of a
+ * stream. Samples are kept in a persistent multiset Tree, so adding or
+ * expiring a sample and answering any quantile are all O(log n), and
+ * readers on other threads can hold a snapshot of the window without
+ * locking it.
+ *
+ *
+ * Copyright (C) 2014  Vernon R. Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <cmath>    // ceil
+#include <stdexcept>
+#include <vector>   // ring of samples, in arrival order
+
+#include "atomic_root.h"
+#include "option.h"
+#include "tree.h"
+
+/**
+ * @brief return the q-quantile of the values in a tree
+ *
+ * Uses the nearest-rank definition: the smallest value with at least
+ * q * size() values less than or equal to it. q is clamped to [0, 1],
+ * and a NaN q is taken as 0.
+ */
+template<typename T>
+const T& tree_quantile(const Tree<T>& tree, double q)
+{
+    double rank = std::ceil(q * tree.size());
+    // written so that a NaN rank takes this branch too
+    if (!(rank >= 1)) {
+        return tree.nth(0);
+    } else if (rank >= tree.size()) {
+        return tree.nth(tree.size() - 1);
+    } else {
+        return tree.nth(static_cast<size_t>(rank) - 1);
+    }
+}
+
+
+/**
+ * @brief Quantiles over the last N samples of a stream
+ *
+ * One thread pushes samples. Any number of threads may call snapshot()
+ * at the same time, without locking (see AtomicRoot); a snapshot is an
+ * immutable Tree of the window as it was, and stays valid however far
+ * the window moves on.
+ */
+template<typename T>
+class WindowedQuantiles
+{
+public:
+    /**
+     * @brief creates an empty window holding at most window samples
+     */
+    explicit WindowedQuantiles(size_t window) :
+        m_window(window),
+        m_oldest(0)
+    {
+        if (window == 0) {
+            throw std::invalid_argument("window must hold a sample");
+        }
+        m_samples.reserve(window);
+    };
+
+    /**
+     * @brief adds a sample, expiring the oldest one if the window is full
+     */
+    void push(const T& sample);
+
+    /**
+     * @brief returns the number of samples in the window
+     */
+    inline size_t size() const { return m_samples.size(); };
+
+    /**
+     * @brief returns the q-quantile of the samples in the window
+     *
+     * @note throws an exception if the window is empty
+     */
+    T quantile(double q) const {
+        return tree_quantile(snapshot().get_bare(), q);
+    }
+
+    /**
+     * @brief returns the window as it is now, or None if it is empty
+     *
+     * Safe to call from any thread while samples are being pushed.
+     */
+    Option<Tree<T>> snapshot() const {
+        return m_root.load();
+    }
+
+private:
+
+    /**
+     * @brief blocked copy constructor, not implemented
+     */
+    WindowedQuantiles(const WindowedQuantiles<T>&);
+
+    /**
+     * @brief blocked copy assignment operator, not implemented
+     */
+    WindowedQuantiles<T>& operator=(const WindowedQuantiles<T>&);
+
+    /// maximum number of samples kept
+    const size_t m_window;
+
+    /// samples in the window, used as a ring once it is full
+    std::vector<T> m_samples;
+
+    /// index of the oldest sample in m_samples once it is full
+    size_t m_oldest;
+
+    /// the published window, None while empty
+    AtomicRoot<T> m_root;
+};
+
+
+
+template<typename T>
+void WindowedQuantiles<T>::push(const T& sample)
+{
+    Option<Tree<T>> root = m_root.load();
+    if (m_samples.size() == m_window) {
+        root = root->remove(m_samples[m_oldest]);
+        m_samples[m_oldest] = sample;
+        m_oldest = (m_oldest + 1) % m_window;
+    } else {
+        m_samples.push_back(sample);
+    }
+    if (root.is_none()) {
+        m_root.store(Some(Tree<T>(sample)));
+    } else {
+        m_root.store(Some(root->insert(sample)));
+    }
+}